@@ -0,0 +1,190 @@
+/*
+	This file is part of apfs-fuse, a read-only implementation of APFS
+	(Apple File System) for FUSE.
+	Copyright (C) 2017 Simon Gander
+
+	Apfs-fuse is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 2 of the License, or
+	(at your option) any later version.
+
+	Apfs-fuse is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with apfs-fuse.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <getopt.h>
+
+#include <cstdio>
+#include <iostream>
+#include <memory>
+#include <string>
+
+#include <ApfsLib/ApfsContainer.h>
+#include <ApfsLib/ApfsVolume.h>
+#include <ApfsLib/Device.h>
+#include <ApfsLib/GptPartitionMap.h>
+#include <ApfsLib/SnapshotDiff.h>
+
+// Writes one line per changed record: change, record type, object id and name or offset, separated by tabs.
+class DiffPrinter : public SnapshotDiff::Receiver
+{
+public:
+	DiffPrinter() : m_count(0) {}
+
+	bool Change(const SnapshotDiff::Record &rec) override
+	{
+		static const char change_chr[] = { '+', '-', 'M' };
+
+		printf("%c\t%s\t%llu\t", change_chr[rec.change], SnapshotDiff::TypeName(rec.type), static_cast<unsigned long long>(rec.obj_id));
+
+		if (rec.type == APFS_TYPE_DIR_REC || rec.type == APFS_TYPE_XATTR)
+			print_escaped(rec.name);
+		else if (rec.type == APFS_TYPE_FILE_EXTENT || rec.type == APFS_TYPE_SIBLING_LINK)
+			printf("%llu", static_cast<unsigned long long>(rec.offs));
+
+		putchar('\n');
+		m_count++;
+
+		return !ferror(stdout);
+	}
+
+	uint64_t count() const { return m_count; }
+
+private:
+	static void print_escaped(const std::string &str)
+	{
+		// Keeps one record per line whatever the name contains.
+		for (char c : str)
+		{
+			switch (c)
+			{
+			case '\t': fputs("\\t", stdout); break;
+			case '\n': fputs("\\n", stdout); break;
+			case '\\': fputs("\\\\", stdout); break;
+			default: putchar(c); break;
+			}
+		}
+	}
+
+	uint64_t m_count;
+};
+
+static void usage(const char *name)
+{
+	std::cerr << "Syntax: " << name << " [-v volume-id] [-r passphrase] <device> <old-xid> <new-xid>" << std::endl;
+	std::cerr << std::endl;
+	std::cerr << "Lists the records that differ between two snapshots of a volume. An xid of 0 stands for" << std::endl;
+	std::cerr << "the current state. Each line holds the change (+ added, - removed, M modified), the record" << std::endl;
+	std::cerr << "type, the object id and the name or offset, separated by tabs." << std::endl;
+	std::cerr << std::endl;
+	std::cerr << "-v volume-id   : Volume number (default 0)." << std::endl;
+	std::cerr << "-r passphrase  : Passphrase of an encrypted volume. Asked for if not specified." << std::endl;
+}
+
+int main(int argc, char *argv[])
+{
+	std::unique_ptr<Device> disk;
+	std::unique_ptr<ApfsContainer> container;
+	std::unique_ptr<ApfsVolume> vol_old;
+	std::unique_ptr<ApfsVolume> vol_new;
+	std::streambuf *cout_buf;
+	unsigned int vol_id = 0;
+	std::string passphrase;
+	xid_t xid_old;
+	xid_t xid_new;
+	uint64_t main_offset = 0;
+	uint64_t main_size;
+	int partition_id;
+	int opt;
+	bool ok;
+
+	g_debug = 0;
+
+	while ((opt = getopt(argc, argv, "v:r:")) != -1)
+	{
+		switch (opt)
+		{
+			case 'v':
+				vol_id = strtoul(optarg, nullptr, 10);
+				break;
+			case 'r':
+				passphrase = optarg;
+				break;
+			default:
+				usage(argv[0]);
+				return 1;
+		}
+	}
+
+	if ((argc - optind) != 3)
+	{
+		usage(argv[0]);
+		return 1;
+	}
+
+	xid_old = strtoull(argv[optind + 1], nullptr, 10);
+	xid_new = strtoull(argv[optind + 2], nullptr, 10);
+
+	disk.reset(Device::OpenDevice(argv[optind]));
+	if (!disk)
+	{
+		std::cerr << "Unable to open device " << argv[optind] << std::endl;
+		return 1;
+	}
+
+	main_size = disk->GetSize();
+
+	GptPartitionMap gpt;
+	if (gpt.LoadAndVerify(*disk))
+	{
+		partition_id = gpt.FindFirstAPFSPartition();
+		if (partition_id != -1)
+			gpt.GetPartitionOffsetAndSize(partition_id, main_offset, main_size);
+	}
+
+	// Messages and the passphrase prompt must not end up in the output.
+	cout_buf = std::cout.rdbuf(std::cerr.rdbuf());
+
+	container.reset(new ApfsContainer(disk.get(), main_offset, main_size));
+	if (container->Init())
+	{
+		vol_old.reset(container->GetVolume(vol_id, passphrase, xid_old));
+		if (vol_old)
+			vol_new.reset(container->GetVolume(vol_id, passphrase, xid_new));
+	}
+
+	std::cout.rdbuf(cout_buf);
+
+	if (!vol_old || !vol_new)
+	{
+		std::cerr << "Unable to get volume!" << std::endl;
+		vol_old.reset();
+		container.reset();
+		disk->Close();
+		return 1;
+	}
+
+	{
+		SnapshotDiff diff(*vol_old, *vol_new);
+		DiffPrinter printer;
+
+		ok = diff.Run(printer);
+		fflush(stdout);
+
+		const BTreeDiff::Stats &st = diff.GetStats();
+		std::cerr << printer.count() << " changes, " << st.nodes_read << " nodes read, " << st.subtrees_skipped << " shared subtrees skipped." << std::endl;
+	}
+
+	vol_new.reset();
+	vol_old.reset();
+	container.reset();
+	disk->Close();
+
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,653 @@
+/*
+	This file is part of apfs-fuse, a read-only implementation of APFS
+	(Apple File System) for FUSE.
+	Copyright (C) 2017 Simon Gander
+
+	Apfs-fuse is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 2 of the License, or
+	(at your option) any later version.
+
+	Apfs-fuse is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with apfs-fuse.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/xattr.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <ApfsLib/ApfsContainer.h>
+#include <ApfsLib/ApfsVolume.h>
+#include <ApfsLib/ApfsDir.h>
+#include <ApfsLib/Decmpfs.h>
+#include <ApfsLib/Device.h>
+#include <ApfsLib/GptPartitionMap.h>
+
+// Size of the pieces uncompressed files are read and written in.
+#define EXTRACT_CHUNK_SIZE 0x100000
+// Limits of the data read ahead of the writers.
+#define EXTRACT_QUEUE_BYTES (64 * 1024 * 1024)
+#define EXTRACT_QUEUE_ITEMS 256
+
+// Metadata restored after the contents are written.
+struct Meta
+{
+	std::string path;
+	uint64_t ino;
+	uint16_t mode;
+	uint32_t owner;
+	uint32_t group;
+	uint64_t access_time;
+	uint64_t mod_time;
+	std::vector<ApfsDir::XAttrRec> xattrs;
+};
+
+struct FileJob
+{
+	Meta meta;
+	uint64_t private_id;
+	uint64_t size;
+	paddr_t first_paddr; // Sort key, 0 for files without allocated extents. The resource fork for compressed files.
+	bool compressed;
+	int fd;
+	std::atomic<uint64_t> pending; // Work items not yet written
+};
+
+struct WorkItem
+{
+	FileJob *job;
+	uint64_t offs;
+	std::vector<uint8_t> data; // The resource fork of a compressed file, if it has one
+	std::vector<uint8_t> cmp;  // decmpfs xattr of a compressed file, empty if it couldn't be read
+};
+
+// Bounded queue between the reader and the writer threads.
+class WorkQueue
+{
+public:
+	WorkQueue() : m_bytes(0), m_closed(false) {}
+
+	void Push(WorkItem &&item)
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+
+		m_not_full.wait(lock, [this] { return m_items.size() < EXTRACT_QUEUE_ITEMS && m_bytes < EXTRACT_QUEUE_BYTES; });
+		m_bytes += item.data.size();
+		m_items.push_back(std::move(item));
+		m_not_empty.notify_one();
+	}
+
+	bool Pop(WorkItem &item)
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+
+		m_not_empty.wait(lock, [this] { return !m_items.empty() || m_closed; });
+		if (m_items.empty())
+			return false;
+		item = std::move(m_items.front());
+		m_items.pop_front();
+		m_bytes -= item.data.size();
+		m_not_full.notify_one();
+		return true;
+	}
+
+	void Close()
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+
+		m_closed = true;
+		m_not_empty.notify_all();
+	}
+
+private:
+	std::mutex m_mutex;
+	std::condition_variable m_not_empty;
+	std::condition_variable m_not_full;
+	std::deque<WorkItem> m_items;
+	size_t m_bytes;
+	bool m_closed;
+};
+
+static ApfsVolume *g_volume = nullptr;
+static std::atomic<int> g_errors(0);
+static bool g_set_owner = false;
+
+static void error(const std::string &path, const char *what)
+{
+	std::cerr << path << ": " << what;
+	if (errno)
+		std::cerr << " (" << strerror(errno) << ")";
+	std::cerr << std::endl;
+	g_errors++;
+}
+
+static bool is_internal_xattr(const ApfsDir::XAttrRec &xattr, bool compressed)
+{
+	if (xattr.name == SYMLINK_EA_NAME)
+		return true;
+	// Compression data is consumed by the extraction itself.
+	if (compressed && (xattr.name == "com.apple.decmpfs" || xattr.name == "com.apple.ResourceFork"))
+		return true;
+	return false;
+}
+
+static bool set_xattr(const std::string &path, const std::string &name, const std::vector<uint8_t> &data)
+{
+#ifdef __APPLE__
+	return setxattr(path.c_str(), name.c_str(), data.data(), data.size(), 0, XATTR_NOFOLLOW) == 0;
+#else
+	// Arbitrary names are only allowed in the user namespace.
+	return lsetxattr(path.c_str(), ("user." + name).c_str(), data.data(), data.size(), 0) == 0;
+#endif
+}
+
+static void restore_meta(ApfsDir &dir, const Meta &meta, bool compressed)
+{
+	constexpr uint64_t div_nsec = 1000000000;
+	std::vector<uint8_t> data;
+	struct timespec ts[2];
+	bool is_link = (meta.mode & MODE_S_IFMT) == MODE_S_IFLNK;
+
+	if (!is_link)
+	{
+		for (const ApfsDir::XAttrRec &xattr : meta.xattrs)
+		{
+			if (is_internal_xattr(xattr, compressed))
+				continue;
+
+			errno = 0;
+			if (!dir.GetAttribute(data, xattr))
+				error(meta.path, ("Unable to read xattr " + xattr.name).c_str());
+			else if (!set_xattr(meta.path, xattr.name, data))
+				error(meta.path, ("Unable to set xattr " + xattr.name).c_str());
+		}
+	}
+
+	errno = 0;
+	if (g_set_owner && lchown(meta.path.c_str(), meta.owner, meta.group) != 0)
+		error(meta.path, "Unable to set owner");
+	if (!is_link && chmod(meta.path.c_str(), meta.mode & 07777) != 0)
+		error(meta.path, "Unable to set mode");
+
+	ts[0].tv_sec = meta.access_time / div_nsec;
+	ts[0].tv_nsec = meta.access_time % div_nsec;
+	ts[1].tv_sec = meta.mod_time / div_nsec;
+	ts[1].tv_nsec = meta.mod_time % div_nsec;
+
+	if (utimensat(AT_FDCWD, meta.path.c_str(), ts, AT_SYMLINK_NOFOLLOW) != 0)
+		error(meta.path, "Unable to set times");
+}
+
+static bool is_zero(const uint8_t *data, size_t size)
+{
+	size_t k;
+
+	for (k = 0; k < size; k++)
+	{
+		if (data[k])
+			return false;
+	}
+
+	return true;
+}
+
+static void finish_job(ApfsDir &dir, FileJob *job)
+{
+	errno = 0;
+	if (close(job->fd) != 0)
+		error(job->meta.path, "Error closing file");
+	job->fd = -1;
+
+	restore_meta(dir, job->meta, job->compressed);
+}
+
+static void writer_thread(WorkQueue *queue)
+{
+	ApfsDir dir(*g_volume);
+	WorkItem item;
+	std::vector<uint8_t> data;
+	FileJob *job;
+
+	while (queue->Pop(item))
+	{
+		job = item.job;
+		errno = 0;
+
+		if (job->compressed)
+		{
+			// The reader already fetched the compressed data, and reported it if that failed.
+			if (!item.cmp.empty())
+			{
+				if (!DecompressData(data, item.cmp, item.data))
+					error(job->meta.path, "Unable to decompress");
+				else if (ftruncate(job->fd, data.size()) != 0 || pwrite(job->fd, data.data(), data.size(), 0) != static_cast<ssize_t>(data.size()))
+					error(job->meta.path, "Write error");
+			}
+		}
+		else if (!item.data.empty() && !is_zero(item.data.data(), item.data.size()))
+		{
+			// Zero chunks are left as holes, the file already has its full size.
+			if (pwrite(job->fd, item.data.data(), item.data.size(), item.offs) != static_cast<ssize_t>(item.data.size()))
+				error(job->meta.path, "Write error");
+		}
+
+		if (--job->pending == 0)
+			finish_job(dir, job);
+	}
+}
+
+static void fill_meta(Meta &meta, const std::string &path, const ApfsDir::RecordGroup &grp)
+{
+	meta.path = path;
+	meta.ino = grp.inode.obj_id;
+	meta.mode = grp.inode.mode;
+	meta.owner = grp.inode.owner;
+	meta.group = grp.inode.group;
+	meta.access_time = grp.inode.access_time;
+	meta.mod_time = grp.inode.mod_time;
+	meta.xattrs = grp.xattrs;
+}
+
+struct Walker
+{
+	std::vector<std::unique_ptr<FileJob>> files;
+	std::vector<Meta> dirs;     // Parents before children
+	std::vector<Meta> others;   // Symlinks and special files
+	std::vector<std::pair<std::string, std::string>> hardlinks; // Existing path, new path
+	std::map<uint64_t, std::string> link_paths;
+};
+
+// Creates the directory tree and collects the files. Contents are extracted later, sorted by physical address.
+static void walk(ApfsDir &dir, Walker &w, uint64_t ino, const std::string &path)
+{
+	ApfsDir::RecordGroup grp;
+	std::vector<ApfsDir::DirRec> entries;
+	std::vector<ApfsDir::Extent> extents;
+	std::vector<uint8_t> target;
+	uint16_t type;
+
+	errno = 0;
+	if (!dir.GetRecordGroup(grp, ino, true))
+	{
+		error(path, "Unable to read inode");
+		return;
+	}
+
+	type = grp.inode.mode & MODE_S_IFMT;
+
+	if (type != MODE_S_IFDIR && grp.inode.nchildren_nlink > 1)
+	{
+		auto it = w.link_paths.find(ino);
+
+		if (it != w.link_paths.end())
+		{
+			w.hardlinks.emplace_back(it->second, path);
+			return;
+		}
+
+		w.link_paths[ino] = path;
+	}
+
+	if (type == MODE_S_IFDIR)
+	{
+		if (mkdir(path.c_str(), 0700) != 0 && errno != EEXIST)
+		{
+			error(path, "Unable to create directory");
+			return;
+		}
+
+		w.dirs.emplace_back();
+		fill_meta(w.dirs.back(), path, grp);
+
+		if (!dir.ListDirectory(entries, ino))
+		{
+			error(path, "Unable to list directory");
+			return;
+		}
+
+		for (const ApfsDir::DirRec &e : entries)
+			walk(dir, w, e.file_id, path + "/" + e.name);
+	}
+	else if (type == MODE_S_IFREG)
+	{
+		std::unique_ptr<FileJob> job(new FileJob());
+
+		fill_meta(job->meta, path, grp);
+		job->private_id = grp.inode.private_id;
+		job->size = grp.inode.ds_size;
+		job->compressed = (grp.inode.bsd_flags & APFS_UF_COMPRESSED) != 0;
+		job->first_paddr = 0;
+		job->fd = -1;
+		job->pending = 0;
+
+		// Compressed files are read from the resource fork, so that is where they sort.
+		const ApfsDir::XAttrRec *rsrc = job->compressed ? grp.FindAttribute("com.apple.ResourceFork") : nullptr;
+
+		if (rsrc && (rsrc->attr.flags & XATTR_DATA_STREAM))
+		{
+			if (!dir.ListExtents(extents, rsrc->attr.xstrm.xattr_obj_id))
+				extents.clear();
+		}
+		else
+		{
+			extents.swap(grp.extents);
+		}
+
+		for (const ApfsDir::Extent &ext : extents)
+		{
+			if (ext.phys_block_num != 0)
+			{
+				job->first_paddr = ext.phys_block_num;
+				break;
+			}
+		}
+
+		w.files.push_back(std::move(job));
+	}
+	else if (type == MODE_S_IFLNK)
+	{
+		const ApfsDir::XAttrRec *xa = grp.FindAttribute(SYMLINK_EA_NAME);
+
+		if (!xa || !dir.GetAttribute(target, *xa) || target.empty())
+		{
+			error(path, "Unable to read symlink");
+			return;
+		}
+
+		target.push_back(0);
+		if (symlink(reinterpret_cast<const char *>(target.data()), path.c_str()) != 0)
+		{
+			error(path, "Unable to create symlink");
+			return;
+		}
+
+		w.others.emplace_back();
+		fill_meta(w.others.back(), path, grp);
+	}
+	else if (type == MODE_S_IFIFO)
+	{
+		if (mkfifo(path.c_str(), 0600) != 0)
+		{
+			error(path, "Unable to create fifo");
+			return;
+		}
+
+		w.others.emplace_back();
+		fill_meta(w.others.back(), path, grp);
+	}
+	else
+	{
+		std::cerr << path << ": Skipping special file" << std::endl;
+	}
+}
+
+// Reads the decmpfs xattr and the resource fork it refers to, the writer decompresses them.
+static WorkItem read_compressed(ApfsDir &dir, FileJob *job)
+{
+	WorkItem item = { job, 0, std::vector<uint8_t>(), std::vector<uint8_t>() };
+	const ApfsDir::XAttrRec *cmp_xa = nullptr;
+	const ApfsDir::XAttrRec *rsrc_xa = nullptr;
+	const CompressionHeader *hdr;
+
+	for (const ApfsDir::XAttrRec &x : job->meta.xattrs)
+	{
+		if (x.name == "com.apple.decmpfs")
+			cmp_xa = &x;
+		else if (x.name == "com.apple.ResourceFork")
+			rsrc_xa = &x;
+	}
+
+	if (!cmp_xa || !dir.GetAttribute(item.cmp, *cmp_xa) || item.cmp.size() < sizeof(CompressionHeader))
+	{
+		error(job->meta.path, "Unable to read compression header");
+		item.cmp.clear();
+		return item;
+	}
+
+	hdr = reinterpret_cast<const CompressionHeader *>(item.cmp.data());
+
+	if (IsDecompAlgoInRsrc(hdr->algo) && (!rsrc_xa || !dir.GetAttribute(item.data, *rsrc_xa)))
+	{
+		error(job->meta.path, "Unable to read resource fork");
+		item.cmp.clear();
+		item.data.clear();
+	}
+
+	return item;
+}
+
+// Reads the files in physical order and hands the data to the writers.
+static void read_files(Walker &w, WorkQueue &queue)
+{
+	ApfsDir dir(*g_volume);
+	uint64_t offs;
+	size_t size;
+
+	std::stable_sort(w.files.begin(), w.files.end(), [](const std::unique_ptr<FileJob> &a, const std::unique_ptr<FileJob> &b) { return a->first_paddr < b->first_paddr; });
+
+	for (auto &p : w.files)
+	{
+		FileJob *job = p.get();
+
+		errno = 0;
+		job->fd = open(job->meta.path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+		if (job->fd < 0)
+		{
+			error(job->meta.path, "Unable to create file");
+			continue;
+		}
+
+		if (job->compressed)
+		{
+			job->pending = 1;
+			queue.Push(read_compressed(dir, job));
+			continue;
+		}
+
+		if (ftruncate(job->fd, job->size) != 0)
+			error(job->meta.path, "Unable to set size");
+
+		job->pending = std::max<uint64_t>((job->size + EXTRACT_CHUNK_SIZE - 1) / EXTRACT_CHUNK_SIZE, 1);
+
+		offs = 0;
+		do
+		{
+			size = static_cast<size_t>(std::min<uint64_t>(job->size - offs, EXTRACT_CHUNK_SIZE));
+
+			WorkItem item = { job, offs, std::vector<uint8_t>(size), std::vector<uint8_t>() };
+
+			if (size > 0 && !dir.ReadFile(item.data.data(), job->private_id, offs, size))
+			{
+				error(job->meta.path, "Read error");
+				item.data.clear();
+			}
+
+			queue.Push(std::move(item));
+			offs += size;
+		} while (offs < job->size);
+	}
+}
+
+static void usage(const char *name)
+{
+	std::cout << "Syntax: " << name << " [-v volume-id] [-r passphrase] [-s snapshot-xid] [-j threads] [-o] <device> <path> <target-dir>" << std::endl;
+	std::cout << std::endl;
+	std::cout << "Copies <path> of the volume with all contents to <target-dir>. Extended attributes," << std::endl;
+	std::cout << "symlinks, hardlinks, modes and timestamps are preserved." << std::endl;
+	std::cout << std::endl;
+	std::cout << "-v volume-id   : Volume number (default 0)." << std::endl;
+	std::cout << "-r passphrase  : Passphrase of an encrypted volume. Asked for if not specified." << std::endl;
+	std::cout << "-s xid         : Extract a snapshot." << std::endl;
+	std::cout << "-j threads     : Number of writer threads (default: number of CPUs)." << std::endl;
+	std::cout << "-o             : Also restore owner and group." << std::endl;
+}
+
+int main(int argc, char *argv[])
+{
+	std::unique_ptr<Device> disk;
+	std::unique_ptr<ApfsContainer> container;
+	unsigned int vol_id = 0;
+	std::string passphrase;
+	xid_t snap_xid = 0;
+	unsigned int threads = std::thread::hardware_concurrency();
+	uint64_t main_offset = 0;
+	uint64_t main_size;
+	uint64_t ino;
+	int partition_id;
+	int opt;
+
+	g_debug = 0;
+
+	while ((opt = getopt(argc, argv, "v:r:s:j:o")) != -1)
+	{
+		switch (opt)
+		{
+			case 'v':
+				vol_id = strtoul(optarg, nullptr, 10);
+				break;
+			case 'r':
+				passphrase = optarg;
+				break;
+			case 's':
+				snap_xid = strtoull(optarg, nullptr, 10);
+				break;
+			case 'j':
+				threads = strtoul(optarg, nullptr, 10);
+				break;
+			case 'o':
+				g_set_owner = true;
+				break;
+			default:
+				usage(argv[0]);
+				return 1;
+		}
+	}
+
+	if ((argc - optind) != 3)
+	{
+		usage(argv[0]);
+		return 1;
+	}
+
+	if (threads == 0)
+		threads = 1;
+
+	disk.reset(Device::OpenDevice(argv[optind]));
+	if (!disk)
+	{
+		std::cerr << "Unable to open device " << argv[optind] << std::endl;
+		return 1;
+	}
+
+	main_size = disk->GetSize();
+
+	GptPartitionMap gpt;
+	if (gpt.LoadAndVerify(*disk))
+	{
+		partition_id = gpt.FindFirstAPFSPartition();
+		if (partition_id != -1)
+			gpt.GetPartitionOffsetAndSize(partition_id, main_offset, main_size);
+	}
+
+	container.reset(new ApfsContainer(disk.get(), main_offset, main_size));
+	if (!container->Init())
+	{
+		std::cerr << "Unable to load container." << std::endl;
+		container.reset();
+		disk->Close();
+		return 1;
+	}
+
+	g_volume = container->GetVolume(vol_id, passphrase, snap_xid);
+	if (!g_volume)
+	{
+		std::cerr << "Unable to get volume!" << std::endl;
+		container.reset();
+		disk->Close();
+		return 1;
+	}
+
+	{
+		ApfsDir dir(*g_volume);
+		Walker w;
+		WorkQueue queue;
+		std::vector<std::thread> writers;
+		std::string target = argv[optind + 2];
+		size_t k;
+
+		if (!dir.LookupPath(ino, argv[optind + 1]))
+		{
+			std::cerr << "Path not found: " << argv[optind + 1] << std::endl;
+			g_errors++;
+		}
+		else
+		{
+			ApfsDir::InodeStat root;
+
+			// A single file is extracted into the target directory.
+			if (dir.GetInodeStat(root, ino) && (root.mode & MODE_S_IFMT) != MODE_S_IFDIR)
+			{
+				const char *name = strrchr(argv[optind + 1], '/');
+				mkdir(target.c_str(), 0755);
+				target += "/";
+				target += name ? name + 1 : argv[optind + 1];
+			}
+
+			walk(dir, w, ino, target);
+
+			for (k = 0; k < threads; k++)
+				writers.emplace_back(writer_thread, &queue);
+
+			read_files(w, queue);
+
+			queue.Close();
+			for (std::thread &t : writers)
+				t.join();
+
+			for (const auto &l : w.hardlinks)
+			{
+				errno = 0;
+				if (link(l.first.c_str(), l.second.c_str()) != 0)
+					error(l.second, "Unable to create hardlink");
+			}
+
+			for (const Meta &m : w.others)
+				restore_meta(dir, m, false);
+
+			// Children first, so creating entries doesn't change the restored times.
+			for (k = w.dirs.size(); k > 0; k--)
+				restore_meta(dir, w.dirs[k - 1], false);
+
+			std::cout << w.files.size() << " files, " << w.dirs.size() << " directories, " << w.others.size() << " other, ";
+			std::cout << w.hardlinks.size() << " hardlinks extracted, " << g_errors << " errors." << std::endl;
+		}
+	}
+
+	delete g_volume;
+	container.reset();
+	disk->Close();
+
+	return g_errors ? 1 : 0;
+}
@@ -281,30 +281,53 @@ bool ApfsContainer::GetVolumeInfo(unsigned int fsid, apfs_superblock_t& apsb)
 bool ApfsContainer::ReadBlocks(uint8_t * data, paddr_t paddr, uint64_t blkcnt) const
 {
 	uint64_t offs;
-	uint64_t size;
+	bool tier2;
+	Device *dev;
 
 	//if ((paddr + blkcnt) > m_nx.nx_block_count)
 	//	return false;
 
-	offs = m_nx.nx_block_size * paddr;
-	size = m_nx.nx_block_size * blkcnt;
+	offs = GetDeviceOffset(paddr, tier2);
+	dev = tier2 ? m_tier2_disk : m_main_disk;
 
-	if (offs & FUSION_TIER2_DEVICE_BYTE_ADDR)
-	{
-		if (!m_tier2_disk)
-			return false;
+	if (!dev)
+		return false;
 
-		offs = offs - FUSION_TIER2_DEVICE_BYTE_ADDR + m_tier2_part_start;
-		return m_tier2_disk->Read(data, offs, size);
-	}
+	return dev->Read(data, offs, m_nx.nx_block_size * blkcnt);
+}
+
+uint64_t ApfsContainer::GetDeviceOffset(paddr_t paddr, bool &tier2) const
+{
+	uint64_t offs = m_nx.nx_block_size * paddr;
+
+	tier2 = (offs & FUSION_TIER2_DEVICE_BYTE_ADDR) != 0;
+
+	if (tier2)
+		return offs - FUSION_TIER2_DEVICE_BYTE_ADDR + m_tier2_part_start;
 	else
-	{
-		if (!m_main_disk)
-			return false;
+		return offs + m_main_part_start;
+}
 
-		offs = offs + m_main_part_start;
-		return m_main_disk->Read(data, offs, size);
-	}
+bool ApfsContainer::IsDeviceLinear(bool tier2) const
+{
+	const Device *dev = tier2 ? m_tier2_disk : m_main_disk;
+
+	return dev && dev->IsLinear();
+}
+
+const uint8_t *ApfsContainer::MapBlocks(paddr_t paddr, uint64_t blkcnt) const
+{
+	uint64_t offs;
+	bool tier2;
+	Device *dev;
+
+	offs = GetDeviceOffset(paddr, tier2);
+	dev = tier2 ? m_tier2_disk : m_main_disk;
+
+	if (!dev)
+		return nullptr;
+
+	return dev->Map(offs, m_nx.nx_block_size * blkcnt);
 }
 
 bool ApfsContainer::ReadAndVerifyHeaderBlock(uint8_t * data, paddr_t paddr) const
@@ -47,9 +47,16 @@ public:
 
 	bool ReadBlocks(uint8_t *data, paddr_t paddr, uint64_t blkcnt = 1) const;
 	bool ReadAndVerifyHeaderBlock(uint8_t *data, paddr_t paddr) const;
+	// Direct view of the blocks if the device is memory mapped, nullptr otherwise.
+	const uint8_t *MapBlocks(paddr_t paddr, uint64_t blkcnt = 1) const;
+	// Byte offset of a block on the device holding it, tier2 is set if that is the fusion tier2 device.
+	uint64_t GetDeviceOffset(paddr_t paddr, bool &tier2) const;
+	// Whether offsets from GetDeviceOffset are positions in the underlying file, see Device::IsLinear.
+	bool IsDeviceLinear(bool tier2) const;
 
 	uint32_t GetBlocksize() const { return m_nx.nx_block_size; }
 	uint64_t GetBlockCount() const { return m_nx.nx_block_count; }
+	const nx_superblock_t &GetSuperblock() const { return m_nx; }
 	uint64_t GetFreeBlocks() const { return m_sm->sm_dev[SD_MAIN].sm_free_count + m_sm->sm_dev[SD_TIER2].sm_free_count; }
 
 	bool GetVolumeKey(uint8_t *key, const apfs_uuid_t &vol_uuid, const char *password = nullptr);
@@ -163,6 +163,25 @@ ApfsDir::DirRec::DirRec(const ApfsDir::DirRec& o)
 	has_sibling_id = o.has_sibling_id;
 }
 
+ApfsDir::XAttr::XAttr()
+{
+	flags = 0;
+	xdata_len = 0;
+	memset(&xstrm, 0, sizeof(xstrm));
+}
+
+ApfsDir::XAttr::XAttr(const ApfsDir::XAttr& o)
+{
+	flags = o.flags;
+	xdata_len = o.xdata_len;
+	xstrm = o.xstrm;
+}
+
+uint64_t ApfsDir::XAttr::size() const
+{
+	return (flags & XATTR_DATA_STREAM) ? static_cast<uint64_t>(xstrm.dstream.size) : xdata_len;
+}
+
 ApfsDir::ApfsDir(ApfsVolume &vol) :
 	m_vol(vol),
 	m_fs_tree(vol.fstree())
@@ -194,8 +213,14 @@ bool ApfsDir::GetInode(ApfsDir::Inode& res, uint64_t inode)
 	if (!rc || (bte.val == nullptr))
 		return false;
 
-	// const uint8_t *idata = reinterpret_cast<const uint8_t *>(bte.val);
-	const j_inode_val_t *obj = reinterpret_cast<const j_inode_val_t *>(bte.val);
+	ParseInode(res, inode, bte.val, bte.val_len);
+
+	return true;
+}
+
+void ApfsDir::ParseInode(Inode &res, uint64_t inode, const void *val, size_t val_len)
+{
+	const j_inode_val_t *obj = reinterpret_cast<const j_inode_val_t *>(val);
 
 	res.obj_id = inode;
 
@@ -220,7 +245,7 @@ bool ApfsDir::GetInode(ApfsDir::Inode& res, uint64_t inode)
 
 	// internal_flags & 0x00200000 => pad2 = uncompressed_size ?
 
-	if (bte.val_len > sizeof(j_inode_val_t))
+	if (val_len > sizeof(j_inode_val_t))
 	{
 		const xf_blob_t *xf_hdr = reinterpret_cast<const xf_blob_t *>(obj->xfields);
 		const x_field_t *xf = reinterpret_cast<const x_field_t *>(xf_hdr->xf_data);
@@ -283,6 +308,11 @@ bool ApfsDir::GetInode(ApfsDir::Inode& res, uint64_t inode)
 				res.sparse_bytes = bswap_le(*reinterpret_cast<const uint64_t *>(xdata));
 				res.optional_present_flags |= Inode::INO_HAS_SPARSE_BYTES;
 				break;
+			case INO_EXT_TYPE_RDEV:
+				assert(xf[n].x_size == sizeof(uint32_t));
+				res.rdev = bswap_le(*reinterpret_cast<const uint32_t *>(xdata));
+				res.optional_present_flags |= Inode::INO_HAS_RDEV;
+				break;
 			default:
 				std::cerr << "Warning: Unknown XF " << xf[n].x_type << " at inode " << inode << std::endl;
 				break;
@@ -291,11 +321,223 @@ bool ApfsDir::GetInode(ApfsDir::Inode& res, uint64_t inode)
 			xdata += ((xf[n].x_size + 7) & ~7);
 		}
 	}
+}
+
+bool ApfsDir::GetInodeStat(InodeStat &res, uint64_t inode)
+{
+	BTreeEntry bte;
+	j_inode_key_t key;
+	bool rc;
+
+	key.hdr.obj_id_and_type = APFS_TYPE_ID(APFS_TYPE_INODE, inode);
+
+	rc = m_fs_tree.Lookup(bte, &key, sizeof(j_inode_key_t), CompareStdDirKey, this, true);
+
+	if (!rc || (bte.val == nullptr))
+		return false;
+
+	ParseInodeStat(res, inode, bte.val, bte.val_len);
 
 	return true;
 }
 
-bool ApfsDir::ListDirectory(std::vector<DirRec> &dir, uint64_t inode)
+void ApfsDir::ParseInodeStat(InodeStat &res, uint64_t inode, const void *val, size_t val_len)
+{
+	const j_inode_val_t *obj = reinterpret_cast<const j_inode_val_t *>(val);
+
+	memset(&res, 0, sizeof(res));
+
+	res.obj_id = inode;
+
+	res.parent_id = obj->parent_id;
+	res.private_id = obj->private_id;
+
+	res.create_time = obj->create_time;
+	res.mod_time = obj->mod_time;
+	res.change_time = obj->change_time;
+	res.access_time = obj->access_time;
+
+	res.nchildren_nlink = obj->nchildren;
+
+	res.bsd_flags = obj->bsd_flags;
+	res.owner = obj->owner;
+	res.group = obj->group;
+	res.mode = obj->mode;
+
+	if (val_len > sizeof(j_inode_val_t))
+	{
+		const xf_blob_t *xf_hdr = reinterpret_cast<const xf_blob_t *>(obj->xfields);
+		const x_field_t *xf = reinterpret_cast<const x_field_t *>(xf_hdr->xf_data);
+		const uint8_t *xdata = obj->xfields + sizeof(xf_blob_t) + xf_hdr->xf_num_exts * sizeof(x_field_t);
+		uint16_t n;
+
+		// Skip over everything else, the name in particular.
+		for (n = 0; n < xf_hdr->xf_num_exts; n++)
+		{
+			if (xf[n].x_type == INO_EXT_TYPE_DSTREAM)
+			{
+				assert(xf[n].x_size == sizeof(j_dstream_t));
+				const j_dstream_t *ds = reinterpret_cast<const j_dstream_t *>(xdata);
+				res.ds_size = ds->size;
+				res.ds_alloced_size = ds->alloced_size;
+				res.optional_present_flags |= Inode::INO_HAS_DSTREAM;
+			}
+			else if (xf[n].x_type == INO_EXT_TYPE_RDEV)
+			{
+				assert(xf[n].x_size == sizeof(uint32_t));
+				res.rdev = bswap_le(*reinterpret_cast<const uint32_t *>(xdata));
+				res.optional_present_flags |= Inode::INO_HAS_RDEV;
+			}
+
+			xdata += ((xf[n].x_size + 7) & ~7);
+		}
+	}
+}
+
+bool ApfsDir::GetRecordGroup(RecordGroup &res, uint64_t inode, bool with_extents)
+{
+	j_inode_key_t skey;
+	BTreeIterator it;
+	BTreeEntry e;
+	const j_key_t *k;
+	uint64_t type;
+	bool has_inode = false;
+	bool ext_in_range = false;
+	bool rc;
+
+	res.inode = Inode();
+	res.xattrs.clear();
+	res.extents.clear();
+
+	skey.hdr.obj_id_and_type = APFS_TYPE_ID(APFS_TYPE_INODE, inode);
+
+	rc = m_fs_tree.GetIterator(it, &skey, sizeof(j_inode_key_t), CompareStdDirKey, this);
+	if (!rc)
+		return false;
+
+	// Records of one object are sorted by type: inode, xattrs, ..., file extents, dir records.
+	for (;;)
+	{
+		rc = it.GetEntry(e);
+		if (!rc)
+			break;
+
+		k = reinterpret_cast<const j_key_t *>(e.key);
+
+		if ((k->obj_id_and_type & OBJ_ID_MASK) != inode)
+			break;
+
+		type = k->obj_id_and_type >> OBJ_TYPE_SHIFT;
+
+		if (type == APFS_TYPE_INODE)
+		{
+			ParseInode(res.inode, inode, e.val, e.val_len);
+			has_inode = true;
+			// The extents are only in this range if the data stream belongs to this inode.
+			ext_in_range = with_extents && !m_vol.isSealed() && res.inode.private_id == inode;
+		}
+		else if (type == APFS_TYPE_XATTR)
+		{
+			res.xattrs.emplace_back();
+			ParseXAttr(res.xattrs.back(), e.key, e.val);
+		}
+		else if (type == APFS_TYPE_FILE_EXTENT && ext_in_range)
+		{
+			res.extents.emplace_back();
+			DecodeExtent(res.extents.back(), e, inode);
+		}
+		else if (type > (ext_in_range ? APFS_TYPE_FILE_EXTENT : APFS_TYPE_XATTR))
+			break;
+
+		it.next();
+	}
+
+	if (!has_inode)
+		return false;
+
+	if (with_extents && !ext_in_range)
+		return ListExtents(res.extents, res.inode.private_id);
+
+	return true;
+}
+
+const ApfsDir::XAttrRec *ApfsDir::RecordGroup::FindAttribute(const char *name) const
+{
+	for (const XAttrRec &x : xattrs)
+	{
+		if (x.name == name)
+			return &x;
+	}
+
+	return nullptr;
+}
+
+bool ApfsDir::GetStatGroup(StatGroup &res, uint64_t inode)
+{
+	j_inode_key_t skey;
+	BTreeIterator it;
+	BTreeEntry e;
+	const j_key_t *k;
+	uint64_t type;
+	bool has_inode = false;
+	bool rc;
+
+	res.xattrs.clear();
+
+	skey.hdr.obj_id_and_type = APFS_TYPE_ID(APFS_TYPE_INODE, inode);
+
+	rc = m_fs_tree.GetIterator(it, &skey, sizeof(j_inode_key_t), CompareStdDirKey, this);
+	if (!rc)
+		return false;
+
+	// The inode comes first, so the xattrs of an uncompressed file are never visited.
+	for (;;)
+	{
+		rc = it.GetEntry(e);
+		if (!rc)
+			break;
+
+		k = reinterpret_cast<const j_key_t *>(e.key);
+
+		if ((k->obj_id_and_type & OBJ_ID_MASK) != inode)
+			break;
+
+		type = k->obj_id_and_type >> OBJ_TYPE_SHIFT;
+
+		if (type == APFS_TYPE_INODE)
+		{
+			ParseInodeStat(res.inode, inode, e.val, e.val_len);
+			has_inode = true;
+
+			if (!(res.inode.bsd_flags & APFS_UF_COMPRESSED))
+				break;
+		}
+		else if (type == APFS_TYPE_XATTR)
+		{
+			res.xattrs.emplace_back();
+			ParseXAttr(res.xattrs.back(), e.key, e.val);
+		}
+		else if (type > APFS_TYPE_XATTR)
+			break;
+
+		it.next();
+	}
+
+	return has_inode;
+}
+
+const ApfsDir::XAttrRec *ApfsDir::StatGroup::FindAttribute(const char *name) const
+{
+	for (const XAttrRec &x : xattrs)
+	{
+		if (x.name == name)
+			return &x;
+	}
+
+	return nullptr;
+}
+
+bool ApfsDir::VisitDirectory(uint64_t inode, DirVisitor visit, void *context)
 {
 	uint8_t skey_buf[0x500];
 
@@ -306,11 +548,11 @@ bool ApfsDir::ListDirectory(std::vector<DirRec> &dir, uint64_t inode)
 
 	const j_key_t *k;
 	const j_drec_val_t *v;
+	const uint8_t *name;
+	size_t name_len;
 
 	skey = APFS_TYPE_ID(APFS_TYPE_DIR_REC, inode);
 
-	dir.clear();
-
 	if (m_txt_fmt & 9)
 	{
 		j_drec_hashed_key_t *key = reinterpret_cast<j_drec_hashed_key_t *>(skey_buf);
@@ -335,7 +577,7 @@ bool ApfsDir::ListDirectory(std::vector<DirRec> &dir, uint64_t inode)
 
 	for (;;)
 	{
-		DirRec e;
+		DirEntryView e;
 
 		rc = it.GetEntry(bte);
 		if (!rc)
@@ -358,15 +600,19 @@ bool ApfsDir::ListDirectory(std::vector<DirRec> &dir, uint64_t inode)
 		{
 			const j_drec_hashed_key_t *hk = reinterpret_cast<const j_drec_hashed_key_t *>(bte.key);
 			e.hash = hk->name_len_and_hash;
-			e.name = reinterpret_cast<const char *>(hk->name);
+			name = hk->name;
+			name_len = bte.key_len > sizeof(j_drec_hashed_key_t) ? std::min<size_t>(hk->name_len_and_hash & J_DREC_LEN_MASK, bte.key_len - sizeof(j_drec_hashed_key_t)) : 0;
 		}
 		else
 		{
 			const j_drec_key_t *rk = reinterpret_cast<const j_drec_key_t *>(bte.key);
 			e.hash = 0;
-			e.name = reinterpret_cast<const char *>(rk->name);
+			name = rk->name;
+			name_len = bte.key_len > sizeof(j_drec_key_t) ? std::min<size_t>(rk->name_len, bte.key_len - sizeof(j_drec_key_t)) : 0;
 		}
 
+		e.name = std::string_view(reinterpret_cast<const char *>(name), strnlen(reinterpret_cast<const char *>(name), name_len));
+
 		// assert(res.val_len == sizeof(APFS_Name));
 
 		v = reinterpret_cast<const j_drec_val_t *>(bte.val);
@@ -374,6 +620,8 @@ bool ApfsDir::ListDirectory(std::vector<DirRec> &dir, uint64_t inode)
 		e.file_id = v->file_id;
 		e.date_added = v->date_added;
 		e.flags = v->flags;
+		e.sibling_id = 0;
+		e.has_sibling_id = false;
 
 		if (bte.val_len > sizeof(j_drec_val_t))
 		{
@@ -400,7 +648,8 @@ bool ApfsDir::ListDirectory(std::vector<DirRec> &dir, uint64_t inode)
 			}
 		}
 
-		dir.push_back(e);
+		if (!visit(e, context))
+			break;
 
 		it.next();
 	}
@@ -408,13 +657,41 @@ bool ApfsDir::ListDirectory(std::vector<DirRec> &dir, uint64_t inode)
 	return true;
 }
 
-bool ApfsDir::LookupName(ApfsDir::DirRec& res, uint64_t parent_id, const char* name)
+static bool AddDirRec(const ApfsDir::DirEntryView &e, void *context)
+{
+	std::vector<ApfsDir::DirRec> &dir = *reinterpret_cast<std::vector<ApfsDir::DirRec> *>(context);
+	ApfsDir::DirRec r;
+
+	r.parent_id = e.parent_id;
+	r.hash = e.hash;
+	r.name.assign(e.name);
+	r.file_id = e.file_id;
+	r.date_added = e.date_added;
+	r.sibling_id = e.sibling_id;
+	r.flags = e.flags;
+	r.has_sibling_id = e.has_sibling_id;
+
+	dir.push_back(r);
+	return true;
+}
+
+bool ApfsDir::ListDirectory(std::vector<DirRec> &dir, uint64_t inode)
+{
+	dir.clear();
+
+	return VisitDirectory(inode, AddDirRec, &dir);
+}
+
+bool ApfsDir::LookupName(ApfsDir::DirRec& res, uint64_t parent_id, const char* name, bool *not_found)
 {
 	bool rc;
 	BTreeEntry e;
 	uint8_t srch_key_buf[0x500];
 	size_t name_len = strlen(name) + 1;
 
+	if (not_found)
+		*not_found = name_len > 0x400;
+
 	if (name_len > 0x400)
 		return false;
 
@@ -435,7 +712,7 @@ bool ApfsDir::LookupName(ApfsDir::DirRec& res, uint64_t parent_id, const char* n
 		}
 		res.hash = skey->name_len_and_hash;
 
-		rc = m_fs_tree.Lookup(e, skey, sizeof(j_drec_hashed_key_t) + (skey->name_len_and_hash & J_DREC_LEN_MASK), CompareStdDirKey, this, true);
+		rc = m_fs_tree.Lookup(e, skey, sizeof(j_drec_hashed_key_t) + (skey->name_len_and_hash & J_DREC_LEN_MASK), CompareStdDirKey, this, true, not_found);
 	}
 	else
 	{
@@ -450,7 +727,7 @@ bool ApfsDir::LookupName(ApfsDir::DirRec& res, uint64_t parent_id, const char* n
 		}
 		res.hash = 0;
 
-		rc = m_fs_tree.Lookup(e, skey, sizeof(j_drec_key_t) + skey->name_len, CompareStdDirKey, this, true);
+		rc = m_fs_tree.Lookup(e, skey, sizeof(j_drec_key_t) + skey->name_len, CompareStdDirKey, this, true, not_found);
 	}
 
 	if (!rc)
@@ -473,22 +750,70 @@ bool ApfsDir::LookupName(ApfsDir::DirRec& res, uint64_t parent_id, const char* n
 	return true;
 }
 
+bool ApfsDir::LookupPath(uint64_t &inode, const char *path)
+{
+	DirRec rec;
+	std::string name;
+	const char *e;
+
+	inode = ROOT_DIR_INO_NUM;
+
+	while (*path)
+	{
+		e = strchr(path, '/');
+		if (!e)
+			e = path + strlen(path);
+
+		name.assign(path, e);
+		path = *e ? e + 1 : e;
+
+		if (name.empty())
+			continue;
+
+		if (!LookupName(rec, inode, name.c_str()))
+			return false;
+
+		inode = rec.file_id;
+	}
+
+	return true;
+}
+
 bool ApfsDir::ReadFile(void* data, uint64_t inode, uint64_t offs, size_t size)
+{
+	std::vector<ReadRun> runs;
+	uint8_t *bdata = reinterpret_cast<uint8_t *>(data);
+
+	if (!PlanRead(runs, inode, offs, size))
+		return false;
+
+	for (const ReadRun &run : runs)
+	{
+		if (!ExecuteRead(bdata + run.offs, run))
+			return false;
+	}
+
+	return true;
+}
+
+bool ApfsDir::PlanRead(std::vector<ReadRun> &runs, uint64_t inode, uint64_t offs, size_t size)
 {
 	BTreeEntry e;
 	bool rc;
 
-	uint8_t *bdata = reinterpret_cast<uint8_t *>(data);
-
-	size_t cur_size;
+	ReadRun cur;
+	uint64_t out_offs = 0;
+	uint64_t cur_size;
 	uint64_t blk_idx;
-	uint64_t blk_offs;
+	uint64_t run_end;
 
 	uint64_t extent_size;
 	uint64_t extent_offs;
 	paddr_t extent_paddr;
 	uint64_t extent_crypto_id;
 
+	runs.clear();
+
 	while (size > 0)
 	{
 		if (m_vol.isSealed()) {
@@ -546,9 +871,6 @@ bool ApfsDir::ReadFile(void* data, uint64_t inode, uint64_t offs, size_t size)
 			extent_crypto_id = ext_val->crypto_id;
 		}
 
-		blk_idx = extent_offs >> m_blksize_sh;
-		blk_offs = extent_offs & m_blksize_mask_lo;
-
 		cur_size = size;
 
 		if ((extent_offs + cur_size) > extent_size)
@@ -557,50 +879,116 @@ bool ApfsDir::ReadFile(void* data, uint64_t inode, uint64_t offs, size_t size)
 		if (cur_size == 0)
 			break;
 
-		if (extent_paddr != 0)
-		{
-			if (blk_offs == 0 && cur_size > m_blksize)
-				cur_size &= m_blksize_mask_hi;
+		blk_idx = extent_offs >> m_blksize_sh;
 
-			if (blk_offs == 0 && (cur_size & m_blksize_mask_lo) == 0)
-			{
-				if (g_debug & Dbg_Dir)
-					std::cout << "Full read blk " << extent_paddr + blk_idx << " cnt " << (cur_size >> m_blksize_sh) << std::endl;
-				m_vol.ReadBlocks(bdata, extent_paddr + blk_idx, cur_size >> m_blksize_sh, extent_crypto_id + blk_idx);
-			}
-			else
-			{
-				if (g_debug & Dbg_Dir)
-					std::cout << "Partial read blk " << extent_paddr + blk_idx << " cnt 1" << std::endl;
+		cur.offs = out_offs;
+		cur.size = cur_size;
+		cur.paddr = extent_paddr ? extent_paddr + blk_idx : 0;
+		cur.blk_offs = extent_offs & m_blksize_mask_lo;
+		cur.crypto_id = extent_crypto_id + blk_idx;
 
-				m_vol.ReadBlocks(m_tmp_blk.data(), extent_paddr + blk_idx, 1, extent_crypto_id + blk_idx);
+		// Extend the previous run if this part continues it on disk, or if both are holes.
+		rc = false;
 
-				if (blk_offs + cur_size > m_blksize)
-					cur_size = m_blksize - blk_offs;
+		if (!runs.empty())
+		{
+			ReadRun &prev = runs.back();
 
-				if (g_debug & Dbg_Dir)
-					std::cout << "Partial copy off " << blk_offs << " size " << cur_size << std::endl;
+			run_end = prev.blk_offs + prev.size;
 
-				memcpy(bdata, m_tmp_blk.data() + blk_offs, cur_size);
+			if (prev.paddr == 0 && cur.paddr == 0)
+				rc = true;
+			else if (prev.paddr != 0 && cur.paddr != 0 && cur.blk_offs == 0 && (run_end & m_blksize_mask_lo) == 0 &&
+				cur.paddr == prev.paddr + (run_end >> m_blksize_sh))
+			{
+				// The XTS tweak has to continue as well, and a run starting with tweak 0 isn't decrypted at all.
+				rc = !m_vol.isEncrypted() || (prev.crypto_id != 0 && cur.crypto_id == prev.crypto_id + (run_end >> m_blksize_sh));
 			}
+
+			if (rc)
+				prev.size += cur_size;
 		}
-		else
-			memset(bdata, 0, cur_size);
-		bdata += cur_size;
+
+		if (!rc)
+			runs.push_back(cur);
+
+		out_offs += cur_size;
 		offs += cur_size;
 		size -= cur_size;
-		// printf("ReadFile: offs=%016lX size=%016lX\n", offs, size);
 	}
 
 	return true;
 }
 
-bool ApfsDir::ListAttributes(std::vector<std::string>& names, uint64_t inode)
+bool ApfsDir::ExecuteRead(uint8_t *data, const ReadRun &run)
+{
+	uint64_t offs;
+	uint64_t size;
+	uint64_t first;
+	uint64_t cnt;
+	uint64_t copy_offs;
+	uint64_t copy_size;
+
+	if (run.paddr == 0)
+	{
+		memset(data, 0, run.size);
+		return true;
+	}
+
+	if (run.blk_offs == 0 && (run.size & m_blksize_mask_lo) == 0)
+	{
+		if (g_debug & Dbg_Dir)
+			std::cout << "Full read blk " << run.paddr << " cnt " << (run.size >> m_blksize_sh) << std::endl;
+
+		return m_vol.ReadBlocks(data, run.paddr, run.size >> m_blksize_sh, run.crypto_id);
+	}
+
+	// Unaligned runs are read whole into the bounce buffer, one device read per DIR_READ_MAX_BLOCKS,
+	// and the requested part is copied out.
+	offs = run.blk_offs;
+	size = run.size;
+
+	while (size > 0)
+	{
+		first = offs >> m_blksize_sh;
+		cnt = ((offs + size + m_blksize_mask_lo) >> m_blksize_sh) - first;
+		if (cnt > DIR_READ_MAX_BLOCKS)
+			cnt = DIR_READ_MAX_BLOCKS;
+
+		if (m_tmp_blk.size() < (cnt << m_blksize_sh))
+			m_tmp_blk.resize(cnt << m_blksize_sh);
+
+		if (g_debug & Dbg_Dir)
+			std::cout << "Partial read blk " << run.paddr + first << " cnt " << cnt << std::endl;
+
+		if (!m_vol.ReadBlocks(m_tmp_blk.data(), run.paddr + first, cnt, run.crypto_id + first))
+			return false;
+
+		copy_offs = offs - (first << m_blksize_sh);
+		copy_size = (cnt << m_blksize_sh) - copy_offs;
+		if (copy_size > size)
+			copy_size = size;
+
+		if (g_debug & Dbg_Dir)
+			std::cout << "Partial copy off " << copy_offs << " size " << copy_size << std::endl;
+
+		memcpy(data, m_tmp_blk.data() + copy_offs, copy_size);
+
+		data += copy_size;
+		offs += copy_size;
+		size -= copy_size;
+	}
+
+	return true;
+}
+
+bool ApfsDir::VisitAttributes(uint64_t inode, XAttrNameVisitor visit, void *context)
 {
 	j_inode_key_t skey;
 	const j_xattr_key_t *ekey;
 	BTreeIterator it;
 	BTreeEntry res;
+	size_t name_len;
 	bool rc;
 
 	skey.hdr.obj_id_and_type = APFS_TYPE_ID(APFS_TYPE_INODE, inode);
@@ -629,7 +1017,9 @@ bool ApfsDir::ListAttributes(std::vector<std::string>& names, uint64_t inode)
 		if ((ekey->hdr.obj_id_and_type >> OBJ_TYPE_SHIFT) > APFS_TYPE_XATTR)
 			break;
 
-		names.push_back(reinterpret_cast<const char *>(ekey->name));
+		name_len = res.key_len > sizeof(j_xattr_key_t) ? std::min<size_t>(ekey->name_len, res.key_len - sizeof(j_xattr_key_t)) : 0;
+		if (!visit(std::string_view(reinterpret_cast<const char *>(ekey->name), strnlen(reinterpret_cast<const char *>(ekey->name), name_len)), context))
+			break;
 
 		it.next();
 	}
@@ -637,82 +1027,129 @@ bool ApfsDir::ListAttributes(std::vector<std::string>& names, uint64_t inode)
 	return true;
 }
 
-bool ApfsDir::GetAttribute(std::vector<uint8_t>& data, uint64_t inode, const char* name)
+static bool AddAttrName(std::string_view name, void *context)
 {
-	uint8_t skey_buf[0x500];
-	j_xattr_key_t *skey = reinterpret_cast<j_xattr_key_t *>(skey_buf);
-	const j_xattr_val_t *attr;
-	const j_xattr_dstream_t *xstm = nullptr;
-
-	// const uint8_t *adata;
-	BTreeEntry res;
-	bool rc;
+	reinterpret_cast<std::vector<std::string> *>(context)->emplace_back(name);
+	return true;
+}
 
-	size_t name_len = strlen(name) + 1;
-	if (name_len > 0x400)
-		return false;
+bool ApfsDir::ListAttributes(std::vector<std::string>& names, uint64_t inode)
+{
+	return VisitAttributes(inode, AddAttrName, &names);
+}
 
-	skey->hdr.obj_id_and_type = APFS_TYPE_ID(APFS_TYPE_XATTR, inode);
-	skey->name_len = static_cast<int16_t>(name_len);
-	memcpy(skey->name, name, skey->name_len);
+bool ApfsDir::GetAttribute(std::vector<uint8_t>& data, uint64_t inode, const char* name)
+{
+	XAttrRec xattr;
 
-	rc = m_fs_tree.Lookup(res, skey, sizeof(j_xattr_key_t) + skey->name_len, CompareStdDirKey, this, true);
-	if (!rc)
+	if (!GetAttributeInfo(xattr, inode, name))
 		return false;
 
-	attr = reinterpret_cast<const j_xattr_val_t *>(res.val);
-	// adata = reinterpret_cast<const uint8_t *>(res.val) + sizeof(APFS_Xattr_Val);
+	return GetAttribute(data, xattr);
+}
+
+bool ApfsDir::GetAttribute(std::vector<uint8_t> &data, const XAttrRec &xattr)
+{
+	size_t read;
 
 	if (g_debug & Dbg_Dir)
-		std::cout << "GetAttribute: type=" << attr->flags << std::endl;
+		std::cout << "GetAttribute: type=" << xattr.attr.flags << std::endl;
 
-	if (attr->flags & XATTR_DATA_STREAM)
+	if ((g_debug & Dbg_Dir) && (xattr.attr.flags & XATTR_DATA_STREAM))
 	{
-		// Attribute contents are stored in a file
-		assert(attr->xdata_len == sizeof(j_xattr_dstream_t));
-		xstm = reinterpret_cast<const j_xattr_dstream_t *>(attr->xdata);
+		const j_xattr_dstream_t *xstm = &xattr.attr.xstrm;
+
+		std::cout << "Attribute is link:" << std::endl;
+		std::cout << "  obj_id       : " << xstm->xattr_obj_id << std::endl;
+		std::cout << "  size         : " << xstm->dstream.size << std::endl;
+		std::cout << "  alloced_size : " << xstm->dstream.alloced_size << std::endl;
+		std::cout << "  default_crypto_id : " << xstm->dstream.default_crypto_id << std::endl;
+		std::cout << "  total_bytes_written  : " << xstm->dstream.total_bytes_written << std::endl;
+		std::cout << "  total_bytes_read  : " << xstm->dstream.total_bytes_read << std::endl;
+	}
 
-		if (g_debug & Dbg_Dir)
-		{
-			std::cout << "Attribute is link:" << std::endl;
-			std::cout << "  obj_id       : " << xstm->xattr_obj_id << std::endl;
-			std::cout << "  size         : " << xstm->dstream.size << std::endl;
-			std::cout << "  alloced_size : " << xstm->dstream.alloced_size << std::endl;
-			std::cout << "  default_crypto_id : " << xstm->dstream.default_crypto_id << std::endl;
-			std::cout << "  total_bytes_written  : " << xstm->dstream.total_bytes_written << std::endl;
-			std::cout << "  total_bytes_read  : " << xstm->dstream.total_bytes_read << std::endl;
-		}
+	data.resize(xattr.attr.size());
 
-		data.resize(xstm->dstream.alloced_size);
-		ReadFile(data.data(), xstm->xattr_obj_id, 0, data.size()); // Read must be multiple of 4K ...
-		data.resize(xstm->dstream.size);
+	if (!ReadAttribute(data.data(), read, xattr, 0, data.size()))
+		return false;
 
-		if (g_debug & Dbg_Dir)
-		{
-			size_t dmpsize = 0x40;
-			if (dmpsize > data.size())
-				dmpsize = data.size();
-			DumpBuffer(data.data(), dmpsize, "start of attribute content");
-		}
+	data.resize(read);
+
+	if ((g_debug & Dbg_Dir) && (xattr.attr.flags & XATTR_DATA_STREAM))
+	{
+		size_t dmpsize = 0x40;
+		if (dmpsize > data.size())
+			dmpsize = data.size();
+		DumpBuffer(data.data(), dmpsize, "start of attribute content");
 	}
-	else if (attr->flags & XATTR_DATA_EMBEDDED)
+
+	return true;
+}
+
+bool ApfsDir::ReadAttribute(void *data, size_t &read, const XAttrRec &xattr, uint64_t offs, size_t size)
+{
+	uint64_t total = xattr.attr.size();
+
+	read = 0;
+
+	if (offs >= total)
+		return true;
+
+	if (size > total - offs)
+		size = total - offs;
+
+	if (xattr.attr.flags & XATTR_DATA_STREAM)
 	{
-		// Attribute contents are stored in the btree
-		data.assign(attr->xdata, attr->xdata + attr->xdata_len);
+		// Attribute contents are stored in a file, only the blocks covering the range are read
+		if (!ReadFile(data, xattr.attr.xstrm.xattr_obj_id, offs, size))
+			return false;
+	}
+	else
+	{
+		if (offs + size > xattr.data.size())
+			return false;
+
+		memcpy(data, xattr.data.data() + offs, size);
 	}
 
+	read = size;
 	return true;
 }
 
 bool ApfsDir::GetAttributeInfo(ApfsDir::XAttr& attr, uint64_t inode, const char* name)
 {
-	uint8_t skey_buf[0x500];
-	j_xattr_key_t *skey = reinterpret_cast<j_xattr_key_t *>(skey_buf);
 	const j_xattr_val_t *xv;
-	const j_xattr_dstream_t *xs = nullptr;
+	BTreeEntry res;
+
+	if (!LookupAttribute(res, inode, name))
+		return false;
 
+	xv = reinterpret_cast<const j_xattr_val_t *>(res.val);
+	attr.flags = xv->flags;
+	attr.xdata_len = xv->xdata_len;
+
+	if (xv->flags & XATTR_DATA_STREAM)
+		attr.xstrm = *reinterpret_cast<const j_xattr_dstream_t *>(xv->xdata);
+
+	return true;
+}
+
+bool ApfsDir::GetAttributeInfo(XAttrRec &attr, uint64_t inode, const char *name)
+{
 	BTreeEntry res;
-	bool rc;
+
+	if (!LookupAttribute(res, inode, name))
+		return false;
+
+	ParseXAttr(attr, res.key, res.val);
+
+	return true;
+}
+
+bool ApfsDir::LookupAttribute(BTreeEntry &res, uint64_t inode, const char *name)
+{
+	uint8_t skey_buf[0x500];
+	j_xattr_key_t *skey = reinterpret_cast<j_xattr_key_t *>(skey_buf);
 
 	size_t name_len = strlen(name) + 1;
 	if (name_len > 0x400)
@@ -722,23 +1159,179 @@ bool ApfsDir::GetAttributeInfo(ApfsDir::XAttr& attr, uint64_t inode, const char*
 	skey->name_len = static_cast<int16_t>(name_len);
 	memcpy(skey->name, name, skey->name_len);
 
-	rc = m_fs_tree.Lookup(res, skey, sizeof(j_xattr_key_t) + skey->name_len, CompareStdDirKey, this, true);
-	if (!rc)
+	return m_fs_tree.Lookup(res, skey, sizeof(j_xattr_key_t) + skey->name_len, CompareStdDirKey, this, true);
+}
+
+bool ApfsDir::ListExtents(std::vector<Extent> &extents, uint64_t private_id)
+{
+	BTreeIterator it;
+	BTreeEntry e;
+	Extent ext;
+
+	extents.clear();
+
+	if (!GetExtentIterator(it, private_id, 0))
 		return false;
 
-	xv = reinterpret_cast<const j_xattr_val_t *>(res.val);
-	attr.flags = xv->flags;
-	attr.xdata_len = xv->xdata_len;
+	while (it.GetEntry(e) && DecodeExtent(ext, e, private_id))
+	{
+		extents.push_back(ext);
+		it.next();
+	}
 
-	if (xv->flags & XATTR_DATA_STREAM)
+	return true;
+}
+
+bool ApfsDir::GetPhysExtents(std::vector<PhysExtent> &extents, uint64_t inode)
+{
+	RecordGroup grp;
+	PhysExtent pe;
+	bool tier2;
+
+	extents.clear();
+
+	if (!GetRecordGroup(grp, inode, true))
+		return false;
+
+	for (const Extent &ext : grp.extents)
 	{
-		xs = reinterpret_cast<const j_xattr_dstream_t *>(xv->xdata);
-		attr.xstrm = *xs;
+		pe.logical_offs = ext.logical_addr;
+		pe.device_offs = 0;
+		pe.length = ext.length;
+		pe.crypto_id = ext.crypto_id;
+		pe.flags = 0;
+
+		if (ext.phys_block_num == 0)
+			pe.flags |= PhysExtent::SPARSE;
+		else
+		{
+			pe.device_offs = m_vol.getContainer().GetDeviceOffset(ext.phys_block_num, tier2);
+			if (tier2)
+				pe.flags |= PhysExtent::TIER2;
+			if (!m_vol.getContainer().IsDeviceLinear(tier2))
+				pe.flags |= PhysExtent::INDIRECT;
+			// Same rule as ApfsVolume::ReadBlocks, tweak 0 means the data is stored in the clear.
+			if (m_vol.isEncrypted() && ext.crypto_id != 0)
+				pe.flags |= PhysExtent::ENCRYPTED;
+		}
+
+		extents.push_back(pe);
 	}
 
 	return true;
 }
 
+bool ApfsDir::SeekHoleData(uint64_t &res, uint64_t private_id, uint64_t offs, uint64_t size, bool data)
+{
+	BTreeIterator it;
+	BTreeEntry e;
+	Extent ext;
+	bool found = false;
+
+	// Ranges without an extent record are holes as well, so a hole is also found past the last extent.
+	if (!GetExtentIterator(it, private_id, offs))
+		return false;
+
+	while (!found && offs < size && it.GetEntry(e) && DecodeExtent(ext, e, private_id))
+	{
+		if (ext.logical_addr + ext.length > offs)
+		{
+			if (!data && ext.logical_addr > offs)
+				break;
+
+			if (ext.logical_addr > offs)
+				offs = ext.logical_addr;
+
+			found = data == (ext.phys_block_num != 0);
+			if (!found)
+				offs = ext.logical_addr + ext.length;
+		}
+
+		it.next();
+	}
+
+	if (data && !found)
+		offs = size;
+
+	res = std::min(offs, size);
+	return true;
+}
+
+bool ApfsDir::GetExtentIterator(BTreeIterator &it, uint64_t private_id, uint64_t offs)
+{
+	BTreeEntry e;
+	Extent ext;
+
+	// Start at the extent containing offs, not at the next one.
+	if (m_vol.isSealed())
+	{
+		fext_tree_key_t key;
+
+		key.private_id = private_id;
+		key.logical_addr = offs;
+
+		if (offs > 0 && m_vol.fexttree().Lookup(e, &key, sizeof(key), CompareFextKey, this, false) && DecodeExtent(ext, e, private_id))
+			key.logical_addr = ext.logical_addr;
+
+		return m_vol.fexttree().GetIterator(it, &key, sizeof(key), CompareFextKey, this);
+	}
+	else
+	{
+		j_file_extent_key_t key;
+
+		key.hdr.obj_id_and_type = APFS_TYPE_ID(APFS_TYPE_FILE_EXTENT, private_id);
+		key.logical_addr = offs;
+
+		if (offs > 0 && m_fs_tree.Lookup(e, &key, sizeof(key), CompareStdDirKey, this, false) && DecodeExtent(ext, e, private_id))
+			key.logical_addr = ext.logical_addr;
+
+		return m_fs_tree.GetIterator(it, &key, sizeof(key), CompareStdDirKey, this);
+	}
+}
+
+bool ApfsDir::DecodeExtent(Extent &ext, const BTreeEntry &e, uint64_t private_id) const
+{
+	if (m_vol.isSealed())
+	{
+		const fext_tree_key_t *k = reinterpret_cast<const fext_tree_key_t *>(e.key);
+		const fext_tree_val_t *v = reinterpret_cast<const fext_tree_val_t *>(e.val);
+
+		if (k->private_id != private_id)
+			return false;
+
+		ext = { k->logical_addr, v->len_and_flags & J_FILE_EXTENT_LEN_MASK, v->phys_block_num, 0 };
+	}
+	else
+	{
+		const j_file_extent_key_t *k = reinterpret_cast<const j_file_extent_key_t *>(e.key);
+		const j_file_extent_val_t *v = reinterpret_cast<const j_file_extent_val_t *>(e.val);
+
+		if (k->hdr.obj_id_and_type != APFS_TYPE_ID(APFS_TYPE_FILE_EXTENT, private_id))
+			return false;
+
+		ext = { k->logical_addr, v->len_and_flags & J_FILE_EXTENT_LEN_MASK, v->phys_block_num, v->crypto_id };
+	}
+
+	return true;
+}
+
+void ApfsDir::ParseXAttr(XAttrRec &res, const void *key, const void *val)
+{
+	const j_xattr_key_t *k = reinterpret_cast<const j_xattr_key_t *>(key);
+	const j_xattr_val_t *v = reinterpret_cast<const j_xattr_val_t *>(val);
+
+	res.name = reinterpret_cast<const char *>(k->name);
+	res.attr.flags = v->flags;
+	res.attr.xdata_len = v->xdata_len;
+
+	res.data.clear();
+
+	if (v->flags & XATTR_DATA_STREAM)
+		res.attr.xstrm = *reinterpret_cast<const j_xattr_dstream_t *>(v->xdata);
+	else if (v->flags & XATTR_DATA_EMBEDDED)
+		res.data.assign(v->xdata, v->xdata + v->xdata_len);
+}
+
 int ApfsDir::CompareStdDirKey(const void *skey, size_t skey_len, const void *ekey, size_t ekey_len, void *context)
 {
 	// assert(skey_len == 8);
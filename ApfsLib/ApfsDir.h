@@ -20,13 +20,19 @@
 #pragma once
 
 #include <string>
+#include <string_view>
 #include <vector>
 
 #include "DiskStruct.h"
 
 class BTree;
+class BTreeEntry;
+class BTreeIterator;
 class ApfsVolume;
 
+// Largest read that goes through the bounce buffer when a file read is not block aligned.
+#define DIR_READ_MAX_BLOCKS 256
+
 class ApfsDir
 {
 public:
@@ -34,6 +40,7 @@ public:
 	{
 		Inode();
 		Inode(const Inode &other);
+		Inode &operator=(const Inode &other) = default;
 
 		/* TODO */
 		uint64_t obj_id;
@@ -92,6 +99,32 @@ public:
 		};
 	};
 
+	// What stat and file reads need, trivially copyable. Only the dstream and rdev xfields are
+	// decoded, use GetInode for the rest.
+	struct InodeStat
+	{
+		uint64_t obj_id;
+		uint64_t parent_id;
+		uint64_t private_id;
+
+		uint64_t create_time;
+		uint64_t mod_time;
+		uint64_t change_time;
+		uint64_t access_time;
+
+		uint64_t nchildren_nlink;
+		uint64_t ds_size;
+		uint64_t ds_alloced_size;
+
+		uint32_t bsd_flags;
+		uint32_t owner;
+		uint32_t group;
+		uint32_t rdev;
+		uint16_t mode;
+
+		uint32_t optional_present_flags; // Inode::INO_HAS_DSTREAM, Inode::INO_HAS_RDEV
+	};
+
 	struct DirRec
 	{
 		DirRec();
@@ -109,32 +142,148 @@ public:
 		bool has_sibling_id;
 	};
 
+	// Directory record passed to a DirVisitor. name points into the cached node and is only
+	// valid during the call, it doesn't include the terminating NUL.
+	struct DirEntryView
+	{
+		uint64_t parent_id;
+		uint32_t hash;
+		std::string_view name;
+
+		uint64_t file_id;
+		uint64_t date_added;
+
+		uint64_t sibling_id;
+		uint16_t flags;
+		bool has_sibling_id;
+	};
+
+	// Enumeration callbacks, return false to stop.
+	typedef bool (*DirVisitor)(const DirEntryView &e, void *context);
+	typedef bool (*XAttrNameVisitor)(std::string_view name, void *context);
+
 	struct XAttr
 	{
 		XAttr();
 		XAttr(const XAttr &other);
+		XAttr &operator=(const XAttr &other) = default;
+
+		// Size of the contents, without reading them.
+		uint64_t size() const;
 
 		uint16_t flags;
 		uint16_t xdata_len;
 		j_xattr_dstream_t xstrm;
 	};
 
+	// Extended attribute header. Embedded contents are kept, stream contents are not read.
+	struct XAttrRec
+	{
+		std::string name;
+		XAttr attr;
+		std::vector<uint8_t> data;
+	};
+
+	struct Extent
+	{
+		uint64_t logical_addr;
+		uint64_t length;
+		paddr_t phys_block_num; // 0 for a sparse hole
+		uint64_t crypto_id;
+	};
+
+	// Where an extent of a file lives on the device, for readers that bypass the library.
+	struct PhysExtent
+	{
+		enum Flags {
+			SPARSE = 1,    // Not allocated, reads as zeroes
+			ENCRYPTED = 2, // Stored XTS encrypted with crypto_id as tweak
+			TIER2 = 4,     // On the fusion tier2 device
+			INDIRECT = 8   // The device decodes an image format, device_offs is not a position in its file
+		};
+
+		uint64_t logical_offs;
+		uint64_t device_offs; // Byte offset in the Device, 0 if sparse. Only readable directly without INDIRECT.
+		uint64_t length;
+		uint64_t crypto_id;
+		uint32_t flags;
+	};
+
+	// The inode with its xattrs and file extents, fetched in one pass over the fs tree.
+	struct RecordGroup
+	{
+		Inode inode;
+		std::vector<XAttrRec> xattrs;
+		std::vector<Extent> extents;
+
+		const XAttrRec *FindAttribute(const char *name) const;
+	};
+
+	// The stat decode of the inode, with the xattr headers of a compressed file, in one pass.
+	struct StatGroup
+	{
+		InodeStat inode;
+		std::vector<XAttrRec> xattrs; // Empty unless the file is compressed
+
+		const XAttrRec *FindAttribute(const char *name) const;
+	};
 
 	ApfsDir(ApfsVolume &vol);
 	~ApfsDir();
 
 	bool GetInode(Inode &res, uint64_t inode);
+	bool GetInodeStat(InodeStat &res, uint64_t inode);
+	bool GetRecordGroup(RecordGroup &res, uint64_t inode, bool with_extents = true);
+	bool GetStatGroup(StatGroup &res, uint64_t inode);
 
 	bool ListDirectory(std::vector<DirRec> &dir, uint64_t inode);
-	bool LookupName(DirRec &res, uint64_t parent_id, const char *name);
+	// Calls visit for each record of the directory, without copying the names.
+	bool VisitDirectory(uint64_t inode, DirVisitor visit, void *context);
+	// not_found is set if the directory has no such entry, a false return without it is a read error.
+	bool LookupName(DirRec &res, uint64_t parent_id, const char *name, bool *not_found = nullptr);
+	// Resolves a '/' separated path, starting at the root directory.
+	bool LookupPath(uint64_t &inode, const char *path);
 	bool ReadFile(void *data, uint64_t inode, uint64_t offs, size_t size);
 	bool ListAttributes(std::vector<std::string> &names, uint64_t inode);
+	bool VisitAttributes(uint64_t inode, XAttrNameVisitor visit, void *context);
 	bool GetAttribute(std::vector<uint8_t> &data, uint64_t inode, const char *name);
+	bool GetAttribute(std::vector<uint8_t> &data, const XAttrRec &xattr);
 	bool GetAttributeInfo(XAttr &attr, uint64_t inode, const char *name);
+	// Header and embedded contents only, a stream attribute isn't read.
+	bool GetAttributeInfo(XAttrRec &attr, uint64_t inode, const char *name);
+	// Reads up to size bytes of the contents at offs, read is set to the number of bytes copied.
+	bool ReadAttribute(void *data, size_t &read, const XAttrRec &xattr, uint64_t offs, size_t size);
+	bool ListExtents(std::vector<Extent> &extents, uint64_t private_id);
+	bool GetPhysExtents(std::vector<PhysExtent> &extents, uint64_t inode);
+	// Start of the next data (or hole) at or after offs. res is size if there is no more data.
+	bool SeekHoleData(uint64_t &res, uint64_t private_id, uint64_t offs, uint64_t size, bool data);
 
-private:
+	// Key order of the fs tree, context is an ApfsDir of the volume.
 	static int CompareStdDirKey(const void *skey, size_t skey_len, const void *ekey, size_t ekey_len, void *context);
+	// Key order of the fext tree of sealed volumes.
 	static int CompareFextKey(const void *skey, size_t skey_len, const void *ekey, size_t ekey_len, void *context);
+	// Decode fs tree record values, for callers that walk the tree themselves.
+	static void ParseInode(Inode &res, uint64_t inode, const void *val, size_t val_len);
+	static void ParseInodeStat(InodeStat &res, uint64_t inode, const void *val, size_t val_len);
+	static void ParseXAttr(XAttrRec &res, const void *key, const void *val);
+
+private:
+	// Part of a file read that maps to contiguous physical blocks, or to a sparse hole.
+	struct ReadRun
+	{
+		uint64_t offs;      // Offset in the output buffer
+		uint64_t size;
+		paddr_t paddr;      // Block containing the first byte, 0 for a hole
+		uint64_t blk_offs;  // Offset of the first byte in that block
+		uint64_t crypto_id; // XTS tweak of that block
+	};
+
+	bool LookupAttribute(BTreeEntry &res, uint64_t inode, const char *name);
+	bool GetExtentIterator(BTreeIterator &it, uint64_t private_id, uint64_t offs);
+	bool DecodeExtent(Extent &ext, const BTreeEntry &e, uint64_t private_id) const;
+
+	bool PlanRead(std::vector<ReadRun> &runs, uint64_t inode, uint64_t offs, size_t size);
+	bool ExecuteRead(uint8_t *data, const ReadRun &run);
 
 	ApfsVolume &m_vol;
 	BTree &m_fs_tree;
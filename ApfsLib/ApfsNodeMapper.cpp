@@ -27,3 +27,21 @@ ApfsNodeMapper::ApfsNodeMapper()
 ApfsNodeMapper::~ApfsNodeMapper()
 {
 }
+
+size_t ApfsNodeMapper::LookupBatch(std::vector<omap_res_t> &res, const std::vector<oid_t> &oids, xid_t xid)
+{
+	size_t found = 0;
+	size_t k;
+
+	res.resize(oids.size());
+
+	for (k = 0; k < oids.size(); k++)
+	{
+		if (Lookup(res[k], oids[k], xid))
+			found++;
+		else
+			res[k].paddr = 0;
+	}
+
+	return found;
+}
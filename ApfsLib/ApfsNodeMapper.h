@@ -19,6 +19,9 @@
 
 #pragma once
 
+#include <cstddef>
+#include <vector>
+
 #include "ApfsTypes.h"
 
 struct omap_res_t
@@ -37,4 +40,6 @@ public:
 	virtual ~ApfsNodeMapper();
 
 	virtual bool Lookup(omap_res_t &res, oid_t oid, xid_t xid) = 0;
+	// Maps several oids at once. res[k].paddr is 0 if oids[k] has no mapping. Returns the number found.
+	virtual size_t LookupBatch(std::vector<omap_res_t> &res, const std::vector<oid_t> &oids, xid_t xid);
 };
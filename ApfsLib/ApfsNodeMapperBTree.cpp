@@ -17,6 +17,7 @@
 	along with apfs-fuse.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <algorithm>
 #include <cassert>
 #include <cstring>
 #include <iostream>
@@ -49,6 +50,7 @@ static int CompareOMapKey(const void *skey, size_t skey_len, const void *ekey, s
 
 ApfsNodeMapperBTree::ApfsNodeMapperBTree(ApfsContainer &container) :
 	m_tree(container),
+	m_flat_xid(0),
 	m_container(container)
 {
 }
@@ -89,6 +91,17 @@ bool ApfsNodeMapperBTree::Lookup(omap_res_t &omr, oid_t oid, xid_t xid)
 
 	BTreeEntry res;
 
+	if (!m_flat.empty() && xid == m_flat_xid)
+	{
+		auto it = std::lower_bound(m_flat.begin(), m_flat.end(), oid, [](const omap_res_t &r, oid_t o) { return r.oid < o; });
+
+		if (it != m_flat.end() && it->oid == oid)
+		{
+			omr = *it;
+			return true;
+		}
+	}
+
 	key.ok_oid = oid;
 	key.ok_xid = xid;
 
@@ -128,3 +141,124 @@ bool ApfsNodeMapperBTree::Lookup(omap_res_t &omr, oid_t oid, xid_t xid)
 
 	return true;
 }
+
+size_t ApfsNodeMapperBTree::LookupBatch(std::vector<omap_res_t> &res, const std::vector<oid_t> &oids, xid_t xid)
+{
+	std::vector<omap_key_t> keys;
+	std::vector<BTreeKey> bkeys;
+	std::vector<size_t> reqs;
+	std::vector<BTreeEntry> entries;
+	const omap_key_t *res_key;
+	const omap_val_t *res_val;
+	size_t found = 0;
+	size_t k;
+
+	res.resize(oids.size());
+
+	for (k = 0; k < oids.size(); k++)
+	{
+		res[k].paddr = 0;
+
+		if (!m_flat.empty() && xid == m_flat_xid)
+		{
+			auto it = std::lower_bound(m_flat.begin(), m_flat.end(), oids[k], [](const omap_res_t &r, oid_t o) { return r.oid < o; });
+
+			if (it != m_flat.end() && it->oid == oids[k])
+			{
+				res[k] = *it;
+				found++;
+				continue;
+			}
+		}
+
+		reqs.push_back(k);
+	}
+
+	if (reqs.empty())
+		return found;
+
+	keys.resize(reqs.size());
+	bkeys.resize(reqs.size());
+
+	for (k = 0; k < reqs.size(); k++)
+	{
+		keys[k].ok_oid = oids[reqs[k]];
+		keys[k].ok_xid = xid;
+		bkeys[k].key = &keys[k];
+		bkeys[k].key_len = sizeof(omap_key_t);
+	}
+
+	m_tree.LookupBatch(entries, bkeys, CompareOMapKey, this, false);
+
+	for (k = 0; k < reqs.size(); k++)
+	{
+		omap_res_t &omr = res[reqs[k]];
+
+		res_key = reinterpret_cast<const omap_key_t *>(entries[k].key);
+		res_val = reinterpret_cast<const omap_val_t *>(entries[k].val);
+
+		if (!res_key || res_key->ok_oid != keys[k].ok_oid)
+		{
+			std::cerr << std::hex << "oid " << keys[k].ok_oid << " xid " << xid << " NOT FOUND!!!" << std::endl;
+			continue;
+		}
+
+		omr.oid = res_key->ok_oid;
+		omr.xid = res_key->ok_xid;
+		omr.flags = res_val->ov_flags;
+		omr.size = res_val->ov_size;
+		omr.paddr = res_val->ov_paddr;
+		found++;
+	}
+
+	return found;
+}
+
+bool ApfsNodeMapperBTree::Flatten(std::vector<omap_res_t> &map, xid_t xid)
+{
+	BTreeIterator it;
+	BTreeEntry e;
+	const omap_key_t *k;
+	const omap_val_t *v;
+	omap_res_t r;
+
+	map.clear();
+
+	if (!m_tree.GetIteratorBegin(it))
+		return false;
+
+	// Keys are sorted by oid, then xid, so the last version not newer than xid wins.
+	do
+	{
+		if (!it.GetEntry(e))
+			break;
+
+		if (e.key_len != sizeof(omap_key_t) || e.val_len != sizeof(omap_val_t))
+			return false;
+
+		k = reinterpret_cast<const omap_key_t *>(e.key);
+		v = reinterpret_cast<const omap_val_t *>(e.val);
+
+		if (k->ok_xid > xid)
+			continue;
+
+		r.oid = k->ok_oid;
+		r.xid = k->ok_xid;
+		r.flags = v->ov_flags;
+		r.size = v->ov_size;
+		r.paddr = v->ov_paddr;
+
+		if (!map.empty() && map.back().oid == r.oid)
+			map.back() = r;
+		else
+			map.push_back(r);
+	} while (it.next());
+
+	return true;
+}
+
+void ApfsNodeMapperBTree::SetFlatMap(std::vector<omap_res_t> &&map, xid_t xid)
+{
+	m_flat = std::move(map);
+	m_flat_xid = xid;
+}
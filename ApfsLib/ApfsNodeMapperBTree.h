@@ -21,6 +21,8 @@
 
 #include "DiskStruct.h"
 
+#include <vector>
+
 #include "ApfsNodeMapper.h"
 #include "BTree.h"
 
@@ -34,12 +36,23 @@ public:
 
 	bool Init(oid_t omap_oid, xid_t xid);
 	bool Lookup(omap_res_t & omr, oid_t oid, xid_t xid) override;
+	// The oids missing from the flat map are looked up with shared tree descents.
+	size_t LookupBatch(std::vector<omap_res_t> &res, const std::vector<oid_t> &oids, xid_t xid) override;
+
+	// Mapping of every oid as seen at xid, sorted by oid.
+	bool Flatten(std::vector<omap_res_t> &map, xid_t xid);
+	// Lookups at xid are answered from the flat map, others still use the tree.
+	void SetFlatMap(std::vector<omap_res_t> &&map, xid_t xid);
 
 	void dump(BlockDumper &bd) { m_tree.dump(bd); }
+	BTree &tree() { return m_tree; }
 
 private:
 	omap_phys_t m_omap;
 	BTree m_tree;
 
+	std::vector<omap_res_t> m_flat;
+	xid_t m_flat_xid;
+
 	ApfsContainer &m_container;
 };
@@ -44,13 +44,17 @@ public:
 
 	BTree &fstree() { return m_fs_tree; }
 	BTree &fexttree() { return m_fext_tree; }
+	ApfsNodeMapperBTree &omap() { return m_omap; }
+	const apfs_superblock_t &getSuperblock() const { return m_sb; }
 	uint32_t getTextFormat() const { return m_sb.apfs_incompatible_features & 0x9; }
+	xid_t getXid() const { return m_sb.apfs_o.o_xid; }
 
 	ApfsContainer &getContainer() const { return m_container; }
 
 	bool ReadBlocks(uint8_t *data, paddr_t paddr, uint64_t blkcnt, uint64_t xts_tweak);
 	bool isSealed() const { return (m_sb.apfs_incompatible_features & APFS_INCOMPAT_SEALED_VOLUME) != 0; }
 	bool isPreboot() const { return m_sb.apfs_role == APFS_VOL_ROLE_PREBOOT; }
+	bool isEncrypted() const { return m_is_encrypted; }
 
 private:
 	static int CompareSnapMetaKey(const void *skey, size_t skey_len, const void *ekey, size_t ekey_len, void *context);
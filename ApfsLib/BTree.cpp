@@ -17,6 +17,7 @@
 	along with apfs-fuse.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <algorithm>
 #include <cassert>
 #include <cstring>
 #include <cstdio>
@@ -24,12 +25,14 @@
 
 #include <iostream>
 #include <iomanip>
+#include <new>
 
 #include "ApfsContainer.h"
 #include "ApfsVolume.h"
 #include "BTree.h"
 #include "Util.h"
 #include "BlockDumper.h"
+#include "HotList.h"
 
 int CompareStdKey(const void *skey, size_t skey_len, const void *ekey, size_t ekey_len, void *context)
 {
@@ -50,6 +53,104 @@ int CompareStdKey(const void *skey, size_t skey_len, const void *ekey, size_t ek
 	return 0;
 }
 
+// Comparators for the specialized search kernels. Same convention as
+// BTCompareFunc: ekey < skey: -1, ekey > skey: 1, ekey == skey: 0.
+
+struct OMapKeyCmp
+{
+	explicit OMapKeyCmp(const void *skey)
+	{
+		const omap_key_t *k = reinterpret_cast<const omap_key_t *>(skey);
+		oid = k->ok_oid;
+		xid = k->ok_xid;
+	}
+
+	int operator()(const uint8_t *ekey, size_t ekey_len) const
+	{
+		(void)ekey_len;
+
+		const omap_key_t *k = reinterpret_cast<const omap_key_t *>(ekey);
+		uint64_t e_oid = k->ok_oid;
+
+		if (e_oid != oid)
+			return e_oid < oid ? -1 : 1;
+
+		uint64_t e_xid = k->ok_xid;
+
+		if (e_xid != xid)
+			return e_xid < xid ? -1 : 1;
+
+		return 0;
+	}
+
+	uint64_t oid;
+	uint64_t xid;
+};
+
+struct FextKeyCmp
+{
+	explicit FextKeyCmp(const void *skey)
+	{
+		const fext_tree_key_t *k = reinterpret_cast<const fext_tree_key_t *>(skey);
+		private_id = k->private_id;
+		logical_addr = k->logical_addr;
+	}
+
+	int operator()(const uint8_t *ekey, size_t ekey_len) const
+	{
+		(void)ekey_len;
+
+		const fext_tree_key_t *k = reinterpret_cast<const fext_tree_key_t *>(ekey);
+		uint64_t e_id = k->private_id;
+
+		if (e_id != private_id)
+			return e_id < private_id ? -1 : 1;
+
+		uint64_t e_addr = k->logical_addr;
+
+		if (e_addr != logical_addr)
+			return e_addr < logical_addr ? -1 : 1;
+
+		return 0;
+	}
+
+	uint64_t private_id;
+	uint64_t logical_addr;
+};
+
+// fs tree keys are ordered by obj_id first, then type, so compare the
+// rotated obj_id_and_type directly. Only on a tie does the caller's
+// comparator look at the rest of the key (names, offsets, ...).
+struct JKeyCmp
+{
+	JKeyCmp(const void *skey, size_t skey_len, BTCompareFunc func, void *context) :
+		skey(skey), skey_len(skey_len), func(func), context(context)
+	{
+		uint64_t k = *reinterpret_cast<const le_uint64_t *>(skey);
+		ks = (k << 4) | (k >> 60);
+	}
+
+	int operator()(const uint8_t *ekey, size_t ekey_len) const
+	{
+		uint64_t ke = *reinterpret_cast<const le_uint64_t *>(ekey);
+		ke = (ke << 4) | (ke >> 60);
+
+		if (ke != ks)
+			return ke < ks ? -1 : 1;
+
+		if (skey_len > sizeof(uint64_t))
+			return func(skey, skey_len, ekey, ekey_len, context);
+
+		return 0;
+	}
+
+	const void *skey;
+	size_t skey_len;
+	BTCompareFunc func;
+	void *context;
+	uint64_t ks;
+};
+
 BTreeEntry::BTreeEntry()
 {
 	key = nullptr;
@@ -72,44 +173,48 @@ void BTreeEntry::clear()
 	m_node.reset();
 }
 
-BTreeNode::BTreeNode(BTree &tree, const uint8_t *block, size_t blocksize, paddr_t paddr, const std::shared_ptr<BTreeNode> &parent, uint32_t parent_index) :
+BTreeNode::BTreeNode(BTree &tree, const BlockBuffer &block, paddr_t paddr) :
+	m_block(block),
 	m_tree(tree),
-	m_parent_index(parent_index),
-	m_parent(parent),
 	m_paddr(paddr)
 {
-	m_block.assign(block, block + blocksize);
 	m_btn = reinterpret_cast<const btree_node_phys_t *>(m_block.data());
 
 	assert(m_btn->btn_table_space.off == 0);
 
 	m_keys_start = sizeof(btree_node_phys_t) + m_btn->btn_table_space.len;
 	if (m_btn->btn_flags & BTNODE_ROOT)
-		m_vals_start = blocksize - sizeof(btree_info_t);
+		m_vals_start = m_block.size() - sizeof(btree_info_t);
 	else
-		m_vals_start = blocksize;
+		m_vals_start = m_block.size();
 }
 
-std::shared_ptr<BTreeNode> BTreeNode::CreateNode(BTree & tree, const uint8_t * block, size_t blocksize, paddr_t paddr, const std::shared_ptr<BTreeNode> &parent, uint32_t parent_index)
+std::shared_ptr<BTreeNode> BTreeNode::CreateNode(BTree & tree, const BlockBuffer &block, paddr_t paddr)
 {
-	const btree_node_phys_t *btn = reinterpret_cast<const btree_node_phys_t *>(block);
+	const btree_node_phys_t *btn = reinterpret_cast<const btree_node_phys_t *>(block.data());
 
 	if (btn->btn_flags & BTNODE_FIXED_KV_SIZE)
-		return std::make_shared<BTreeNodeFix>(tree, block, blocksize, paddr, parent, parent_index);
+		return std::make_shared<BTreeNodeFix>(tree, block, paddr);
 	else
-		return std::make_shared<BTreeNodeVar>(tree, block, blocksize, paddr, parent, parent_index);
+		return std::make_shared<BTreeNodeVar>(tree, block, paddr);
 }
 
 BTreeNode::~BTreeNode()
 {
 }
 
-BTreeNodeFix::BTreeNodeFix(BTree &tree, const uint8_t *block, size_t blocksize, paddr_t paddr, const std::shared_ptr<BTreeNode> &parent, uint32_t parent_index) :
-	BTreeNode(tree, block, blocksize, paddr, parent, parent_index)
+BTreeNodeFix::BTreeNodeFix(BTree &tree, const BlockBuffer &block, paddr_t paddr) :
+	BTreeNode(tree, block, paddr)
 {
 	m_entries = reinterpret_cast<const kvoff_t *>(m_block.data() + sizeof(btree_node_phys_t));
 }
 
+const uint8_t *BTreeNodeFix::KeyAt(uint32_t index, size_t &key_len) const
+{
+	key_len = m_tree.GetKeyLen();
+	return m_block.data() + m_keys_start + m_entries[index].k;
+}
+
 bool BTreeNodeFix::GetEntry(BTreeEntry & result, uint32_t index) const
 {
 	result.clear();
@@ -134,12 +239,18 @@ bool BTreeNodeFix::GetEntry(BTreeEntry & result, uint32_t index) const
 	return true;
 }
 
-BTreeNodeVar::BTreeNodeVar(BTree &tree, const uint8_t *block, size_t blocksize, paddr_t paddr, const std::shared_ptr<BTreeNode> &parent, uint32_t parent_index) :
-	BTreeNode(tree, block, blocksize, paddr, parent, parent_index)
+BTreeNodeVar::BTreeNodeVar(BTree &tree, const BlockBuffer &block, paddr_t paddr) :
+	BTreeNode(tree, block, paddr)
 {
 	m_entries = reinterpret_cast<const kvloc_t *>(m_block.data() + sizeof(btree_node_phys_t));
 }
 
+const uint8_t *BTreeNodeVar::KeyAt(uint32_t index, size_t &key_len) const
+{
+	key_len = m_entries[index].k.len;
+	return m_block.data() + m_keys_start + m_entries[index].k.off;
+}
+
 bool BTreeNodeVar::GetEntry(BTreeEntry & result, uint32_t index) const
 {
 	result.clear();
@@ -171,8 +282,13 @@ BTree::BTree(ApfsContainer &container, ApfsVolume *volume) :
 
 	m_root_node = nullptr;
 	m_omap = nullptr;
+	m_key_type = KeyType::Generic;
 	m_xid = 0;
 	m_debug = false;
+	m_iter_readahead = BTREE_ITERATOR_READAHEAD;
+	m_recorder = nullptr;
+	m_pin_arena = nullptr;
+	m_pin_size = 0;
 }
 
 BTree::~BTree()
@@ -180,23 +296,43 @@ BTree::~BTree()
 #ifdef BTREE_USE_MAP
 	m_nodes.clear();
 #endif
+	// The pinned nodes borrow their blocks from the arena.
+	m_root_node.reset();
+	m_pinned.clear();
+	if (m_pin_arena)
+		::operator delete(m_pin_arena, std::align_val_t(BTREE_PIN_ALIGN));
 }
 
 bool BTree::Init(oid_t oid_root, xid_t xid, ApfsNodeMapper *omap)
 {
-	std::shared_ptr<BTreeNode> dummy;
-
 	m_omap = omap;
 	m_oid = oid_root;
 	m_xid = xid;
 
 	if (oid_root == 0) return false;
 
-	m_root_node = GetNode(oid_root, dummy, 0);
+	m_root_node = GetNode(oid_root);
 
 	if (m_root_node)
 	{
 		memcpy(&m_treeinfo, m_root_node->block().data() + m_root_node->block().size() - sizeof(btree_info_t), sizeof(btree_info_t));
+
+		switch (m_root_node->subtype())
+		{
+		case OBJECT_TYPE_OMAP:
+			m_key_type = KeyType::OMap;
+			break;
+		case OBJECT_TYPE_FSTREE:
+			m_key_type = KeyType::FsTree;
+			break;
+		case OBJECT_TYPE_FEXT_TREE:
+			m_key_type = KeyType::FextTree;
+			break;
+		default:
+			m_key_type = KeyType::Generic;
+			break;
+		}
+
 		return true;
 	}
 	else
@@ -206,8 +342,11 @@ bool BTree::Init(oid_t oid_root, xid_t xid, ApfsNodeMapper *omap)
 	}
 }
 
-bool BTree::Lookup(BTreeEntry &result, const void *key, size_t key_size, BTCompareFunc func, void *context, bool exact)
+bool BTree::Lookup(BTreeEntry &result, const void *key, size_t key_size, BTCompareFunc func, void *context, bool exact, bool *not_found)
 {
+	if (not_found)
+		*not_found = false;
+
 	if (!m_root_node)
 		return false;
 
@@ -215,8 +354,16 @@ bool BTree::Lookup(BTreeEntry &result, const void *key, size_t key_size, BTCompa
 	oid_t oid_parent;
 	int index;
 
-	std::shared_ptr<BTreeNode> node(m_root_node);
+	// Cached nodes are used through plain pointers under the shared cache lock, so the
+	// descent doesn't touch any refcount. Only nodes that have to be read from disk, and
+	// the leaf handed out in result, are referenced.
+	const BTreeNode *node = m_root_node.get();
+	const std::shared_ptr<BTreeNode> *cached = &m_root_node;
+	std::shared_ptr<BTreeNode> child;
 	BTreeEntry e;
+#ifdef BTREE_USE_MAP
+	std::shared_lock<std::shared_mutex> lock(m_mutex);
+#endif
 
 	if (m_debug)
 	{
@@ -227,53 +374,191 @@ bool BTree::Lookup(BTreeEntry &result, const void *key, size_t key_size, BTCompa
 
 	while (node->level() > 0)
 	{
-		index = FindBin(node, key, key_size, func, context, FindMode::LE);
+		index = FindBin(*node, key, key_size, func, context, FindMode::LE);
 
 		if (index < 0)
+		{
+			if (not_found)
+				*not_found = true;
 			return false;
+		}
 
 		node->GetEntry(e, index);
 		// DumpHex(std::cout, reinterpret_cast<const uint8_t*>(e.val), e.val_len, 32);
 
 		oid_parent = node->nodeid();
+		oid = GetChildOid(*node, e);
+
+		cached = PeekCachedNode(oid);
 
-		if (node->flags() & BTNODE_HASHED) {
-			const btn_index_node_val_t *binv = reinterpret_cast<const btn_index_node_val_t*>(e.val);
-			oid = binv->binv_child_oid + m_oid;
-		} else {
-			assert(e.val_len == sizeof(oid_t));
-			oid = *reinterpret_cast<const oid_t *>(e.val);
+		if (cached)
+		{
+			node = cached->get();
+			continue;
 		}
 
-		node = GetNode(oid, node, index);
+		// The read can't happen under the lock, caching the node needs it exclusively.
+#ifdef BTREE_USE_MAP
+		lock.unlock();
+#endif
+		child = GetNode(oid);
+#ifdef BTREE_USE_MAP
+		lock.lock();
+#endif
 
-		if (!node)
+		if (!child)
 		{
 			std::cerr << "BTree::Lookup: Node " << oid << " with parent " << oid_parent << " not found." << std::endl;
 			return false;
 		}
+
+		node = child.get();
 	}
 
-	index = FindBin(node, key, key_size, func, context, exact ? FindMode::EQ : FindMode::LE);
+	index = FindBin(*node, key, key_size, func, context, exact ? FindMode::EQ : FindMode::LE);
 
 	if (m_debug)
 		std::cout << "Result = " << node->nodeid() << ":" << index << std::endl;
 
 	if (index < 0)
+	{
+		if (not_found)
+			*not_found = true;
 		return false;
+	}
 
 	node->GetEntry(result, index);
-	result.m_node = node;
+	if (cached)
+		result.m_node = *cached;
+	else
+		result.m_node = std::move(child);
 
 	return true;
 }
 
+size_t BTree::LookupBatch(std::vector<BTreeEntry> &results, const std::vector<BTreeKey> &keys, BTCompareFunc func, void *context, bool exact)
+{
+	struct Group
+	{
+		std::shared_ptr<BTreeNode> node;
+		oid_t parent;
+		size_t beg;
+		size_t end;
+	};
+
+	std::vector<size_t> order(keys.size());
+	std::vector<Group> groups;
+	std::vector<Group> next_groups;
+	std::vector<oid_t> reqs;
+	std::vector<std::shared_ptr<BTreeNode>> nodes;
+	BTreeEntry e;
+	size_t found = 0;
+	size_t n;
+	size_t k;
+	int index;
+	int prev_index;
+
+	{
+		// BTreeEntry is not copyable, so recreate the vector instead of resizing it.
+		std::vector<BTreeEntry> tmp(keys.size());
+		results.swap(tmp);
+	}
+
+	if (!m_root_node || keys.empty())
+		return 0;
+
+	// Keys are expected to be sorted. If they aren't, work on a sorted permutation.
+	for (k = 0; k < keys.size(); k++)
+		order[k] = k;
+
+	auto key_less = [&keys, func, context](size_t a, size_t b) {
+		return func(keys[b].key, keys[b].key_len, keys[a].key, keys[a].key_len, context) < 0;
+	};
+
+	if (!std::is_sorted(order.begin(), order.end(), key_less))
+		std::stable_sort(order.begin(), order.end(), key_less);
+
+	if (m_debug)
+		std::cout << "BTree::LookupBatch: " << keys.size() << " keys, root=" << m_root_node->nodeid() << std::endl;
+
+	groups.push_back({ m_root_node, 0, 0, keys.size() });
+
+	// Descend one level at a time. Keys that end up in the same child share
+	// its node, and all children of one level are fetched together.
+	while (!groups.empty() && groups.front().node->level() > 0)
+	{
+		reqs.clear();
+		next_groups.clear();
+
+		for (const Group &g : groups)
+		{
+			prev_index = -1;
+
+			for (n = g.beg; n < g.end; n++)
+			{
+				k = order[n];
+				index = FindBin(*g.node, keys[k].key, keys[k].key_len, func, context, FindMode::LE);
+
+				if (index < 0)
+					continue;
+
+				if (index != prev_index)
+				{
+					g.node->GetEntry(e, index);
+					reqs.push_back(GetChildOid(*g.node, e));
+					next_groups.push_back({ nullptr, g.node->nodeid(), n, n + 1 });
+					prev_index = index;
+				}
+				else
+				{
+					next_groups.back().end = n + 1;
+				}
+			}
+		}
+
+		GetNodes(nodes, reqs);
+
+		groups.clear();
+
+		for (k = 0; k < next_groups.size(); k++)
+		{
+			if (!nodes[k])
+			{
+				std::cerr << "BTree::LookupBatch: Node " << reqs[k] << " with parent " << next_groups[k].parent << " not found." << std::endl;
+				continue;
+			}
+
+			next_groups[k].node = nodes[k];
+			groups.push_back(next_groups[k]);
+		}
+	}
+
+	for (const Group &g : groups)
+	{
+		for (n = g.beg; n < g.end; n++)
+		{
+			k = order[n];
+			index = FindBin(*g.node, keys[k].key, keys[k].key_len, func, context, exact ? FindMode::EQ : FindMode::LE);
+
+			if (index < 0)
+				continue;
+
+			g.node->GetEntry(results[k], index);
+			results[k].m_node = g.node;
+			found++;
+		}
+	}
+
+	return found;
+}
+
 bool BTree::GetIterator(BTreeIterator& it, const void* key, size_t key_size, BTCompareFunc func, void *context)
 {
 	oid_t oid;
 	int index;
 
 	std::shared_ptr<BTreeNode> node(m_root_node);
+	std::vector<BTreeIterator::PathEntry> path;
 	BTreeEntry e;
 
 	if (m_debug)
@@ -281,25 +566,25 @@ bool BTree::GetIterator(BTreeIterator& it, const void* key, size_t key_size, BTC
 
 	while (node->level() > 0)
 	{
-		index = FindBin(node, key, key_size, func, context, FindMode::LE);
+		index = FindBin(*node, key, key_size, func, context, FindMode::LE);
 
 		if (index < 0)
 			index = 0;
 
 		node->GetEntry(e, index);
+		oid = GetChildOid(*node, e);
 
-		if (node->flags() & BTNODE_HASHED) {
-			const btn_index_node_val_t *binv = reinterpret_cast<const btn_index_node_val_t*>(e.val);
-			oid = binv->binv_child_oid + m_oid;
-		} else {
-			assert(e.val_len == sizeof(oid_t));
-			oid = *reinterpret_cast<const oid_t *>(e.val);
-		}
+		path.push_back({ node, static_cast<uint32_t>(index) });
+		node = GetNode(oid);
 
-		node = GetNode(oid, node, index);
+		if (!node)
+		{
+			std::cerr << "BTree::GetIterator: Node " << oid << " not found." << std::endl;
+			return false;
+		}
 	}
 
-	index = FindBin(node, key, key_size, func, context, FindMode::GE);
+	index = FindBin(*node, key, key_size, func, context, FindMode::GE);
 
 	if (m_debug)
 		std::cout << "Result = " << node->nodeid() << ":" << index << std::endl;
@@ -307,14 +592,14 @@ bool BTree::GetIterator(BTreeIterator& it, const void* key, size_t key_size, BTC
 	if (index < 0)
 	{
 		index = node->entries_cnt() - 1;
-		it.Setup(this, node, index);
+		it.Setup(this, path, node, index);
 		it.next();
 		if (m_debug)
 			std::cout << "Iterator next entry" << std::endl;
 	}
 	else
 	{
-		it.Setup(this, node, index);
+		it.Setup(this, path, node, index);
 	}
 
 #if 0
@@ -332,6 +617,7 @@ bool BTree::GetIteratorBegin(BTreeIterator& it)
 	oid_t oid;
 
 	std::shared_ptr<BTreeNode> node(m_root_node);
+	std::vector<BTreeIterator::PathEntry> path;
 	BTreeEntry e;
 
 	while (node->level() > 0)
@@ -339,16 +625,236 @@ bool BTree::GetIteratorBegin(BTreeIterator& it)
 		if (!node->GetEntry(e, 0))
 			return false;
 
-		if (node->flags() & BTNODE_HASHED) {
-			const btn_index_node_val_t *binv = reinterpret_cast<const btn_index_node_val_t*>(e.val);
-			oid = binv->binv_child_oid + m_oid;
-		} else {
-			oid = *reinterpret_cast<const oid_t *>(e.val);
+		oid = GetChildOid(*node, e);
+
+		path.push_back({ node, 0 });
+		node = GetNode(oid);
+
+		if (!node)
+		{
+			std::cerr << "BTree::GetIteratorBegin: Node " << oid << " not found." << std::endl;
+			return false;
+		}
+	}
+
+	it.Setup(this, path, node, 0);
+
+	return true;
+}
+
+void BTree::GetSplitKeys(std::vector<std::vector<uint8_t>> &keys, size_t min_cnt)
+{
+	std::vector<std::shared_ptr<BTreeNode>> nodes;
+	std::vector<std::shared_ptr<BTreeNode>> children;
+	std::vector<oid_t> oids;
+	BTreeEntry e;
+	size_t cnt;
+	uint32_t k;
+
+	keys.clear();
+
+	if (!m_root_node || m_root_node->level() == 0)
+		return;
+
+	nodes.push_back(m_root_node);
+
+	// Index levels are small compared to the leaves, the leaves themselves are never read.
+	while (nodes[0]->level() > 1)
+	{
+		cnt = 0;
+		for (const auto &node : nodes)
+			cnt += node->entries_cnt();
+
+		if (cnt >= min_cnt)
+			break;
+
+		oids.clear();
+		for (const auto &node : nodes)
+		{
+			for (k = 0; k < node->entries_cnt(); k++)
+			{
+				if (node->GetEntry(e, k))
+					oids.push_back(GetChildOid(*node, e));
+			}
+		}
+
+		GetNodes(children, oids);
+
+		if (std::find(children.begin(), children.end(), nullptr) != children.end())
+			break;
+
+		nodes.swap(children);
+	}
+
+	for (const auto &node : nodes)
+	{
+		for (k = 0; k < node->entries_cnt(); k++)
+		{
+			if (node->GetEntry(e, k))
+				keys.emplace_back(reinterpret_cast<const uint8_t *>(e.key), reinterpret_cast<const uint8_t *>(e.key) + e.key_len);
+		}
+	}
+
+	// The first key is the start of the tree, not a boundary.
+	if (!keys.empty())
+		keys.erase(keys.begin());
+}
+
+size_t BTree::Prewarm(unsigned int levels, const std::atomic<bool> *stop)
+{
+	std::vector<std::shared_ptr<BTreeNode>> nodes;
+	std::vector<std::shared_ptr<BTreeNode>> children;
+	std::vector<oid_t> oids;
+	BTreeEntry e;
+	size_t loaded = 0;
+	unsigned int level;
+	uint32_t k;
+
+	if (!m_root_node)
+		return 0;
+
+	nodes.push_back(m_root_node);
+
+	// The root is the first level. GetNodes reads each level sorted by paddr.
+	for (level = 1; levels == 0 || level < levels; level++)
+	{
+		if (nodes.empty() || nodes[0]->level() == 0)
+			break;
+
+		if (stop && stop->load())
+			break;
+
+		oids.clear();
+		for (const auto &node : nodes)
+		{
+			for (k = 0; k < node->entries_cnt(); k++)
+			{
+				if (node->GetEntry(e, k))
+					oids.push_back(GetChildOid(*node, e));
+			}
+		}
+
+		// A level that doesn't fit would only evict itself.
+		if (oids.size() > GetCacheRoom())
+			break;
+
+		GetNodes(children, oids);
+		children.erase(std::remove(children.begin(), children.end(), nullptr), children.end());
+
+		loaded += children.size();
+		nodes.swap(children);
+	}
+
+	return loaded;
+}
+
+size_t BTree::Prefetch(const std::vector<oid_t> &oids, const std::atomic<bool> *stop)
+{
+	std::vector<std::shared_ptr<BTreeNode>> nodes;
+	std::vector<oid_t> part;
+	size_t loaded = 0;
+	size_t beg;
+	size_t cnt;
+
+	// In chunks, so a stop request doesn't have to wait for all of them.
+	for (beg = 0; beg < oids.size(); beg += cnt)
+	{
+		cnt = std::min<size_t>(oids.size() - beg, BTREE_MAP_MAX_NODES / 8);
+
+		if ((stop && stop->load()) || cnt > GetCacheRoom())
+			break;
+
+		part.assign(oids.begin() + beg, oids.begin() + beg + cnt);
+		GetNodes(nodes, part);
+		loaded += cnt - std::count(nodes.begin(), nodes.end(), nullptr);
+	}
+
+	return loaded;
+}
+
+void BTree::SetRecorder(HotListRecorder *rec)
+{
+	m_recorder = rec;
+
+	// The root was read by Init, before there was a recorder.
+	if (m_recorder && m_root_node)
+		m_recorder->Add(m_root_node->paddr(), m_oid, GetSubtype());
+}
+
+bool BTree::Pin()
+{
+	std::vector<std::shared_ptr<BTreeNode>> nodes;
+	std::vector<std::shared_ptr<BTreeNode>> children;
+	std::vector<std::shared_ptr<BTreeNode>> all;
+	std::vector<oid_t> oids;
+	std::vector<oid_t> all_oids;
+	BTreeEntry e;
+	BlockBuffer blk;
+	const size_t blksize = m_container.GetBlocksize();
+	size_t k;
+	uint32_t n;
+
+	if (!m_root_node || !m_pinned.empty())
+		return false;
+
+	nodes.push_back(m_root_node);
+	all.push_back(m_root_node);
+	all_oids.push_back(m_oid);
+
+	// A level at a time in physical order. The nodes bypass the cache, it would only thrash.
+	while (nodes[0]->level() > 0)
+	{
+		oids.clear();
+		for (const auto &node : nodes)
+		{
+			for (n = 0; n < node->entries_cnt(); n++)
+			{
+				if (node->GetEntry(e, n))
+					oids.push_back(GetChildOid(*node, e));
+			}
+		}
+
+		GetNodes(children, oids, false);
+
+		if (children.empty() || std::find(children.begin(), children.end(), nullptr) != children.end())
+		{
+			std::cerr << "ERROR: BTree Pin: Unable to read all nodes of tree " << m_oid << std::endl;
+			return false;
 		}
-		node = GetNode(oid, node, 0);
+
+		all.insert(all.end(), children.begin(), children.end());
+		all_oids.insert(all_oids.end(), oids.begin(), oids.end());
+		nodes.swap(children);
+	}
+
+	m_pin_size = all.size() * blksize;
+	m_pin_arena = static_cast<uint8_t *>(::operator new(m_pin_size, std::align_val_t(BTREE_PIN_ALIGN), std::nothrow));
+
+	if (!m_pin_arena)
+	{
+		std::cerr << "ERROR: BTree Pin: Out of memory!" << std::endl;
+		m_pin_size = 0;
+		return false;
+	}
+
+	m_pinned.reserve(all.size());
+
+	for (k = 0; k < all.size(); k++)
+	{
+		memcpy(m_pin_arena + k * blksize, all[k]->block().data(), blksize);
+		blk.Borrow(m_pin_arena + k * blksize, blksize);
+		m_pinned.emplace_back(all_oids[k], BTreeNode::CreateNode(*this, blk, all[k]->paddr()));
 	}
 
-	it.Setup(this, node, 0);
+	std::sort(m_pinned.begin(), m_pinned.end(), [](const std::pair<oid_t, std::shared_ptr<BTreeNode>> &a, const std::pair<oid_t, std::shared_ptr<BTreeNode>> &b) { return a.first < b.first; });
+
+	m_root_node = FindCachedNode(m_oid);
+
+#ifdef BTREE_USE_MAP
+	m_mutex.lock();
+	m_nodes.clear();
+	m_mutex.unlock();
+#endif
 
 	return true;
 }
@@ -406,7 +912,7 @@ void BTree::DumpTreeInternal(BlockDumper& out, const std::shared_ptr<BTreeNode>
 				}
 			}
 
-			child = GetNode(oid_child, node, k);
+			child = GetNode(oid_child);
 
 			if (child)
 				DumpTreeInternal(out, child);
@@ -416,116 +922,375 @@ void BTree::DumpTreeInternal(BlockDumper& out, const std::shared_ptr<BTreeNode>
 	}
 }
 
-std::shared_ptr<BTreeNode> BTree::GetNode(oid_t oid, const std::shared_ptr<BTreeNode> &parent, uint32_t parent_index)
+std::shared_ptr<BTreeNode> BTree::GetNode(oid_t oid)
 {
 	std::shared_ptr<BTreeNode> node;
 
 	// printf("GetNode oid=%" PRIx64 "\n", oid);
 
-#ifdef BTREE_USE_MAP
-	m_mutex.lock();
-	auto it = m_nodes.find(oid);
-
-	if (it != m_nodes.end())
-		node = it->second;
-
-	m_mutex.unlock();
+	node = FindCachedNode(oid);
 
 	if (!node)
-#endif
 	{
 		omap_res_t omr;
+		BlockBuffer blk;
 
-		omr.oid = oid;
-		omr.xid = m_xid;
-		omr.flags = 0;
-		omr.size = m_treeinfo.bt_fixed.bt_node_size;
-		omr.paddr = oid;
+		if (!MapNode(omr, oid))
+			return node;
 
-		std::vector<uint8_t> blk;
+		if (!ReadNodeBuffer(blk, omr, 1))
+			return node;
 
-		if (m_omap)
-		{
-			if (g_debug & Dbg_Info) {
-				std::cout << "omap: oid=" << omr.oid << " xid=" << omr.xid << " flags=" << omr.flags << " size=" << omr.size << " paddr=" << omr.paddr << std::endl;
-			}
+		if (!VerifyNodeBlock(blk.data(), omr))
+			return node;
 
-			if (!m_omap->Lookup(omr, oid, m_xid))
-			{
-				std::cerr << "ERROR: GetNode: omap entry oid " << std::hex << oid << " xid " << m_xid << " not found." << std::endl;
-				return node;
-			}
+		node = BTreeNode::CreateNode(*this, blk, omr.paddr);
+
+		CacheNode(oid, node);
+
+		if (m_recorder)
+			m_recorder->Add(omr.paddr, oid, GetSubtype());
+	}
+
+	return node;
+}
+
+void BTree::GetNodes(std::vector<std::shared_ptr<BTreeNode>> &nodes, const std::vector<oid_t> &oids, bool cache)
+{
+	struct PendingRead
+	{
+		size_t req;
+		omap_res_t omr;
+	};
+
+	std::vector<PendingRead> pending;
+	std::vector<oid_t> missing;
+	std::vector<size_t> missing_req;
+	std::vector<omap_res_t> omrs;
+	BlockBuffer buf;
+	const size_t blksize = m_container.GetBlocksize();
+	size_t k;
+	size_t beg;
+	size_t end;
+	uint64_t cnt;
+
+	nodes.assign(oids.size(), std::shared_ptr<BTreeNode>());
+
+	for (k = 0; k < oids.size(); k++)
+	{
+		nodes[k] = FindCachedNode(oids[k]);
+
+		if (!nodes[k])
+		{
+			missing.push_back(oids[k]);
+			missing_req.push_back(k);
 		}
+	}
+
+	// All misses are mapped with one omap lookup, they share most of its descent.
+	MapNodes(omrs, missing);
+
+	for (k = 0; k < missing.size(); k++)
+	{
+		if (omrs[k].paddr != 0)
+			pending.push_back({ missing_req[k], omrs[k] });
+	}
+
+	// Read the missing nodes in physical order, merging adjacent blocks into one read.
+	std::sort(pending.begin(), pending.end(), [](const PendingRead &a, const PendingRead &b) { return a.omr.paddr < b.omr.paddr; });
+
+	for (beg = 0; beg < pending.size(); beg = end)
+	{
+		end = beg + 1;
+
+		while (end < pending.size() && (end - beg) < BTREE_BATCH_MAX_BLOCKS &&
+			pending[end].omr.paddr == pending[end - 1].omr.paddr + 1 &&
+			(pending[end].omr.flags & OMAP_VAL_ENCRYPTED) == (pending[beg].omr.flags & OMAP_VAL_ENCRYPTED))
+		{
+			end++;
+		}
+
+		cnt = end - beg;
+
+		if (m_debug)
+			std::cout << "BTree::GetNodes: read paddr=" << pending[beg].omr.paddr << " cnt=" << cnt << std::endl;
 
-		blk.resize(m_container.GetBlocksize());
+		if (!ReadNodeBuffer(buf, pending[beg].omr, cnt))
+			continue;
 
-		if (m_volume)
+		for (k = beg; k < end; k++)
 		{
-			// TODO: is the crypto_id always equal to the block ID here?
-			// I think so, the xts id and the block id only differ when the
-			// volume has been converted from a HFS/FileVault volume, which
-			// used CoreStorage. After conversions, the block numbers do not
-			// match anymore, since the CoreStorage data has been removed
-			// and assigned to the apfs volume. But the metadata is always
-			// fresh and therefore the ids should match.
-			if (!m_volume->ReadBlocks(blk.data(), omr.paddr, 1, (omr.flags & OMAP_VAL_ENCRYPTED) ? omr.paddr : 0))
+			BlockBuffer blk = buf.Slice((k - beg) * blksize, blksize);
+
+			if (!VerifyNodeBlock(blk.data(), pending[k].omr))
+				continue;
+
+			// A node must not keep the whole merged read alive after its neighbours are evicted,
+			// so it gets its own block. Mapped memory isn't owned and can be shared.
+			if (cnt > 1 && !buf.borrowed())
 			{
-				std::cerr << "ERROR: GetNode: ReadBlocks failed!" << std::endl;
-				return node;
-			}
+				BlockBuffer own;
 
-			if (!(omr.flags & OMAP_VAL_NOHEADER)) {
-				if (!VerifyBlock(blk.data(), blk.size()))
+				if (!own.Alloc(blksize))
 				{
-					std::cerr << "ERROR: GetNode: VerifyBlock failed!" << std::endl;
-					if (g_debug & Dbg_Errors)
-						DumpHex(std::cerr, blk.data(), blk.size());
-					return node;
+					std::cerr << "ERROR: GetNode: Out of memory!" << std::endl;
+					continue;
 				}
-			} else {
-				/*
-				std::cout << "BTNode @ " << omr.paddr << ":" << std::endl;
-				DumpHex(std::cout, blk.data(), blk.size());
-				std::cout << std::endl;
-				*/
-			}
-		}
-		else
-		{
-			if (!m_container.ReadAndVerifyHeaderBlock(blk.data(), omr.paddr))
-			{
-				std::cerr << "ERROR: GetNode: ReadAndVerifyHeaderBlock failed!" << std::endl;
-				return node;
+
+				memcpy(own.data(), blk.data(), blksize);
+				blk = std::move(own);
 			}
+
+			nodes[pending[k].req] = BTreeNode::CreateNode(*this, blk, pending[k].omr.paddr);
+
+			if (cache)
+				CacheNode(oids[pending[k].req], nodes[pending[k].req]);
+
+			if (m_recorder)
+				m_recorder->Add(pending[k].omr.paddr, oids[pending[k].req], GetSubtype());
 		}
+	}
+}
+
+oid_t BTree::GetChildOid(const BTreeNode &node, const BTreeEntry &e) const
+{
+	if (node.flags() & BTNODE_HASHED) {
+		const btn_index_node_val_t *binv = reinterpret_cast<const btn_index_node_val_t *>(e.val);
+		return binv->binv_child_oid + m_oid;
+	} else {
+		assert(e.val_len == sizeof(oid_t));
+		return *reinterpret_cast<const oid_t *>(e.val);
+	}
+}
+
+std::shared_ptr<BTreeNode> BTree::FindCachedNode(oid_t oid)
+{
+	std::shared_ptr<BTreeNode> node;
+
+	if (!m_pinned.empty())
+	{
+		auto it = std::lower_bound(m_pinned.begin(), m_pinned.end(), oid, [](const std::pair<oid_t, std::shared_ptr<BTreeNode>> &p, oid_t o) { return p.first < o; });
+
+		if (it != m_pinned.end() && it->first == oid)
+			return it->second;
+	}
 
-		node = BTreeNode::CreateNode(*this, blk.data(), blk.size(), omr.paddr, parent, parent_index);
 #ifdef BTREE_USE_MAP
-		m_mutex.lock();
+	m_mutex.lock_shared();
+	auto it = m_nodes.find(oid);
 
-		if (m_nodes.size() > BTREE_MAP_MAX_NODES)
-		{
-#if 0
-			m_nodes.clear(); // TODO: Make this somewhat more intelligent ...
+	if (it != m_nodes.end())
+		node = it->second;
+
+	m_mutex.unlock_shared();
 #else
-			// This might be somewhat more intelligent ...
-			for (it = m_nodes.begin(); it != m_nodes.end();)
-			{
-				if (it->second.use_count() == 1)
-					it = m_nodes.erase(it);
-				else
-					++it;
-			}
+	(void)oid;
 #endif
+
+	return node;
+}
+
+const std::shared_ptr<BTreeNode> *BTree::PeekCachedNode(oid_t oid) const
+{
+	if (!m_pinned.empty())
+	{
+		auto it = std::lower_bound(m_pinned.begin(), m_pinned.end(), oid, [](const std::pair<oid_t, std::shared_ptr<BTreeNode>> &p, oid_t o) { return p.first < o; });
+
+		if (it != m_pinned.end() && it->first == oid)
+			return &it->second;
+	}
+
+#ifdef BTREE_USE_MAP
+	auto it = m_nodes.find(oid);
+
+	if (it != m_nodes.end())
+		return &it->second;
+#endif
+
+	return nullptr;
+}
+
+size_t BTree::GetCacheRoom()
+{
+	size_t room = 0;
+
+#ifdef BTREE_USE_MAP
+	m_mutex.lock_shared();
+	if (m_nodes.size() < BTREE_MAP_MAX_NODES)
+		room = BTREE_MAP_MAX_NODES - m_nodes.size();
+	m_mutex.unlock_shared();
+#endif
+
+	return room;
+}
+
+void BTree::CacheNode(oid_t oid, const std::shared_ptr<BTreeNode> &node)
+{
+#ifdef BTREE_USE_MAP
+	m_mutex.lock();
+
+	if (m_nodes.size() > BTREE_MAP_MAX_NODES)
+	{
+#if 0
+		m_nodes.clear(); // TODO: Make this somewhat more intelligent ...
+#else
+		// This might be somewhat more intelligent ...
+		for (auto it = m_nodes.begin(); it != m_nodes.end();)
+		{
+			if (it->second.use_count() == 1)
+				it = m_nodes.erase(it);
+			else
+				++it;
 		}
+#endif
+	}
 
-		m_nodes[oid] = node;
+	m_nodes[oid] = node;
 
-		m_mutex.unlock();
+	m_mutex.unlock();
+#else
+	(void)oid;
+	(void)node;
 #endif
+}
+
+bool BTree::MapNode(omap_res_t &omr, oid_t oid)
+{
+	omr.oid = oid;
+	omr.xid = m_xid;
+	omr.flags = 0;
+	omr.size = m_treeinfo.bt_fixed.bt_node_size;
+	omr.paddr = oid;
+
+	if (m_omap)
+	{
+		if (g_debug & Dbg_Info) {
+			std::cout << "omap: oid=" << omr.oid << " xid=" << omr.xid << " flags=" << omr.flags << " size=" << omr.size << " paddr=" << omr.paddr << std::endl;
+		}
+
+		if (!m_omap->Lookup(omr, oid, m_xid))
+		{
+			std::cerr << "ERROR: GetNode: omap entry oid " << std::hex << oid << " xid " << m_xid << " not found." << std::endl;
+			return false;
+		}
 	}
 
-	return node;
+	return true;
+}
+
+void BTree::MapNodes(std::vector<omap_res_t> &omrs, const std::vector<oid_t> &oids)
+{
+	size_t k;
+
+	if (!m_omap)
+	{
+		omrs.resize(oids.size());
+
+		for (k = 0; k < oids.size(); k++)
+		{
+			omrs[k].oid = oids[k];
+			omrs[k].xid = m_xid;
+			omrs[k].flags = 0;
+			omrs[k].size = m_treeinfo.bt_fixed.bt_node_size;
+			omrs[k].paddr = oids[k];
+		}
+
+		return;
+	}
+
+	if (oids.empty())
+	{
+		omrs.clear();
+		return;
+	}
+
+	if (m_omap->LookupBatch(omrs, oids, m_xid) == oids.size())
+		return;
+
+	for (k = 0; k < oids.size(); k++)
+	{
+		if (omrs[k].paddr == 0)
+			std::cerr << "ERROR: GetNode: omap entry oid " << std::hex << oids[k] << " xid " << m_xid << " not found." << std::endl;
+	}
+}
+
+bool BTree::ReadNodeBuffer(BlockBuffer &buf, const omap_res_t &omr, uint64_t blkcnt)
+{
+	const size_t size = blkcnt * m_container.GetBlocksize();
+	const uint8_t *mapped = nullptr;
+
+	// Encrypted nodes are decrypted into a buffer of their own, everything else
+	// can be used straight from the device mapping if there is one.
+	if (!(m_volume && (omr.flags & OMAP_VAL_ENCRYPTED)))
+		mapped = m_container.MapBlocks(omr.paddr, blkcnt);
+
+	if (mapped)
+	{
+		buf.Borrow(mapped, size);
+		return true;
+	}
+
+	if (!buf.Alloc(size))
+	{
+		std::cerr << "ERROR: GetNode: Out of memory!" << std::endl;
+		return false;
+	}
+
+	return ReadNodeBlocks(buf.data(), omr, blkcnt);
+}
+
+bool BTree::ReadNodeBlocks(uint8_t *data, const omap_res_t &omr, uint64_t blkcnt)
+{
+	if (m_volume)
+	{
+		// TODO: is the crypto_id always equal to the block ID here?
+		// I think so, the xts id and the block id only differ when the
+		// volume has been converted from a HFS/FileVault volume, which
+		// used CoreStorage. After conversions, the block numbers do not
+		// match anymore, since the CoreStorage data has been removed
+		// and assigned to the apfs volume. But the metadata is always
+		// fresh and therefore the ids should match.
+		if (!m_volume->ReadBlocks(data, omr.paddr, blkcnt, (omr.flags & OMAP_VAL_ENCRYPTED) ? omr.paddr : 0))
+		{
+			std::cerr << "ERROR: GetNode: ReadBlocks failed!" << std::endl;
+			return false;
+		}
+	}
+	else
+	{
+		if (!m_container.ReadBlocks(data, omr.paddr, blkcnt))
+		{
+			std::cerr << "ERROR: GetNode: ReadBlocks failed!" << std::endl;
+			return false;
+		}
+	}
+
+	return true;
+}
+
+bool BTree::VerifyNodeBlock(const uint8_t *data, const omap_res_t &omr)
+{
+	const size_t blksize = m_container.GetBlocksize();
+
+	if (m_volume && (omr.flags & OMAP_VAL_NOHEADER))
+	{
+		/*
+		std::cout << "BTNode @ " << omr.paddr << ":" << std::endl;
+		DumpHex(std::cout, data, blksize);
+		std::cout << std::endl;
+		*/
+		return true;
+	}
+
+	if (!VerifyBlock(data, blksize))
+	{
+		std::cerr << "ERROR: GetNode: VerifyBlock failed!" << std::endl;
+		if (g_debug & Dbg_Errors)
+			DumpHex(std::cerr, data, blksize);
+		return false;
+	}
+
+	return true;
 }
 
 uint32_t BTree::Find(const std::shared_ptr<BTreeNode> &node, const void *key, size_t key_size, BTCompareFunc func, void *context)
@@ -557,19 +1322,40 @@ uint32_t BTree::Find(const std::shared_ptr<BTreeNode> &node, const void *key, si
 	return k;
 }
 
-int BTree::FindBin(const std::shared_ptr<BTreeNode>& node, const void* key, size_t key_size, BTCompareFunc func, void *context, FindMode mode)
+int BTree::FindBin(const BTreeNode &node, const void* key, size_t key_size, BTCompareFunc func, void *context, FindMode mode)
 {
 	static const char resstr[3] = { '<', '=', '>' };
 
 	int beg;
 	int end;
 	int mid = -1;
-	int cnt = node->entries_cnt();
+	int cnt = node.entries_cnt();
 	int res;
 
 	BTreeEntry e;
 	int rc;
 
+	if (!m_debug)
+	{
+		switch (m_key_type)
+		{
+		case KeyType::OMap:
+			if (key_size == sizeof(omap_key_t))
+				return FindBinDispatch(node, OMapKeyCmp(key), mode);
+			break;
+		case KeyType::FextTree:
+			if (key_size == sizeof(fext_tree_key_t))
+				return FindBinDispatch(node, FextKeyCmp(key), mode);
+			break;
+		case KeyType::FsTree:
+			if (key_size >= sizeof(j_key_t))
+				return FindBinDispatch(node, JKeyCmp(key, key_size, func, context), mode);
+			break;
+		default:
+			break;
+		}
+	}
+
 	if (cnt <= 0)
 		return -1;
 
@@ -586,7 +1372,7 @@ int BTree::FindBin(const std::shared_ptr<BTreeNode>& node, const void* key, size
 	{
 		mid = (beg + end) / 2;
 
-		node->GetEntry(e, mid);
+		node.GetEntry(e, mid);
 		rc = func(key, key_size, e.key, e.key_len, context);
 
 		if (m_debug)
@@ -611,6 +1397,64 @@ int BTree::FindBin(const std::shared_ptr<BTreeNode>& node, const void* key, size
 		std::cout << " => " << resstr[rc + 1] << ", " << mid;
 	}
 
+	res = FindBinResult(rc, mid, cnt, mode);
+
+	if (m_debug)
+		std::cout << " => " << res << std::endl;
+
+	return res;
+}
+
+template <class Cmp>
+int BTree::FindBinDispatch(const BTreeNode &node, const Cmp &cmp, FindMode mode)
+{
+	// CreateNode picks the node class by this flag, so the downcast is safe.
+	if (node.flags() & BTNODE_FIXED_KV_SIZE)
+		return FindBinKernel(static_cast<const BTreeNodeFix &>(node), cmp, mode);
+	else
+		return FindBinKernel(static_cast<const BTreeNodeVar &>(node), cmp, mode);
+}
+
+template <class Node, class Cmp>
+int BTree::FindBinKernel(const Node &node, const Cmp &cmp, FindMode mode)
+{
+	int beg;
+	int end;
+	int mid = -1;
+	int cnt = node.entries_cnt();
+	int rc = 0;
+	const uint8_t *ekey;
+	size_t ekey_len;
+
+	if (cnt <= 0)
+		return -1;
+
+	beg = 0;
+	end = cnt - 1;
+
+	while (beg <= end)
+	{
+		mid = (beg + end) / 2;
+
+		ekey = node.KeyAt(mid, ekey_len);
+		rc = cmp(ekey, ekey_len);
+
+		if (rc == 0)
+			break;
+
+		if (rc < 0)
+			beg = mid + 1;
+		else
+			end = mid - 1;
+	}
+
+	return FindBinResult(rc, mid, cnt, mode);
+}
+
+int BTree::FindBinResult(int rc, int mid, int cnt, FindMode mode)
+{
+	int res;
+
 	switch (mode)
 	{
 	case FindMode::EQ:
@@ -637,9 +1481,6 @@ int BTree::FindBin(const std::shared_ptr<BTreeNode>& node, const void* key, size
 	if (res == cnt)
 		res = -1;
 
-	if (m_debug)
-		std::cout << " => " << res << std::endl;
-
 	return res;
 }
 
@@ -647,24 +1488,22 @@ BTreeIterator::BTreeIterator()
 {
 	m_tree = nullptr;
 	m_index = 0;
-}
-
-BTreeIterator::BTreeIterator(BTree *tree, const std::shared_ptr<BTreeNode> &node, uint32_t index)
-{
-	m_tree = tree;
-	m_node = node;
-	m_index = index;
+	m_readahead_pos = 0;
 }
 
 BTreeIterator::~BTreeIterator()
 {
 }
 
-void BTreeIterator::Setup(BTree* tree, const std::shared_ptr<BTreeNode>& node, uint32_t index)
+void BTreeIterator::Setup(BTree* tree, std::vector<PathEntry> &path, const std::shared_ptr<BTreeNode>& node, uint32_t index)
 {
 	m_tree = tree;
 	m_node = node;
 	m_index = index;
+	m_path.swap(path);
+	path.clear();
+	m_readahead.clear();
+	m_readahead_pos = 0;
 }
 
 
@@ -693,6 +1532,9 @@ void BTreeIterator::reset()
 	m_tree = nullptr;
 	m_node.reset();
 	m_index = 0;
+	m_path.clear();
+	m_readahead.clear();
+	m_readahead_pos = 0;
 }
 
 bool BTreeIterator::GetEntry(BTreeEntry& res) const
@@ -712,45 +1554,111 @@ std::shared_ptr<BTreeNode> BTreeIterator::next_node()
 	BTreeEntry e;
 	oid_t oid;
 
-	node = m_node;
+	if (m_readahead_pos < m_readahead.size())
+	{
+		m_path.back().index++;
+		return m_readahead[m_readahead_pos++];
+	}
+
+	if (m_tree->m_iter_readahead > 0)
+	{
+		node = read_ahead();
+		if (node)
+			return node;
+	}
 
 #ifdef BTITDBG
 	std::cout << "======== ******** BTreeIterator::next_node() ******** ========" << std::endl;
-	std::cout << "  Current node: " << node->nodeid() << std::endl;
+	std::cout << "  Current node: " << m_node->nodeid() << std::endl;
 #endif
 
-	do {
-		pidx = node->parent_index();
-		node = node->parent();
-#ifdef BTITDBG
-		std::cout << "  Navigating up to node " << node->nodeid() << " index " << pidx << std::endl;
-#endif
-		pidx++;
-	} while (node && pidx >= node->entries_cnt());
+	while (!m_path.empty() && m_path.back().index + 1 >= m_path.back().node->entries_cnt())
+		m_path.pop_back();
 
-	if (!node)
+	if (m_path.empty())
 		return std::shared_ptr<BTreeNode>();
 
-	while (node->level() > 0) {
-		node->GetEntry(e, pidx);
+	node = m_path.back().node;
+	pidx = ++m_path.back().index;
 
-		if (node->flags() & BTNODE_HASHED) {
-			const btn_index_node_val_t *binv = reinterpret_cast<const btn_index_node_val_t *>(e.val);
-			oid = binv->binv_child_oid + m_tree->m_oid;
-		} else {
-			oid = *reinterpret_cast<const uint64_t *>(e.val);
-		}
+#ifdef BTITDBG
+	std::cout << "  Navigating up to node " << node->nodeid() << " index " << pidx << std::endl;
+#endif
+
+	for (;;) {
+		node->GetEntry(e, pidx);
+		oid = m_tree->GetChildOid(*node, e);
 
 #ifdef BTITDBG
 		std::cout << "  Navigating down to node " << oid << std::endl;
 #endif
-		node = m_tree->GetNode(oid, node, pidx);
+		node = m_tree->GetNode(oid);
 
-		if (!node)
+		if (!node) {
 			std::cerr << "Failed to load btree node oid " << oid << std::endl;
+			break;
+		}
+
+		if (node->level() == 0)
+			break;
 
 		pidx = 0;
+		m_path.push_back({ node, pidx });
 	}
 
 	return node;
 }
+
+std::shared_ptr<BTreeNode> BTreeIterator::read_ahead()
+{
+	std::vector<oid_t> reqs;
+	BTreeEntry e;
+	uint32_t idx;
+	uint32_t end;
+	size_t k;
+
+	m_readahead.clear();
+	m_readahead_pos = 0;
+
+	if (m_path.empty())
+		return std::shared_ptr<BTreeNode>();
+
+	const std::shared_ptr<BTreeNode> &parent = m_path.back().node;
+
+	// Fetch the next siblings below the same parent in one go. Crossing to
+	// the next parent is left to the regular path in next_node().
+	idx = m_path.back().index + 1;
+	end = std::min(parent->entries_cnt(), idx + m_tree->m_iter_readahead);
+
+	for (; idx < end; idx++)
+	{
+		parent->GetEntry(e, idx);
+		reqs.push_back(m_tree->GetChildOid(*parent, e));
+	}
+
+	if (reqs.empty())
+		return std::shared_ptr<BTreeNode>();
+
+#ifdef BTITDBG
+	std::cout << "  Reading ahead " << reqs.size() << " nodes below " << parent->nodeid() << std::endl;
+#endif
+
+	m_tree->GetNodes(m_readahead, reqs);
+
+	// Stop at the first node that couldn't be loaded, the regular path will report it.
+	for (k = 0; k < m_readahead.size(); k++)
+	{
+		if (!m_readahead[k])
+		{
+			m_readahead.resize(k);
+			break;
+		}
+	}
+
+	if (m_readahead.empty())
+		return std::shared_ptr<BTreeNode>();
+
+	m_path.back().index++;
+	m_readahead_pos = 1;
+	return m_readahead[0];
+}
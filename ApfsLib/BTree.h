@@ -19,15 +19,18 @@
 
 #pragma once
 
+#include <atomic>
 #include <vector>
 #include <map>
 #include <memory>
 #include <mutex>
+#include <shared_mutex>
 
 #include "Global.h"
 #include "DiskStruct.h"
 
 #include "ApfsNodeMapper.h"
+#include "BlockBuffer.h"
 
 class BTree;
 class BTreeNode;
@@ -36,6 +39,7 @@ class BlockDumper;
 
 class ApfsContainer;
 class ApfsVolume;
+class HotListRecorder;
 
 // This enables a rudimentary disk cache ...
 #if !(defined(_LIBCPP_HAS_NO_THREADS) || defined(M1N1) || defined(__UBOOT__) || defined(JEV_BAREMETAL))
@@ -44,12 +48,24 @@ class ApfsVolume;
 // TODO: Think about a better solution.
 // 8192 will take max. 32 MB of RAM. Higher may be faster, but use more RAM.
 #define BTREE_MAP_MAX_NODES 8192
+// Maximum number of physically adjacent nodes fetched with a single read.
+#define BTREE_BATCH_MAX_BLOCKS 64
+// Number of sibling leaves an iterator fetches at once when it runs off the end of a leaf.
+#define BTREE_ITERATOR_READAHEAD 8
+// Alignment of the node arena of pinned trees.
+#define BTREE_PIN_ALIGN 64
 
 // ekey < skey: -1, ekey > skey: 1, ekey == skey: 0
 typedef int(*BTCompareFunc)(const void *skey, size_t skey_len, const void *ekey, size_t ekey_len, void *context);
 
 int CompareStdKey(const void *skey, size_t skey_len, const void *ekey, size_t ekey_len, void *context);
 
+struct BTreeKey
+{
+	const void *key;
+	size_t key_len;
+};
+
 class BTreeEntry
 {
 	friend class BTree;
@@ -74,10 +90,10 @@ private:
 class BTreeNode
 {
 protected:
-	BTreeNode(BTree &tree, const uint8_t *block, size_t blocksize, paddr_t paddr, const std::shared_ptr<BTreeNode> &parent, uint32_t parent_index);
+	BTreeNode(BTree &tree, const BlockBuffer &block, paddr_t paddr);
 
 public:
-	static std::shared_ptr<BTreeNode> CreateNode(BTree &tree, const uint8_t *block, size_t blocksize, paddr_t paddr, const std::shared_ptr<BTreeNode> &parent, uint32_t parent_index);
+	static std::shared_ptr<BTreeNode> CreateNode(BTree &tree, const BlockBuffer &block, paddr_t paddr);
 
 	virtual ~BTreeNode();
 
@@ -85,26 +101,21 @@ public:
 	uint32_t entries_cnt() const { return m_btn->btn_nkeys; }
 	uint16_t level() const { return m_btn->btn_level; }
 	uint16_t flags() const { return m_btn->btn_flags; }
+	uint32_t subtype() const { return m_btn->btn_o.o_subtype; }
 	paddr_t paddr() const { return m_paddr; }
 
-	const std::shared_ptr<BTreeNode> &parent() const { return m_parent; }
-	uint16_t parent_index() const { return m_parent_index; }
-
 	virtual bool GetEntry(BTreeEntry &result, uint32_t index) const = 0;
 	// virtual uint32_t Find(const void *key, size_t key_size, BTCompareFunc func) const = 0;
 
-	const std::vector<uint8_t> &block() const { return m_block; }
+	const BlockBuffer &block() const { return m_block; }
 
 protected:
-	std::vector<uint8_t> m_block;
+	BlockBuffer m_block;
 	BTree &m_tree;
 
 	uint16_t m_keys_start; // Up
 	uint16_t m_vals_start; // Dn
 
-	const uint32_t m_parent_index;
-	const std::shared_ptr<BTreeNode> m_parent;
-
 	const paddr_t m_paddr;
 
 	const btree_node_phys_t *m_btn;
@@ -113,11 +124,14 @@ protected:
 class BTreeNodeFix : public BTreeNode
 {
 public:
-	BTreeNodeFix(BTree &tree, const uint8_t *block, size_t blocksize, paddr_t paddr, const std::shared_ptr<BTreeNode> &parent, uint32_t parent_index);
+	BTreeNodeFix(BTree &tree, const BlockBuffer &block, paddr_t paddr);
 
 	bool GetEntry(BTreeEntry &result, uint32_t index) const override;
 	// uint32_t Find(const void *key, size_t key_size, BTCompareFunc func) const override;
 
+	// Non-virtual key access for the search kernels, index must be valid.
+	const uint8_t *KeyAt(uint32_t index, size_t &key_len) const;
+
 private:
 	const kvoff_t *m_entries;
 };
@@ -125,11 +139,14 @@ private:
 class BTreeNodeVar : public BTreeNode
 {
 public:
-	BTreeNodeVar(BTree &tree, const uint8_t *block, size_t blocksize, paddr_t paddr, const std::shared_ptr<BTreeNode> &parent, uint32_t parent_index);
+	BTreeNodeVar(BTree &tree, const BlockBuffer &block, paddr_t paddr);
 
 	bool GetEntry(BTreeEntry &result, uint32_t index) const override;
 	// uint32_t Find(const void *key, size_t key_size, BTCompareFunc func) const override;
 
+	// Non-virtual key access for the search kernels, index must be valid.
+	const uint8_t *KeyAt(uint32_t index, size_t &key_len) const;
+
 private:
 	const kvloc_t *m_entries;
 };
@@ -145,16 +162,49 @@ class BTree
 		GT
 	};
 
+	// Key layouts with a specialized search kernel, derived from the root node subtype.
+	enum class KeyType
+	{
+		Generic,
+		OMap,
+		FsTree,
+		FextTree
+	};
+
 	friend class BTreeIterator;
+	friend class BTreeDiff;
 public:
 	BTree(ApfsContainer &container, ApfsVolume *vol = nullptr);
 	~BTree();
 
 	bool Init(oid_t oid_root, xid_t xid, ApfsNodeMapper *omap = nullptr);
 
-	bool Lookup(BTreeEntry &result, const void *key, size_t key_size, BTCompareFunc func, void *context, bool exact);
+	// If not_found is given, it is set when the search completed without a match, as opposed to a read error.
+	bool Lookup(BTreeEntry &result, const void *key, size_t key_size, BTCompareFunc func, void *context, bool exact, bool *not_found = nullptr);
+	// Looks up several keys with shared descents. results[k] belongs to keys[k] and is
+	// cleared (key == nullptr) if nothing was found. Returns the number of keys found.
+	size_t LookupBatch(std::vector<BTreeEntry> &results, const std::vector<BTreeKey> &keys, BTCompareFunc func, void *context, bool exact);
 	bool GetIterator(BTreeIterator &it, const void *key, size_t key_size, BTCompareFunc func, void *context);
 	bool GetIteratorBegin(BTreeIterator &it);
+	// Keys of the highest index level with at least min_cnt entries (or of the level above
+	// the leaves), without the first one. They split the tree into ranges of similar size.
+	void GetSplitKeys(std::vector<std::vector<uint8_t>> &keys, size_t min_cnt);
+
+	// Loads the top levels of the tree (0: all of them) into the node cache, a level at a
+	// time in physical order, as long as the cache has room. Returns the number of nodes.
+	size_t Prewarm(unsigned int levels, const std::atomic<bool> *stop = nullptr);
+	// Loads the given nodes into the node cache, as long as it has room.
+	size_t Prefetch(const std::vector<oid_t> &oids, const std::atomic<bool> *stop = nullptr);
+	uint32_t GetSubtype() const { return m_root_node ? m_root_node->subtype() : 0; }
+
+	// Every node read from disk from now on is added to rec, nullptr stops recording.
+	void SetRecorder(HotListRecorder *rec);
+
+	// Copies all nodes of the tree into one arena. They stay there until the tree is
+	// destroyed and are found without locking, the node cache isn't used anymore.
+	bool Pin();
+	bool IsPinned() const { return !m_pinned.empty(); }
+	size_t GetPinnedSize() const { return m_pin_size; }
 
 	uint16_t GetKeyLen() const { return m_treeinfo.bt_fixed.bt_key_size; }
 	uint16_t GetValLen() const { return m_treeinfo.bt_fixed.bt_val_size; }
@@ -163,12 +213,33 @@ public:
 
 	void EnableDebugOutput() { m_debug = true; }
 
+	// 0 disables the sibling leaf readahead of iterators.
+	void SetIteratorReadahead(uint32_t nodes) { m_iter_readahead = nodes; }
+	uint32_t GetIteratorReadahead() const { return m_iter_readahead; }
+
 private:
 	void DumpTreeInternal(BlockDumper &out, const std::shared_ptr<BTreeNode> &node);
 	uint32_t Find(const std::shared_ptr<BTreeNode> &node, const void *key, size_t key_size, BTCompareFunc func, void *context);
-	int FindBin(const std::shared_ptr<BTreeNode> &node, const void *key, size_t key_size, BTCompareFunc func, void *context, FindMode mode);
-
-	std::shared_ptr<BTreeNode> GetNode(oid_t oid, const std::shared_ptr<BTreeNode> &parent, uint32_t parent_index);
+	int FindBin(const BTreeNode &node, const void *key, size_t key_size, BTCompareFunc func, void *context, FindMode mode);
+	template <class Cmp> static int FindBinDispatch(const BTreeNode &node, const Cmp &cmp, FindMode mode);
+	template <class Node, class Cmp> static int FindBinKernel(const Node &node, const Cmp &cmp, FindMode mode);
+	static int FindBinResult(int rc, int mid, int cnt, FindMode mode);
+
+	std::shared_ptr<BTreeNode> GetNode(oid_t oid);
+	void GetNodes(std::vector<std::shared_ptr<BTreeNode>> &nodes, const std::vector<oid_t> &oids, bool cache = true);
+
+	oid_t GetChildOid(const BTreeNode &node, const BTreeEntry &e) const;
+	std::shared_ptr<BTreeNode> FindCachedNode(oid_t oid);
+	// Cache entry of a node without taking a reference, the caller holds m_mutex (shared).
+	const std::shared_ptr<BTreeNode> *PeekCachedNode(oid_t oid) const;
+	size_t GetCacheRoom();
+	void CacheNode(oid_t oid, const std::shared_ptr<BTreeNode> &node);
+	bool MapNode(omap_res_t &omr, oid_t oid);
+	// Like MapNode for several oids, with one batched omap lookup. omrs[k].paddr is 0 if oids[k] isn't mapped.
+	void MapNodes(std::vector<omap_res_t> &omrs, const std::vector<oid_t> &oids);
+	bool ReadNodeBuffer(BlockBuffer &buf, const omap_res_t &omr, uint64_t blkcnt);
+	bool ReadNodeBlocks(uint8_t *data, const omap_res_t &omr, uint64_t blkcnt);
+	bool VerifyNodeBlock(const uint8_t *data, const omap_res_t &omr);
 
 	ApfsContainer &m_container;
 	ApfsVolume *m_volume;
@@ -177,22 +248,37 @@ private:
 	ApfsNodeMapper *m_omap;
 
 	btree_info_t m_treeinfo;
+	KeyType m_key_type;
 
 	oid_t m_oid;
 	xid_t m_xid;
 	bool m_debug;
+	uint32_t m_iter_readahead;
+	HotListRecorder *m_recorder;
+
+	// Sorted by oid, immutable once Pin is done.
+	std::vector<std::pair<oid_t, std::shared_ptr<BTreeNode>>> m_pinned;
+	uint8_t *m_pin_arena;
+	size_t m_pin_size;
 
 #ifdef BTREE_USE_MAP
 	std::map<uint64_t, std::shared_ptr<BTreeNode>> m_nodes;
-	std::mutex m_mutex;
+	// Shared for lookups, exclusive for changes. Eviction needs the exclusive lock, so a node
+	// found while holding the shared lock stays valid until it is released.
+	std::shared_mutex m_mutex;
 #endif
 };
 
 class BTreeIterator
 {
 public:
+	struct PathEntry
+	{
+		std::shared_ptr<BTreeNode> node;
+		uint32_t index;
+	};
+
 	BTreeIterator();
-	BTreeIterator(BTree *tree, const std::shared_ptr<BTreeNode> &node, uint32_t index);
 	~BTreeIterator();
 
 	bool next();
@@ -200,12 +286,20 @@ public:
 
 	bool GetEntry(BTreeEntry &res) const;
 
-	void Setup(BTree *tree, const std::shared_ptr<BTreeNode> &node, uint32_t index);
+	// path holds the index nodes from the root down to the parent of node,
+	// each with the index of the child taken. It is moved into the iterator.
+	void Setup(BTree *tree, std::vector<PathEntry> &path, const std::shared_ptr<BTreeNode> &node, uint32_t index);
 
 private:
 	BTree *m_tree;
 	std::shared_ptr<BTreeNode> m_node;
 	uint32_t m_index;
 
+	std::vector<PathEntry> m_path;
+
+	std::vector<std::shared_ptr<BTreeNode>> m_readahead;
+	size_t m_readahead_pos;
+
 	std::shared_ptr<BTreeNode> next_node();
+	std::shared_ptr<BTreeNode> read_ahead();
 };
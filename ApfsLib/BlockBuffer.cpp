@@ -0,0 +1,237 @@
+/*
+	This file is part of apfs-fuse, a read-only implementation of APFS
+	(Apple File System) for FUSE.
+	Copyright (C) 2017 Simon Gander
+
+	Apfs-fuse is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 2 of the License, or
+	(at your option) any later version.
+
+	Apfs-fuse is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with apfs-fuse.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <cstddef>
+#include <new>
+
+#include "BlockBuffer.h"
+
+#if !(defined(_LIBCPP_HAS_NO_THREADS) || defined(M1N1) || defined(__UBOOT__) || defined(JEV_BAREMETAL))
+#define BLOCKBUFFER_USE_MUTEX
+#endif
+
+#ifdef BLOCKBUFFER_USE_MUTEX
+#include <atomic>
+#include <mutex>
+#endif
+
+// Smallest pooled chunk, and number of power of two size classes.
+static constexpr unsigned int kMinShift = 9;
+static constexpr unsigned int kBuckets = 64;
+
+struct BlockBuffer::Chunk
+{
+#ifdef BLOCKBUFFER_USE_MUTEX
+	std::atomic<uint32_t> refcnt;
+#else
+	uint32_t refcnt;
+#endif
+	uint32_t shift;
+	Chunk *next;
+
+	// Keeps the data behind the header 16-byte aligned.
+	alignas(16) uint8_t data[1];
+};
+
+struct BlockBuffer::Pool
+{
+	Chunk *free_list[kBuckets] = {};
+	size_t idle_bytes = 0;
+#ifdef BLOCKBUFFER_USE_MUTEX
+	std::mutex mutex;
+#endif
+};
+
+BlockBuffer::BlockBuffer() : m_chunk(nullptr), m_data(nullptr), m_size(0)
+{
+}
+
+BlockBuffer::BlockBuffer(const BlockBuffer &o) : m_chunk(o.m_chunk), m_data(o.m_data), m_size(o.m_size)
+{
+	if (m_chunk)
+		m_chunk->refcnt++;
+}
+
+BlockBuffer::BlockBuffer(BlockBuffer &&o) noexcept : m_chunk(o.m_chunk), m_data(o.m_data), m_size(o.m_size)
+{
+	o.m_chunk = nullptr;
+	o.m_data = nullptr;
+	o.m_size = 0;
+}
+
+BlockBuffer::~BlockBuffer()
+{
+	reset();
+}
+
+BlockBuffer &BlockBuffer::operator=(const BlockBuffer &o)
+{
+	if (this != &o)
+	{
+		if (o.m_chunk)
+			o.m_chunk->refcnt++;
+		reset();
+		m_chunk = o.m_chunk;
+		m_data = o.m_data;
+		m_size = o.m_size;
+	}
+
+	return *this;
+}
+
+BlockBuffer &BlockBuffer::operator=(BlockBuffer &&o) noexcept
+{
+	if (this != &o)
+	{
+		reset();
+		m_chunk = o.m_chunk;
+		m_data = o.m_data;
+		m_size = o.m_size;
+		o.m_chunk = nullptr;
+		o.m_data = nullptr;
+		o.m_size = 0;
+	}
+
+	return *this;
+}
+
+bool BlockBuffer::Alloc(size_t size)
+{
+	Pool &pool = GetPool();
+	Chunk *chunk = nullptr;
+	unsigned int shift = kMinShift;
+
+	reset();
+
+	while (shift < kBuckets - 1 && (static_cast<size_t>(1) << shift) < size)
+		shift++;
+
+	{
+#ifdef BLOCKBUFFER_USE_MUTEX
+		std::lock_guard<std::mutex> lock(pool.mutex);
+#endif
+		chunk = pool.free_list[shift];
+		if (chunk)
+		{
+			pool.free_list[shift] = chunk->next;
+			pool.idle_bytes -= static_cast<size_t>(1) << shift;
+		}
+	}
+
+	if (!chunk)
+	{
+		void *mem = ::operator new(offsetof(Chunk, data) + (static_cast<size_t>(1) << shift), std::nothrow);
+		if (!mem)
+			return false;
+		chunk = new (mem) Chunk;
+		chunk->shift = shift;
+	}
+
+	chunk->refcnt = 1;
+	chunk->next = nullptr;
+
+	m_chunk = chunk;
+	m_data = chunk->data;
+	m_size = size;
+
+	return true;
+}
+
+void BlockBuffer::Borrow(const uint8_t *data, size_t size)
+{
+	reset();
+
+	m_data = const_cast<uint8_t *>(data);
+	m_size = size;
+}
+
+BlockBuffer BlockBuffer::Slice(size_t offs, size_t size) const
+{
+	BlockBuffer buf(*this);
+
+	buf.m_data += offs;
+	buf.m_size = size;
+
+	return buf;
+}
+
+void BlockBuffer::reset()
+{
+	if (m_chunk && --m_chunk->refcnt == 0)
+		Release(m_chunk);
+
+	m_chunk = nullptr;
+	m_data = nullptr;
+	m_size = 0;
+}
+
+void BlockBuffer::Trim()
+{
+	Pool &pool = GetPool();
+	Chunk *chunk;
+	unsigned int k;
+
+#ifdef BLOCKBUFFER_USE_MUTEX
+	std::lock_guard<std::mutex> lock(pool.mutex);
+#endif
+
+	for (k = 0; k < kBuckets; k++)
+	{
+		while (pool.free_list[k])
+		{
+			chunk = pool.free_list[k];
+			pool.free_list[k] = chunk->next;
+			chunk->~Chunk();
+			::operator delete(chunk);
+		}
+	}
+
+	pool.idle_bytes = 0;
+}
+
+BlockBuffer::Pool &BlockBuffer::GetPool()
+{
+	// Never destroyed, buffers may still be released during static destruction.
+	static Pool *pool = new Pool();
+
+	return *pool;
+}
+
+void BlockBuffer::Release(Chunk *chunk)
+{
+	Pool &pool = GetPool();
+	const size_t size = static_cast<size_t>(1) << chunk->shift;
+
+	{
+#ifdef BLOCKBUFFER_USE_MUTEX
+		std::lock_guard<std::mutex> lock(pool.mutex);
+#endif
+		if (pool.idle_bytes + size <= BLOCKBUFFER_POOL_MAX_BYTES)
+		{
+			chunk->next = pool.free_list[chunk->shift];
+			pool.free_list[chunk->shift] = chunk;
+			pool.idle_bytes += size;
+			return;
+		}
+	}
+
+	chunk->~Chunk();
+	::operator delete(chunk);
+}
@@ -0,0 +1,72 @@
+/*
+	This file is part of apfs-fuse, a read-only implementation of APFS
+	(Apple File System) for FUSE.
+	Copyright (C) 2017 Simon Gander
+
+	Apfs-fuse is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 2 of the License, or
+	(at your option) any later version.
+
+	Apfs-fuse is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with apfs-fuse.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// Pooled read buffers are recycled while less than this many bytes of them are idle.
+#define BLOCKBUFFER_POOL_MAX_BYTES (16 * 1024 * 1024)
+
+// Refcounted handle to block data. The memory either comes from a pool of
+// recycled buffers, or is borrowed from a device mapping that outlives all
+// handles to it. Copies share the memory.
+class BlockBuffer
+{
+	struct Chunk;
+	struct Pool;
+
+public:
+	BlockBuffer();
+	BlockBuffer(const BlockBuffer &o);
+	BlockBuffer(BlockBuffer &&o) noexcept;
+	~BlockBuffer();
+
+	BlockBuffer &operator=(const BlockBuffer &o);
+	BlockBuffer &operator=(BlockBuffer &&o) noexcept;
+
+	// Allocates size bytes from the pool. The contents are undefined.
+	bool Alloc(size_t size);
+	// Refers to memory owned by someone else.
+	void Borrow(const uint8_t *data, size_t size);
+	// Handle to a part of this buffer, sharing its memory.
+	BlockBuffer Slice(size_t offs, size_t size) const;
+	void reset();
+
+	// Writing is only allowed to memory obtained by Alloc.
+	uint8_t *data() { return m_data; }
+	const uint8_t *data() const { return m_data; }
+	size_t size() const { return m_size; }
+	bool empty() const { return m_size == 0; }
+	// True if the memory belongs to someone else (see Borrow).
+	bool borrowed() const { return m_data && !m_chunk; }
+
+	// Releases all idle pooled memory.
+	static void Trim();
+
+private:
+	static Pool &GetPool();
+	static void Release(Chunk *chunk);
+
+	Chunk *m_chunk;
+	uint8_t *m_data;
+	size_t m_size;
+};
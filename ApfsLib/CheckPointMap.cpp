@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <cassert>
 
 #include "ApfsContainer.h"
@@ -9,6 +10,8 @@ CheckPointMap::CheckPointMap(ApfsContainer& container) : m_container(container)
 {
 	m_cpm_oid = 0;
 	m_blksize = 0;
+	m_index_mask = 0;
+	m_index_shift = 64;
 }
 
 CheckPointMap::~CheckPointMap()
@@ -22,6 +25,7 @@ bool CheckPointMap::Init(oid_t root_oid, uint32_t blk_count)
 
 	m_blksize = m_container.GetBlocksize();
 	m_cpm_data.resize(m_blksize * blk_count);
+	m_index.clear();
 
 	for (n = 0; n < blk_count; n++)
 	{
@@ -44,40 +48,103 @@ bool CheckPointMap::Init(oid_t root_oid, uint32_t blk_count)
 
 	m_cpm_oid = root_oid;
 
+	BuildIndex();
+
 	return true;
 }
 
 bool CheckPointMap::Lookup(omap_res_t & res, oid_t oid, xid_t xid)
+{
+	uint64_t pos;
+	const HashSlot *slot;
+
+	(void)xid;
+
+	if (m_index.empty() || oid == 0)
+		return false;
+
+	pos = HashOid(oid) >> m_index_shift;
+
+	for (;;)
+	{
+		slot = &m_index[pos];
+
+		if (slot->oid == 0)
+			return false;
+
+		if (slot->oid == oid)
+		{
+			res.oid = slot->map->cpm_oid;
+			res.xid = slot->cpm->cpm_o.o_xid;
+			res.flags = 0;
+			res.size = slot->map->cpm_size;
+			res.paddr = slot->map->cpm_paddr;
+
+			return true;
+		}
+
+		pos = (pos + 1) & m_index_mask;
+	}
+}
+
+void CheckPointMap::BuildIndex()
 {
 	uint32_t blk_offs;
 	uint32_t k;
 	uint32_t cnt;
-	const checkpoint_map_phys_t * cpm;
+	uint32_t cnt_max;
+	size_t total = 0;
+	size_t size;
+	uint64_t pos;
+	const checkpoint_map_phys_t *cpm;
 
-	(void)xid;
+	cnt_max = (m_blksize - sizeof(checkpoint_map_phys_t)) / sizeof(checkpoint_mapping_t);
 
 	for (blk_offs = 0; blk_offs < m_cpm_data.size(); blk_offs += m_blksize)
 	{
 		cpm = reinterpret_cast<const checkpoint_map_phys_t *>(m_cpm_data.data() + blk_offs);
+		total += std::min<uint32_t>(cpm->cpm_count, cnt_max);
+	}
 
-		cnt = cpm->cpm_count;
+	// Keep the load factor at or below 50%, so probe sequences stay short.
+	size = 16;
+	m_index_shift = 60;
+	while (size < total * 2)
+	{
+		size <<= 1;
+		m_index_shift--;
+	}
+
+	m_index.assign(size, HashSlot{ 0, nullptr, nullptr });
+	m_index_mask = size - 1;
+
+	for (blk_offs = 0; blk_offs < m_cpm_data.size(); blk_offs += m_blksize)
+	{
+		cpm = reinterpret_cast<const checkpoint_map_phys_t *>(m_cpm_data.data() + blk_offs);
+		cnt = std::min<uint32_t>(cpm->cpm_count, cnt_max);
 
 		for (k = 0; k < cnt; k++)
 		{
-			if (oid == cpm->cpm_map[k].cpm_oid)
-			{
-				res.oid = cpm->cpm_map[k].cpm_oid;
-				res.xid = cpm->cpm_o.o_xid;
-				res.flags = 0;
-				res.size = cpm->cpm_map[k].cpm_size;
-				res.paddr = cpm->cpm_map[k].cpm_paddr;
+			const checkpoint_mapping_t &map = cpm->cpm_map[k];
+
+			if (map.cpm_oid == 0)
+				continue;
 
-				return true;
+			pos = HashOid(map.cpm_oid) >> m_index_shift;
+
+			// The linear scan used to return the first mapping of an oid,
+			// so duplicates further down are not inserted.
+			while (m_index[pos].oid != 0 && m_index[pos].oid != map.cpm_oid)
+				pos = (pos + 1) & m_index_mask;
+
+			if (m_index[pos].oid == 0)
+			{
+				m_index[pos].oid = map.cpm_oid;
+				m_index[pos].cpm = cpm;
+				m_index[pos].map = &map;
 			}
 		}
 	}
-
-	return false;
 }
 
 void CheckPointMap::dump(BlockDumper& bd)
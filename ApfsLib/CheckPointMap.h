@@ -20,8 +20,23 @@ public:
 	void dump(BlockDumper &bd);
 
 private:
+	struct HashSlot
+	{
+		oid_t oid;
+		const checkpoint_map_phys_t *cpm;
+		const checkpoint_mapping_t *map;
+	};
+
+	static uint64_t HashOid(oid_t oid) { return oid * 0x9E3779B97F4A7C15ULL; }
+	void BuildIndex();
+
 	ApfsContainer &m_container;
 	std::vector<uint8_t> m_cpm_data;
+	// Open addressing (linear probing) index over all cpm_map entries.
+	// Size is a power of 2, oid 0 marks an empty slot.
+	std::vector<HashSlot> m_index;
+	uint64_t m_index_mask;
+	int m_index_shift;
 	oid_t m_cpm_oid;
 	uint32_t m_blksize;
 };
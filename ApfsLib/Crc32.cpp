@@ -79,6 +79,22 @@ void Crc32::Calc(const uint8_t *data, size_t size)
 	}
 }
 
+uint32_t Crc32::Calc(uint32_t crc, const uint8_t *data, size_t size) const
+{
+	size_t i;
+
+	if (m_reflect) {
+		for (i = 0; i < size; i++)
+			crc = m_table[data[i] ^ (crc & 0xFF)] ^ (crc >> 8);
+	}
+	else {
+		for (i = 0; i < size; i++)
+			crc = m_table[data[i] ^ ((crc >> 24) & 0xFF)] ^ (crc << 8);
+	}
+
+	return crc;
+}
+
 void Crc32::CalcLE(uint8_t b)
 {
 	m_crc = m_table[b ^ (m_crc & 0xFF)] ^ (m_crc >> 8);
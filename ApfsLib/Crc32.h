@@ -32,6 +32,8 @@ public:
 	void SetCRC(uint32_t crc) { m_crc = crc; }
 	uint32_t GetCRC() const { return m_crc; }
 	void Calc(const uint8_t *data, size_t size);
+	// Stateless variant, safe to use from several threads on a shared instance.
+	uint32_t Calc(uint32_t crc, const uint8_t *data, size_t size) const;
 
 	uint32_t GetDataCRC(const uint8_t *data, size_t size, uint32_t initialXor, uint32_t finalXor);
 
@@ -21,6 +21,7 @@
 #include <iostream>
 #include <cstring>
 #include <cassert>
+#include <algorithm>
 
 #include "Decmpfs.h"
 #include "Endian.h"
@@ -50,6 +51,55 @@ struct CmpfRsrc
 	CmpfRsrcEntry entry[32];
 };
 
+// Amount of the resource fork read at once during decompression.
+#define DECMPFS_RSRC_WINDOW 0x100000
+
+// Reads the resource fork through a window. The chunks are decompressed front to back,
+// so the fork never has to be in memory as a whole. A fork that was already read is used in place.
+class RsrcReader
+{
+public:
+	RsrcReader(ApfsDir &dir, const ApfsDir::XAttrRec &xattr) : m_dir(&dir), m_xattr(&xattr), m_data(nullptr), m_size(xattr.attr.size()), m_buf_offs(0), m_buf_size(0) {}
+	RsrcReader(const uint8_t *data, size_t size) : m_dir(nullptr), m_xattr(nullptr), m_data(data), m_size(size), m_buf_offs(0), m_buf_size(0) {}
+
+	// Returns size bytes at offs, valid until the next call. nullptr if out of range or on a read error.
+	const uint8_t *Get(uint64_t offs, size_t size)
+	{
+		size_t read;
+
+		if (offs > m_size || size > m_size - offs)
+			return nullptr;
+
+		if (!m_dir)
+			return m_data + offs;
+
+		if (offs >= m_buf_offs && offs + size <= m_buf_offs + m_buf_size)
+			return m_buf.data() + (offs - m_buf_offs);
+
+		m_buf.resize(std::max<size_t>(size, DECMPFS_RSRC_WINDOW));
+		m_buf_size = 0;
+
+		if (!m_dir->ReadAttribute(m_buf.data(), read, *m_xattr, offs, m_buf.size()) || read < size)
+			return nullptr;
+
+		m_buf_offs = offs;
+		m_buf_size = read;
+
+		return m_buf.data();
+	}
+
+	uint64_t size() const { return m_size; }
+
+private:
+	ApfsDir *m_dir;
+	const ApfsDir::XAttrRec *m_xattr;
+	const uint8_t *m_data;
+	uint64_t m_size;
+	std::vector<uint8_t> m_buf;
+	uint64_t m_buf_offs;
+	size_t m_buf_size;
+};
+
 bool IsDecompAlgoSupported(uint16_t algo)
 {
 	switch (algo)
@@ -76,22 +126,43 @@ bool IsDecompAlgoInRsrc(uint16_t algo)
 	}
 }
 
-bool DecompressFile(ApfsDir &dir, uint64_t ino, std::vector<uint8_t> &decompressed, const std::vector<uint8_t> &compressed)
+DecmpfsStream::DecmpfsStream(ApfsDir &dir, const ApfsDir::XAttrRec *rsrc, const std::vector<uint8_t> &compressed) :
+	m_compressed(compressed), m_size(0), m_algo(0)
+{
+	if (rsrc)
+		m_rsrc.reset(new RsrcReader(dir, *rsrc));
+}
+
+DecmpfsStream::DecmpfsStream(const std::vector<uint8_t> &compressed, const std::vector<uint8_t> &rsrc) :
+	m_rsrc(new RsrcReader(rsrc.data(), rsrc.size())), m_compressed(compressed), m_size(0), m_algo(0)
+{
+}
+
+DecmpfsStream::~DecmpfsStream()
 {
-	if (compressed.size() < sizeof(CompressionHeader))
+}
+
+bool DecmpfsStream::Init()
+{
+	const CompressionHeader *hdr;
+	const uint8_t *p;
+	size_t nchunks;
+	size_t k;
+
+	m_chunks.clear();
+
+	if (m_compressed.size() < sizeof(CompressionHeader))
 		return false;
 
-	const CompressionHeader *hdr = reinterpret_cast<const CompressionHeader *>(compressed.data());
-	const uint8_t *cdata = compressed.data() + sizeof(CompressionHeader);
-	size_t csize = compressed.size() - sizeof(CompressionHeader);
-	size_t decoded_bytes = 0;
+	hdr = reinterpret_cast<const CompressionHeader *>(m_compressed.data());
+	m_algo = hdr->algo;
+	m_size = hdr->size;
 
-#if 1 // Disable to get compressed data
 	if (g_debug & Dbg_Cmpfs)
 	{
-		std::cout << "DecompressFile " << compressed.size() << " => " << hdr->size << ", algo = " << hdr->algo;
+		std::cout << "DecompressFile " << m_compressed.size() << " => " << m_size << ", algo = " << m_algo;
 
-		switch (hdr->algo)
+		switch (m_algo)
 		{
 		case 3: std::cout << " (Zlib, Attr)"; break;
 		case 4: std::cout << " (Zlib, Rsrc)"; break;
@@ -103,185 +174,351 @@ bool DecompressFile(ApfsDir &dir, uint64_t ino, std::vector<uint8_t> &decompress
 		std::cout << std::endl;
 	}
 
-	if (!IsDecompAlgoSupported(hdr->algo))
+	if (!IsDecompAlgoSupported(m_algo))
 	{
 		if (g_debug & Dbg_Errors) {
 			std::cout << "Unsupported decompression algorithm." << std::endl;
-			DumpHex(std::cout, compressed.data(), compressed.size());
+			DumpHex(std::cout, m_compressed.data(), m_compressed.size());
 		}
 		return false;
 	}
 
-	if (IsDecompAlgoInRsrc(hdr->algo))
+	// Contents in the xattr are a single chunk.
+	if (!IsDecompAlgoInRsrc(m_algo))
 	{
-		std::vector<uint8_t> rsrc;
-		size_t k;
+		m_chunks.push_back({ sizeof(CompressionHeader), m_compressed.size() - sizeof(CompressionHeader) });
+		return true;
+	}
+
+	if (!m_rsrc)
+	{
+		if (g_debug & Dbg_Errors)
+			std::cout << "Decmpfs: Could not find resource fork." << std::endl;
+		return false;
+	}
 
-		bool rc = dir.GetAttribute(rsrc, ino, "com.apple.ResourceFork");
+	nchunks = static_cast<size_t>((m_size + DECMPFS_CHUNK_SIZE - 1) / DECMPFS_CHUNK_SIZE);
 
-		if (!rc)
+	if (m_algo == 4) // Zlib, rsrc
+	{
+		RsrcForkHeader rsrc_hdr;
+		uint64_t cmpf_rsrc_base;
+		uint32_t entries;
+		std::vector<CmpfRsrcEntry> entry;
+
+		p = m_rsrc->Get(0, sizeof(rsrc_hdr));
+		if (!p)
 		{
 			if (g_debug & Dbg_Errors)
-				std::cout << "Decmpfs: Could not find resource fork " << ino << std::endl;
-			decompressed.clear();
+				std::cout << "Decmpfs: Could not read rsrc header." << std::endl;
 			return false;
 		}
 
-		if (hdr->algo == 4) // Zlib, rsrc
+		memcpy(&rsrc_hdr, p, sizeof(rsrc_hdr));
+
+		if (rsrc_hdr.data_offset > m_rsrc->size())
+		{
+			if (g_debug & Dbg_Errors)
+				std::cout << "Decmpfs: Invalid data offset in rsrc header." << std::endl;
+			return false;
+		}
+
+		cmpf_rsrc_base = rsrc_hdr.data_offset + sizeof(uint32_t);
+
+		p = m_rsrc->Get(cmpf_rsrc_base, sizeof(uint32_t));
+		entries = p ? static_cast<uint32_t>(*reinterpret_cast<const le_uint32_t *>(p)) : 0;
+		if (p && entries <= nchunks)
+			p = m_rsrc->Get(cmpf_rsrc_base + sizeof(uint32_t), entries * sizeof(CmpfRsrcEntry));
+		else
+			p = nullptr;
+
+		if (!p)
 		{
-			RsrcForkHeader rsrc_hdr;
+			if (g_debug & Dbg_Errors)
+				std::cout << "Decmpfs: Invalid chunk table in rsrc." << std::endl;
+			return false;
+		}
 
-			memcpy(&rsrc_hdr, rsrc.data(), sizeof(rsrc_hdr));
+		// The window may move while reading the chunks.
+		entry.assign(reinterpret_cast<const CmpfRsrcEntry *>(p), reinterpret_cast<const CmpfRsrcEntry *>(p) + entries);
 
-			if (rsrc_hdr.data_offset > rsrc.size())
+		for (k = 0; k < entries; k++)
+		{
+			if (entry[k].size > DECMPFS_CHUNK_SIZE + 1)
 			{
 				if (g_debug & Dbg_Errors)
-					std::cout << "Decmpfs: Invalid data offset in rsrc header." << std::endl;
+					std::cout << "Decmpfs: In rsrc, src_len too big (" << entry[k].size << ")" << std::endl;
 				return false;
 			}
 
-			const uint8_t *cmpf_rsrc_base = rsrc.data() + rsrc_hdr.data_offset + sizeof(uint32_t);
-			const CmpfRsrc *cmpf_rsrc = reinterpret_cast<const CmpfRsrc *>(cmpf_rsrc_base);
+			m_chunks.push_back({ cmpf_rsrc_base + entry[k].off, entry[k].size });
+		}
 
-			decompressed.resize((hdr->size + 0xFFFF) & 0xFFFF0000);
+		// Chunks missing from the table read as zeroes.
+		m_chunks.resize(nchunks, { 0, 0 });
+	}
+	else if (m_algo == 8)
+	{
+		std::vector<uint32_t> off_list(nchunks + 1);
 
-			for (k = 0; k < cmpf_rsrc->entries; k++)
-			{
-				size_t src_offset = cmpf_rsrc->entry[k].off;
-				const uint8_t *src = cmpf_rsrc_base + src_offset;
-				size_t src_len = cmpf_rsrc->entry[k].size;
-				uint8_t *dst = decompressed.data() + 0x10000 * k;
-				size_t expected_len = hdr->size - (0x10000 * k);
-				if (expected_len > 0x10000)
-					expected_len = 0x10000;
-
-				if (src_len > 0x10001)
-				{
-					if (g_debug & Dbg_Errors)
-						std::cout << "Decmpfs: In rsrc, src_len too big (" << src_len << ")" << std::endl;
-					return false;
-				}
-
-				if (src[0] == 0x78)
-				{
-					decoded_bytes = DecompressZLib(dst, 0x10000, src, src_len);
-				}
-				else if ((src[0] & 0x0F) == 0x0F)
-				{
-					memcpy(dst, src + 1, src_len - 1);
-					decoded_bytes = src_len - 1;
-				}
-				else
-				{
-					if (g_debug & Dbg_Errors)
-						std::cout << "Decmpfs: Something wrong with zlib data." << std::endl;
-					decompressed.clear();
-					return false;
-				}
-
-				if (expected_len != decoded_bytes)
-				{
-					if (g_debug & Dbg_Errors)
-						std::cout << "Decmpfs: Expected len != decompressed len: " << expected_len << " != " << decoded_bytes << std::endl;
-					return false;
-				}
-			}
-		}
-		else if (hdr->algo == 8)
+		p = m_rsrc->Get(0, off_list.size() * sizeof(uint32_t));
+		if (!p)
 		{
-			const uint32_t *off_list = reinterpret_cast<const uint32_t *>(rsrc.data());
+			if (g_debug & Dbg_Errors)
+				std::cout << "Decmpfs: Could not read chunk offsets in rsrc." << std::endl;
+			return false;
+		}
 
-			decompressed.resize((hdr->size + 0xFFFF) & 0xFFFF0000);
+		memcpy(off_list.data(), p, off_list.size() * sizeof(uint32_t));
 
-			for (k = 0; (k << 16) < decompressed.size(); k++)
+		for (k = 0; k < nchunks; k++)
+		{
+			if (off_list[k + 1] < off_list[k] || off_list[k + 1] - off_list[k] > DECMPFS_CHUNK_SIZE + 1)
 			{
-				size_t expected_len = hdr->size - (0x10000 * k);
-				if (expected_len > 0x10000)
-					expected_len = 0x10000;
-				const uint8_t *src = rsrc.data() + off_list[k];
-				size_t src_len = off_list[k + 1] - off_list[k];
-
-				if (src_len > 0x10001)
-				{
-					if (g_debug & Dbg_Errors)
-						std::cout << "Decmpfs: In rsrc, src_len too big (" << src_len << ")" << std::endl;
-					return false;
-				}
-
-				if (src[0] == 0x06)
-				{
-					memcpy(decompressed.data() + (k << 16), src + 1, src_len - 1);
-					decoded_bytes = src_len - 1;
-				}
-				else
-				{
-					decoded_bytes = DecompressLZVN(decompressed.data() + (k << 16), expected_len, src, src_len);
-				}
-
-				if (decoded_bytes != expected_len)
-				{
-					if (g_debug & Dbg_Errors)
-						std::cout << "Decmpfs: Expected length != decompressed length: " << expected_len << " != " << decoded_bytes << " [k = " << k << "]" << std::endl;
-
-					return false;
-				}
+				if (g_debug & Dbg_Errors)
+					std::cout << "Decmpfs: In rsrc, src_len too big (" << (off_list[k + 1] - off_list[k]) << ")" << std::endl;
+				return false;
 			}
+
+			m_chunks.push_back({ off_list[k], off_list[k + 1] - off_list[k] });
+		}
+	}
+
+	return true;
+}
+
+size_t DecmpfsStream::GetChunkSize(size_t k) const
+{
+	if (!IsDecompAlgoInRsrc(m_algo))
+		return static_cast<size_t>(m_size);
+
+	return static_cast<size_t>(std::min<uint64_t>(m_size - k * DECMPFS_CHUNK_SIZE, DECMPFS_CHUNK_SIZE));
+}
+
+bool DecmpfsStream::ReadChunk(size_t k, uint8_t *data)
+{
+	const Chunk &c = m_chunks[k];
+	const size_t expected_len = GetChunkSize(k);
+	size_t decoded_bytes = 0;
+	const uint8_t *src;
+
+	if (IsDecompAlgoInRsrc(m_algo))
+	{
+		if (c.size == 0)
+		{
+			memset(data, 0, expected_len);
+			return true;
 		}
 
-		decompressed.resize(hdr->size);
+		src = m_rsrc->Get(c.offs, c.size);
 	}
 	else
 	{
-		decompressed.resize(hdr->size);
+		src = c.size > 0 ? m_compressed.data() + c.offs : nullptr;
+	}
 
-		if (hdr->algo == 3)
+	if (!src)
+	{
+		if (g_debug & Dbg_Errors)
+			std::cout << "Decmpfs: Could not read chunk " << k << "." << std::endl;
+		return false;
+	}
+
+	switch (m_algo)
+	{
+	case 3:
+	case 4:
+		if (src[0] == 0x78)
 		{
-			if (cdata[0] == 0x78)
-			{
-				decoded_bytes = DecompressZLib(decompressed.data(), decompressed.size(), cdata, csize);
-			}
-			else if (cdata[0] == 0xFF) // cdata[0] & 0x0F == 0x0F ?
-			{
-				assert(hdr->size == csize - 1);
-				decompressed.assign(cdata + 1, cdata + csize);
-				decoded_bytes = decompressed.size();
-			}
-			else
+			decoded_bytes = DecompressZLib(data, expected_len, src, c.size);
+		}
+		else if ((m_algo == 3) ? (src[0] == 0xFF) : ((src[0] & 0x0F) == 0x0F))
+		{
+			if (c.size - 1 > expected_len)
 				return false;
+			memcpy(data, src + 1, c.size - 1);
+			decoded_bytes = c.size - 1;
 		}
-		else if (hdr->algo == 7)
+		else
 		{
-			// TODO: Test if lzvn decompresses correctly if data starts with 0x06 ...
-			if (cdata[0] == 0x06)
-			{
-				assert(hdr->size == csize - 1);
-				decompressed.assign(cdata + 1, cdata + csize);
-				decoded_bytes = decompressed.size();
-			}
-			else
-			{
-				decoded_bytes = DecompressLZVN(decompressed.data(), decompressed.size(), cdata, csize);
-			}
+			if (g_debug & Dbg_Errors)
+				std::cout << "Decmpfs: Something wrong with zlib data." << std::endl;
+			return false;
+		}
+		break;
+	case 7:
+	case 8:
+		if (src[0] == 0x06)
+		{
+			if (c.size - 1 > expected_len)
+				return false;
+			memcpy(data, src + 1, c.size - 1);
+			decoded_bytes = c.size - 1;
 		}
+		else
+		{
+			decoded_bytes = DecompressLZVN(data, expected_len, src, c.size);
+		}
+		break;
+	}
+
+	if (decoded_bytes != expected_len)
+	{
+		if (g_debug & Dbg_Errors)
+			std::cout << "Decmpfs: Expected length != decompressed length: " << expected_len << " != " << decoded_bytes << " [k = " << k << "]" << std::endl;
+		return false;
+	}
+
+	return true;
+}
+
+static bool Decompress(std::vector<uint8_t> &decompressed, DecmpfsStream &stream)
+{
+	uint64_t offs = 0;
+	size_t k;
+
+	if (!stream.Init())
+	{
+		decompressed.clear();
+		return false;
+	}
+
+	decompressed.resize(stream.size());
 
-		if (decoded_bytes != hdr->size)
+	for (k = 0; k < stream.GetChunkCount(); k++)
+	{
+		if (!stream.ReadChunk(k, decompressed.data() + offs))
+			return false;
+
+		offs += stream.GetChunkSize(k);
+	}
+
+	return true;
+}
+
+bool DecompressFile(ApfsDir &dir, uint64_t ino, std::vector<uint8_t> &decompressed, const std::vector<uint8_t> &compressed)
+{
+	ApfsDir::XAttrRec rsrc_attr;
+
+	if (compressed.size() >= sizeof(CompressionHeader) && IsDecompAlgoInRsrc(reinterpret_cast<const CompressionHeader *>(compressed.data())->algo))
+	{
+		if (!dir.GetAttributeInfo(rsrc_attr, ino, "com.apple.ResourceFork"))
 		{
 			if (g_debug & Dbg_Errors)
-				std::cout << "Decmpfs: In attr, expected len != decoded len: " << hdr->size << " != " << decoded_bytes << std::endl;
+				std::cout << "Decmpfs: Could not find resource fork " << ino << std::endl;
+			decompressed.clear();
 			return false;
 		}
+
+		return DecompressFile(dir, &rsrc_attr, decompressed, compressed);
 	}
 
-#else
-	if (IsDecompAlgoInRsrc(hdr->algo))
+	return DecompressFile(dir, nullptr, decompressed, compressed);
+}
+
+bool DecompressFile(ApfsDir &dir, const ApfsDir::XAttrRec *rsrc, std::vector<uint8_t> &decompressed, const std::vector<uint8_t> &compressed)
+{
+	DecmpfsStream stream(dir, rsrc, compressed);
+
+	return Decompress(decompressed, stream);
+}
+
+bool DecompressData(std::vector<uint8_t> &decompressed, const std::vector<uint8_t> &compressed, const std::vector<uint8_t> &rsrc)
+{
+	DecmpfsStream stream(compressed, rsrc);
+
+	return Decompress(decompressed, stream);
+}
+
+DecmpfsCache::DecmpfsCache(size_t max_bytes)
+{
+	m_max_bytes = max_bytes;
+	memset(&m_stats, 0, sizeof(m_stats));
+}
+
+DecmpfsCache::~DecmpfsCache()
+{
+}
+
+DecmpfsCache::Data DecmpfsCache::Get(uint64_t ino, xid_t xid)
+{
+#ifdef DECMPFS_CACHE_USE_MUTEX
+	std::lock_guard<std::mutex> lock(m_mutex);
+#endif
+
+	auto it = m_entries.find(Key(ino, xid));
+
+	if (it == m_entries.end())
 	{
-		dir.GetAttribute(decompressed, ino, "com.apple.ResourceFork");
+		m_stats.misses++;
+		return Data();
 	}
-	else
+
+	m_stats.hits++;
+	m_lru.splice(m_lru.begin(), m_lru, it->second);
+
+	return it->second->data;
+}
+
+void DecmpfsCache::Put(uint64_t ino, xid_t xid, const Data &data)
+{
+	const Key key(ino, xid);
+
+#ifdef DECMPFS_CACHE_USE_MUTEX
+	std::lock_guard<std::mutex> lock(m_mutex);
+#endif
+
+	if (!data || data->size() > m_max_bytes)
+		return;
+
+	auto it = m_entries.find(key);
+
+	if (it != m_entries.end())
 	{
-		decompressed = compressed;
+		m_stats.bytes -= it->second->data->size();
+		m_lru.erase(it->second);
+		m_entries.erase(it);
+		m_stats.entries--;
 	}
+
+	Evict(m_max_bytes - data->size());
+
+	m_lru.push_front({ key, data });
+	m_entries[key] = m_lru.begin();
+	m_stats.entries++;
+	m_stats.bytes += data->size();
+}
+
+void DecmpfsCache::SetMaxBytes(size_t max_bytes)
+{
+#ifdef DECMPFS_CACHE_USE_MUTEX
+	std::lock_guard<std::mutex> lock(m_mutex);
 #endif
 
-	return true;
+	m_max_bytes = max_bytes;
+	Evict(max_bytes);
+}
+
+DecmpfsCache::Stats DecmpfsCache::GetStats()
+{
+#ifdef DECMPFS_CACHE_USE_MUTEX
+	std::lock_guard<std::mutex> lock(m_mutex);
+#endif
+
+	return m_stats;
+}
+
+void DecmpfsCache::Evict(size_t max_bytes)
+{
+	// Contents still referenced by open files stay alive until those are closed.
+	while (m_stats.bytes > max_bytes && !m_lru.empty())
+	{
+		const Entry &e = m_lru.back();
+
+		m_stats.bytes -= e.data->size();
+		m_stats.entries--;
+		m_stats.evictions++;
+		m_entries.erase(e.key);
+		m_lru.pop_back();
+	}
 }
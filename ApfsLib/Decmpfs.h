@@ -20,9 +20,17 @@
 #pragma once
 
 #include <vector>
+#include <list>
+#include <map>
+#include <memory>
 
 #include "ApfsDir.h"
 
+#if !(defined(_LIBCPP_HAS_NO_THREADS) || defined(M1N1) || defined(__UBOOT__) || defined(JEV_BAREMETAL))
+#define DECMPFS_CACHE_USE_MUTEX
+#include <mutex>
+#endif
+
 struct CompressionHeader
 {
 	le_uint32_t signature;
@@ -30,7 +38,101 @@ struct CompressionHeader
 	le_uint64_t size;
 };
 
+// Uncompressed size of the chunks in the resource fork.
+#define DECMPFS_CHUNK_SIZE 0x10000
+
+class RsrcReader;
+
 bool IsDecompAlgoSupported(uint16_t algo);
 bool IsDecompAlgoInRsrc(uint16_t algo);
 
 bool DecompressFile(ApfsDir &dir, uint64_t ino, std::vector<uint8_t> &decompressed, const std::vector<uint8_t> &compressed);
+// Same, with the resource fork header already known (nullptr if the file has none).
+bool DecompressFile(ApfsDir &dir, const ApfsDir::XAttrRec *rsrc, std::vector<uint8_t> &decompressed, const std::vector<uint8_t> &compressed);
+// Same, with the resource fork already in memory (empty if the algorithm doesn't use one).
+bool DecompressData(std::vector<uint8_t> &decompressed, const std::vector<uint8_t> &compressed, const std::vector<uint8_t> &rsrc);
+
+// Decompresses a file one chunk at a time, so the contents don't have to be in memory as a
+// whole. compressed (the decmpfs xattr) and a resource fork in memory must outlive the stream.
+class DecmpfsStream
+{
+public:
+	// rsrc is the resource fork header, nullptr if the file has none.
+	DecmpfsStream(ApfsDir &dir, const ApfsDir::XAttrRec *rsrc, const std::vector<uint8_t> &compressed);
+	// Same, with the resource fork already in memory.
+	DecmpfsStream(const std::vector<uint8_t> &compressed, const std::vector<uint8_t> &rsrc);
+	~DecmpfsStream();
+
+	// Checks the header and reads the chunk table of the resource fork.
+	bool Init();
+
+	// Uncompressed size of the file, from the header.
+	uint64_t size() const { return m_size; }
+	size_t GetChunkCount() const { return m_chunks.size(); }
+	// Uncompressed size of chunk k. Contents compressed into the xattr are a single chunk.
+	size_t GetChunkSize(size_t k) const;
+	// Decompresses chunk k into data, which has room for GetChunkSize(k) bytes.
+	bool ReadChunk(size_t k, uint8_t *data);
+
+private:
+	// Compressed data of a chunk, in the resource fork or the xattr. Size 0 reads as zeroes.
+	struct Chunk
+	{
+		uint64_t offs;
+		size_t size;
+	};
+
+	std::unique_ptr<RsrcReader> m_rsrc;
+	const std::vector<uint8_t> &m_compressed;
+	std::vector<Chunk> m_chunks;
+	uint64_t m_size;
+	uint32_t m_algo;
+};
+
+// Decompressed file contents shared between all users of an inode. The total
+// size is limited, the least recently used contents are dropped first.
+class DecmpfsCache
+{
+public:
+	typedef std::shared_ptr<const std::vector<uint8_t>> Data;
+
+	struct Stats
+	{
+		uint64_t hits;
+		uint64_t misses;
+		uint64_t evictions;
+		size_t entries;
+		size_t bytes;
+	};
+
+	explicit DecmpfsCache(size_t max_bytes);
+	~DecmpfsCache();
+
+	// Returns nullptr on a miss.
+	Data Get(uint64_t ino, xid_t xid);
+	// Contents larger than the whole budget are not cached.
+	void Put(uint64_t ino, xid_t xid, const Data &data);
+
+	void SetMaxBytes(size_t max_bytes);
+	size_t GetMaxBytes() const { return m_max_bytes; }
+	Stats GetStats();
+
+private:
+	typedef std::pair<uint64_t, xid_t> Key;
+
+	struct Entry
+	{
+		Key key;
+		Data data;
+	};
+
+	void Evict(size_t max_bytes);
+
+	std::list<Entry> m_lru; // Most recently used first
+	std::map<Key, std::list<Entry>::iterator> m_entries;
+	size_t m_max_bytes;
+	Stats m_stats;
+#ifdef DECMPFS_CACHE_USE_MUTEX
+	std::mutex m_mutex;
+#endif
+};
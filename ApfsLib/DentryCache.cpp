@@ -0,0 +1,284 @@
+/*
+	This file is part of apfs-fuse, a read-only implementation of APFS
+	(Apple File System) for FUSE.
+	Copyright (C) 2017 Simon Gander
+
+	Apfs-fuse is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 2 of the License, or
+	(at your option) any later version.
+
+	Apfs-fuse is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with apfs-fuse.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <algorithm>
+#include <cstring>
+#include <functional>
+
+#include "DentryCache.h"
+#include "Util.h"
+
+static uint64_t Mix64(uint64_t x)
+{
+	x ^= x >> 33;
+	x *= UINT64_C(0xff51afd7ed558ccd);
+	x ^= x >> 33;
+	x *= UINT64_C(0xc4ceb9fe1a85ec53);
+	x ^= x >> 33;
+	return x;
+}
+
+size_t DentryCache::KeyHash::operator()(const Key &k) const
+{
+	return std::hash<std::string>()(k.second) ^ static_cast<size_t>(Mix64(k.first));
+}
+
+DentryCache::DentryCache(size_t max_entries, size_t max_filter_bytes)
+{
+	m_max_entries = max_entries;
+	m_max_filter_bytes = max_filter_bytes;
+}
+
+DentryCache::~DentryCache()
+{
+}
+
+bool DentryCache::Get(uint64_t &file_id, uint64_t parent_id, const char *name)
+{
+	Shard &sh = GetShard(parent_id);
+
+#ifdef DENTRY_CACHE_USE_MUTEX
+	std::lock_guard<std::mutex> lock(sh.mutex);
+#endif
+
+	auto it = sh.entries.find(Key(parent_id, name));
+
+	if (it == sh.entries.end())
+	{
+		sh.stats.misses++;
+		return false;
+	}
+
+	sh.lru.splice(sh.lru.begin(), sh.lru, it->second);
+	file_id = it->second->file_id;
+
+	if (file_id)
+		sh.stats.hits++;
+	else
+		sh.stats.negative_hits++;
+
+	return true;
+}
+
+void DentryCache::Put(uint64_t parent_id, const char *name, uint64_t file_id)
+{
+	Shard &sh = GetShard(parent_id);
+	const size_t max_entries = m_max_entries / DENTRY_CACHE_SHARDS;
+	Key key(parent_id, name);
+
+#ifdef DENTRY_CACHE_USE_MUTEX
+	std::lock_guard<std::mutex> lock(sh.mutex);
+#endif
+
+	if (max_entries == 0)
+		return;
+
+	auto it = sh.entries.find(key);
+
+	if (it != sh.entries.end())
+	{
+		it->second->file_id = file_id;
+		sh.lru.splice(sh.lru.begin(), sh.lru, it->second);
+		return;
+	}
+
+	while (sh.lru.size() >= max_entries)
+	{
+		sh.entries.erase(sh.lru.back().key);
+		sh.lru.pop_back();
+	}
+
+	sh.lru.push_front({ key, file_id });
+	sh.entries[std::move(key)] = sh.lru.begin();
+}
+
+void DentryCache::SetDirNames(uint64_t parent_id, const std::vector<uint32_t> &name_hashes)
+{
+	Shard &sh = GetShard(parent_id);
+	const size_t max_bytes = m_max_filter_bytes / DENTRY_CACHE_SHARDS;
+	Filter f;
+	size_t nbits;
+	uint64_t h1;
+	uint64_t h2;
+	int k;
+
+	// A disabled cache doesn't filter either.
+	if (m_max_entries == 0)
+		return;
+
+	f.parent_id = parent_id;
+	nbits = std::max<size_t>(64, name_hashes.size() * DENTRY_FILTER_BITS_PER_NAME);
+	f.bits.assign((nbits + 63) / 64, 0);
+	nbits = f.bits.size() * 64;
+
+	if (f.bits.size() * sizeof(uint64_t) > max_bytes)
+		return;
+
+	for (uint32_t hash : name_hashes)
+	{
+		GetProbes(h1, h2, hash);
+		for (k = 0; k < DENTRY_FILTER_PROBES; k++)
+		{
+			uint64_t bit = (h1 + k * h2) % nbits;
+			f.bits[bit >> 6] |= UINT64_C(1) << (bit & 63);
+		}
+	}
+
+#ifdef DENTRY_CACHE_USE_MUTEX
+	std::lock_guard<std::mutex> lock(sh.mutex);
+#endif
+
+	auto it = sh.filters.find(parent_id);
+
+	if (it != sh.filters.end())
+	{
+		sh.filter_bytes -= it->second->bits.size() * sizeof(uint64_t);
+		sh.filter_lru.erase(it->second);
+		sh.filters.erase(it);
+	}
+
+	while (!sh.filter_lru.empty() && sh.filter_bytes + f.bits.size() * sizeof(uint64_t) > max_bytes)
+	{
+		sh.filter_bytes -= sh.filter_lru.back().bits.size() * sizeof(uint64_t);
+		sh.filters.erase(sh.filter_lru.back().parent_id);
+		sh.filter_lru.pop_back();
+	}
+
+	sh.filter_bytes += f.bits.size() * sizeof(uint64_t);
+	sh.filter_lru.push_front(std::move(f));
+	sh.filters[parent_id] = sh.filter_lru.begin();
+}
+
+bool DentryCache::MayContain(uint64_t parent_id, const char *name, uint32_t txt_fmt)
+{
+	Shard &sh = GetShard(parent_id);
+	uint64_t h1;
+	uint64_t h2;
+	uint64_t nbits;
+	int k;
+
+	{
+#ifdef DENTRY_CACHE_USE_MUTEX
+		std::lock_guard<std::mutex> lock(sh.mutex);
+#endif
+		if (sh.filters.find(parent_id) == sh.filters.end())
+			return true;
+	}
+
+	// Hashed outside of the lock, normalizing the name is the expensive part.
+	GetProbes(h1, h2, NameHash(name, strlen(name), txt_fmt));
+
+#ifdef DENTRY_CACHE_USE_MUTEX
+	std::lock_guard<std::mutex> lock(sh.mutex);
+#endif
+
+	auto it = sh.filters.find(parent_id);
+
+	if (it == sh.filters.end())
+		return true;
+
+	sh.filter_lru.splice(sh.filter_lru.begin(), sh.filter_lru, it->second);
+
+	const std::vector<uint64_t> &bits = it->second->bits;
+	nbits = bits.size() * 64;
+
+	for (k = 0; k < DENTRY_FILTER_PROBES; k++)
+	{
+		uint64_t bit = (h1 + k * h2) % nbits;
+		if (!(bits[bit >> 6] & (UINT64_C(1) << (bit & 63))))
+		{
+			sh.stats.filter_rejects++;
+			return false;
+		}
+	}
+
+	return true;
+}
+
+void DentryCache::SetMaxEntries(size_t max_entries)
+{
+	m_max_entries = max_entries;
+
+	for (Shard &sh : m_shards)
+	{
+#ifdef DENTRY_CACHE_USE_MUTEX
+		std::lock_guard<std::mutex> lock(sh.mutex);
+#endif
+		while (sh.lru.size() > max_entries / DENTRY_CACHE_SHARDS)
+		{
+			sh.entries.erase(sh.lru.back().key);
+			sh.lru.pop_back();
+		}
+	}
+}
+
+DentryCache::Stats DentryCache::GetStats()
+{
+	Stats st;
+
+	memset(&st, 0, sizeof(st));
+
+	for (Shard &sh : m_shards)
+	{
+#ifdef DENTRY_CACHE_USE_MUTEX
+		std::lock_guard<std::mutex> lock(sh.mutex);
+#endif
+		st.hits += sh.stats.hits;
+		st.negative_hits += sh.stats.negative_hits;
+		st.filter_rejects += sh.stats.filter_rejects;
+		st.misses += sh.stats.misses;
+		st.entries += sh.lru.size();
+		st.filters += sh.filter_lru.size();
+	}
+
+	return st;
+}
+
+uint32_t DentryCache::NameHash(const char *name, size_t name_len, uint32_t txt_fmt)
+{
+	uint32_t hash = 0x811C9DC5;
+	size_t k;
+
+	// Only the crc part of the drec hash, the length part differs between normalization forms.
+	if (txt_fmt & 9)
+		return HashFilename(reinterpret_cast<const uint8_t *>(name), static_cast<uint16_t>(name_len + 1), (txt_fmt & APFS_INCOMPAT_CASE_INSENSITIVE) != 0) >> 10;
+
+	for (k = 0; k < name_len; k++)
+	{
+		hash ^= static_cast<uint8_t>(name[k]);
+		hash *= 0x01000193;
+	}
+
+	return hash;
+}
+
+uint32_t DentryCache::DirEntryHash(const ApfsDir::DirEntryView &e, uint32_t txt_fmt)
+{
+	if (txt_fmt & 9)
+		return e.hash >> 10;
+
+	return NameHash(e.name.data(), e.name.size(), txt_fmt);
+}
+
+void DentryCache::GetProbes(uint64_t &h1, uint64_t &h2, uint32_t hash)
+{
+	h1 = Mix64(hash);
+	h2 = Mix64(h1 ^ UINT64_C(0x9e3779b97f4a7c15)) | 1;
+}
@@ -0,0 +1,118 @@
+/*
+	This file is part of apfs-fuse, a read-only implementation of APFS
+	(Apple File System) for FUSE.
+	Copyright (C) 2017 Simon Gander
+
+	Apfs-fuse is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 2 of the License, or
+	(at your option) any later version.
+
+	Apfs-fuse is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with apfs-fuse.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#pragma once
+
+#include <cstdint>
+#include <list>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "ApfsDir.h"
+
+#if !(defined(_LIBCPP_HAS_NO_THREADS) || defined(M1N1) || defined(__UBOOT__) || defined(JEV_BAREMETAL))
+#define DENTRY_CACHE_USE_MUTEX
+#include <mutex>
+#endif
+
+// Number of independently locked parts of the cache.
+#define DENTRY_CACHE_SHARDS 16
+// Bits per name in the directory filters, and number of bits tested per name.
+#define DENTRY_FILTER_BITS_PER_NAME 10
+#define DENTRY_FILTER_PROBES 7
+
+// Results of name lookups, including failed ones, and Bloom filters of the names in
+// directories that have been listed completely. Both are limited in size, the least
+// recently used entries are dropped first. Meant for read-only volumes, nothing is
+// ever invalidated.
+class DentryCache
+{
+public:
+	struct Stats
+	{
+		uint64_t hits;
+		uint64_t negative_hits;
+		uint64_t filter_rejects;
+		uint64_t misses;
+		size_t entries;
+		size_t filters;
+	};
+
+	DentryCache(size_t max_entries, size_t max_filter_bytes);
+	~DentryCache();
+
+	// True if the name is cached. file_id is 0 if the name is known not to exist.
+	bool Get(uint64_t &file_id, uint64_t parent_id, const char *name);
+	void Put(uint64_t parent_id, const char *name, uint64_t file_id);
+
+	// Builds the filter of a directory from the DirEntryHash of every name in it.
+	void SetDirNames(uint64_t parent_id, const std::vector<uint32_t> &name_hashes);
+	// The drecs of hashed volumes already carry the hash, it doesn't need to be computed again.
+	static uint32_t DirEntryHash(const ApfsDir::DirEntryView &e, uint32_t txt_fmt);
+	// False if the directory has a filter and the name is certainly not in it.
+	bool MayContain(uint64_t parent_id, const char *name, uint32_t txt_fmt);
+
+	void SetMaxEntries(size_t max_entries);
+	Stats GetStats();
+
+private:
+	typedef std::pair<uint64_t, std::string> Key;
+
+	struct KeyHash
+	{
+		size_t operator()(const Key &k) const;
+	};
+
+	struct Entry
+	{
+		Key key;
+		uint64_t file_id;
+	};
+
+	struct Filter
+	{
+		uint64_t parent_id;
+		std::vector<uint64_t> bits;
+	};
+
+	struct Shard
+	{
+		std::list<Entry> lru; // Most recently used first
+		std::unordered_map<Key, std::list<Entry>::iterator, KeyHash> entries;
+		std::list<Filter> filter_lru;
+		std::unordered_map<uint64_t, std::list<Filter>::iterator> filters;
+		size_t filter_bytes = 0;
+		Stats stats = {};
+#ifdef DENTRY_CACHE_USE_MUTEX
+		std::mutex mutex;
+#endif
+	};
+
+	Shard &GetShard(uint64_t parent_id) { return m_shards[parent_id % DENTRY_CACHE_SHARDS]; }
+	// Normalized (and on case insensitive volumes folded) name hash on hashed volumes,
+	// hash of the name bytes otherwise. Names that can match have the same hash.
+	static uint32_t NameHash(const char *name, size_t name_len, uint32_t txt_fmt);
+	static void GetProbes(uint64_t &h1, uint64_t &h2, uint32_t hash);
+
+	Shard m_shards[DENTRY_CACHE_SHARDS];
+	size_t m_max_entries;
+	size_t m_max_filter_bytes;
+};
@@ -39,6 +39,19 @@ Device::~Device()
 {
 }
 
+const uint8_t *Device::Map(uint64_t offs, uint64_t len)
+{
+	(void)offs;
+	(void)len;
+
+	return nullptr;
+}
+
+bool Device::IsLinear() const
+{
+	return false;
+}
+
 Device * Device::OpenDevice(const char * name)
 {
 	Device *dev = nullptr;
@@ -21,6 +21,11 @@
 
 #include <cstdint>
 
+#if !(defined(_LIBCPP_HAS_NO_THREADS) || defined(M1N1) || defined(__UBOOT__) || defined(JEV_BAREMETAL))
+#define DEVICE_USE_READ_LOCK
+#include <mutex>
+#endif
+
 class Device
 {
 protected:
@@ -32,8 +37,15 @@ public:
 	virtual bool Open(const char *name) = 0;
 	virtual void Close() = 0;
 
+	// May be called from several threads. Devices that seek or keep a cache serialize it themselves.
 	virtual bool Read(void *data, uint64_t offs, uint64_t len) = 0;
 	virtual uint64_t GetSize() const = 0;
+	// Direct read-only view of the device contents, or nullptr if the device isn't memory mapped.
+	// The pointer stays valid until the device is closed.
+	virtual const uint8_t *Map(uint64_t offs, uint64_t len);
+	// True if offsets are positions in the underlying file or disk. Image formats that are
+	// decoded on read (DMG, sparse image, VDI) are not linear.
+	virtual bool IsLinear() const;
 
 	unsigned int GetSectorSize() const { return m_sector_size; }
 	void SetSectorSize(unsigned int size) { m_sector_size = size; }
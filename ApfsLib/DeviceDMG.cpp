@@ -245,6 +245,10 @@ void DeviceDMG::Close()
 
 bool DeviceDMG::Read(void * data, uint64_t offs, uint64_t len)
 {
+#ifdef DEVICE_USE_READ_LOCK
+	std::lock_guard<std::mutex> lock(m_read_mutex);
+#endif
+
 	if (m_is_raw)
 	{
 		m_img.Read(offs + m_offset, data, len);
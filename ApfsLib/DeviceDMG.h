@@ -82,4 +82,9 @@ private:
 	uint64_t m_cache_size;
 	uint8_t *m_cache_data;
 #endif
+
+#ifdef DEVICE_USE_READ_LOCK
+	// The image file position and the decompression cache are shared by all reads.
+	std::mutex m_read_mutex;
+#endif
 };
@@ -21,6 +21,7 @@ along with apfs-fuse.  If not, see <http://www.gnu.org/licenses/>.
 
 #include <unistd.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/fcntl.h>
 #include <linux/fs.h>
@@ -28,6 +29,7 @@ along with apfs-fuse.  If not, see <http://www.gnu.org/licenses/>.
 #include <stdio.h>
 #include <string.h>
 #include <iostream>
+#include <cstdint>
 
 #include "DeviceLinux.h"
 #include "Global.h"
@@ -36,6 +38,7 @@ DeviceLinux::DeviceLinux()
 {
 	m_device = -1;
 	m_size = 0;
+	m_map = nullptr;
 }
 
 DeviceLinux::~DeviceLinux()
@@ -60,6 +63,17 @@ bool DeviceLinux::Open(const char* name)
 	if (S_ISREG(st.st_mode))
 	{
 		m_size = st.st_size;
+
+		// Image files are mapped, so metadata can be used without copying it. Reads still use pread.
+		if (m_size > 0 && m_size <= SIZE_MAX)
+		{
+			void *map = mmap(nullptr, m_size, PROT_READ, MAP_SHARED, m_device, 0);
+
+			if (map != MAP_FAILED)
+				m_map = reinterpret_cast<const uint8_t *>(map);
+			else if (g_debug & Dbg_Info)
+				std::cout << "Mapping device " << name << " failed with error " << strerror(errno) << std::endl;
+		}
 	}
 	else if (S_ISBLK(st.st_mode))
 	{
@@ -75,6 +89,9 @@ bool DeviceLinux::Open(const char* name)
 
 void DeviceLinux::Close()
 {
+	if (m_map)
+		munmap(const_cast<uint8_t *>(m_map), m_size);
+	m_map = nullptr;
 	if (m_device != -1)
 		close(m_device);
 	m_device = -1;
@@ -91,4 +108,12 @@ bool DeviceLinux::Read(void* data, uint64_t offs, uint64_t len)
 	return nread == len;
 }
 
+const uint8_t *DeviceLinux::Map(uint64_t offs, uint64_t len)
+{
+	if (!m_map || offs > m_size || len > m_size - offs)
+		return nullptr;
+
+	return m_map + offs;
+}
+
 #endif
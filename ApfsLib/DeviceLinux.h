@@ -34,12 +34,15 @@ public:
 	void Close() override;
 
 	bool Read(void *data, uint64_t offs, uint64_t len) override;
+	const uint8_t *Map(uint64_t offs, uint64_t len) override;
 
 	uint64_t GetSize() const override { return m_size; }
+	bool IsLinear() const override { return true; }
 
 private:
 	int m_device;
 	uint64_t m_size;
+	const uint8_t *m_map;
 };
 
 #endif
@@ -35,6 +35,7 @@ public:
 	bool Read(void *data, uint64_t offs, uint64_t len) override;
 
 	uint64_t GetSize() const override { return m_size; }
+	bool IsLinear() const override { return true; }
 
 private:
 	int m_device;
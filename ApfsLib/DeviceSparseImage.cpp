@@ -157,6 +157,10 @@ bool DeviceSparseImage::Read(void * data, uint64_t offs, uint64_t len)
 	size_t read_size;
 	uint8_t *bdata = reinterpret_cast<uint8_t *>(data);
 
+#ifdef DEVICE_USE_READ_LOCK
+	std::lock_guard<std::mutex> lock(m_read_mutex);
+#endif
+
 	while (len > 0)
 	{
 		chunk = offs >> 20; // TODO
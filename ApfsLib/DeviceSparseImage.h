@@ -23,4 +23,9 @@ private:
 	uint64_t m_band_size;
 
 	DiskImageFile m_img;
+
+#ifdef DEVICE_USE_READ_LOCK
+	// The image file position is shared by all reads.
+	std::mutex m_read_mutex;
+#endif
 };
@@ -118,6 +118,10 @@ bool DeviceVDI::Read(void * data, uint64_t offs, uint64_t len)
 	if (!m_vdi)
 		return false;
 
+#ifdef DEVICE_USE_READ_LOCK
+	std::lock_guard<std::mutex> lock(m_read_mutex);
+#endif
+
 	while (len > 0)
 	{
 		block_nr = offs >> 20;
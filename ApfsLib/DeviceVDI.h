@@ -27,4 +27,9 @@ private:
 	std::vector<uint32_t> m_block_map;
 
 	FILE *m_vdi;
+
+#ifdef DEVICE_USE_READ_LOCK
+	// The file position of m_vdi is shared by all reads.
+	std::mutex m_read_mutex;
+#endif
 };
@@ -52,6 +52,10 @@ void DeviceWinFile::Close()
 
 bool DeviceWinFile::Read(void *data, uint64_t offs, uint64_t len)
 {
+#ifdef DEVICE_USE_READ_LOCK
+	std::lock_guard<std::mutex> lock(m_read_mutex);
+#endif
+
 	m_vol.seekg(offs);
 	m_vol.read(reinterpret_cast<char *>(data), len);
 
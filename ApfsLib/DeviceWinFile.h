@@ -37,10 +37,16 @@ public:
 	bool Read(void *data, uint64_t offs, uint64_t len) override;
 
 	uint64_t GetSize() const override { return m_size; }
+	bool IsLinear() const override { return true; }
 
 private:
 	std::ifstream m_vol;
 	uint64_t m_size;
+
+#ifdef DEVICE_USE_READ_LOCK
+	// The stream position is shared by all reads.
+	std::mutex m_read_mutex;
+#endif
 };
 
 #endif
@@ -46,6 +46,10 @@ bool DeviceWinPhys::Open(const char *name)
 	if (m_drive == INVALID_HANDLE_VALUE)
 		return false;
 
+#ifdef DEVICE_USE_READ_LOCK
+	std::lock_guard<std::mutex> lock(m_read_mutex);
+#endif
+
 	DeviceIoControl(m_drive, IOCTL_DISK_GET_DRIVE_GEOMETRY_EX, nullptr, 0, &buf, sizeof(buf), &bytes_ret, nullptr);
 
 	if (bytes_ret == 0)
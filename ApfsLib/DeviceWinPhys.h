@@ -38,10 +38,16 @@ public:
 
 	bool Read(void *data, uint64_t offs, uint64_t len) override;
 	uint64_t GetSize() const override;
+	bool IsLinear() const override { return true; }
 
 private:
 	HANDLE m_drive;
 	uint64_t m_size;
+
+#ifdef DEVICE_USE_READ_LOCK
+	// The file pointer of m_drive is shared by all reads.
+	std::mutex m_read_mutex;
+#endif
 };
 
 #endif
@@ -0,0 +1,351 @@
+/*
+	This file is part of apfs-fuse, a read-only implementation of APFS
+	(Apple File System) for FUSE.
+	Copyright (C) 2017 Simon Gander
+
+	Apfs-fuse is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 2 of the License, or
+	(at your option) any later version.
+
+	Apfs-fuse is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with apfs-fuse.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <iostream>
+#include <algorithm>
+#include <cstring>
+#include <iterator>
+
+#include "FsTreeScan.h"
+#include "ApfsDir.h"
+#include "ApfsVolume.h"
+#include "BTree.h"
+#include "Decmpfs.h"
+
+FsTreeScan::FsTreeScan(ApfsVolume &vol) : m_vol(vol)
+{
+}
+
+FsTreeScan::~FsTreeScan()
+{
+}
+
+bool FsTreeScan::Scan(unsigned int threads)
+{
+	std::vector<std::vector<uint8_t>> keys;
+	std::vector<Part> parts;
+	size_t nranges;
+	size_t first;
+	size_t next;
+	size_t k;
+	bool ok = true;
+
+	m_entries.clear();
+	m_links.clear();
+
+#ifndef FSSCAN_USE_THREADS
+	threads = 1;
+#endif
+	if (threads == 0)
+		threads = 1;
+
+	// More ranges than threads, so the contiguous groups of ranges come out similar in size.
+	if (threads > 1)
+		m_vol.fstree().GetSplitKeys(keys, threads * 8);
+
+	// Range r starts at keys[r - 1], part k scans the ranges from first to next.
+	nranges = keys.size() + 1;
+	parts.resize(std::min<size_t>(threads, nranges));
+
+	if (parts.size() == 1)
+	{
+		ScanRange(parts[0], nullptr, nullptr);
+	}
+	else
+	{
+#ifdef FSSCAN_USE_THREADS
+		std::vector<std::thread> workers;
+
+		for (k = 0; k < parts.size(); k++)
+		{
+			first = k * nranges / parts.size();
+			next = (k + 1) * nranges / parts.size();
+
+			workers.emplace_back(&FsTreeScan::ScanRange, this, std::ref(parts[k]), first > 0 ? &keys[first - 1] : nullptr, next < nranges ? &keys[next - 1] : nullptr);
+		}
+
+		for (std::thread &t : workers)
+			t.join();
+#endif
+	}
+
+	first = 0;
+	next = 0;
+	for (const Part &p : parts)
+	{
+		first += p.entries.size();
+		next += p.links.size();
+	}
+
+	m_entries.reserve(first);
+	m_links.reserve(next);
+
+	// The ranges are in key order, so the results are sorted by id when put together.
+	for (Part &p : parts)
+	{
+		if (!p.ok)
+			ok = false;
+
+		m_entries.insert(m_entries.end(), p.entries.begin(), p.entries.end());
+		std::move(p.links.begin(), p.links.end(), std::back_inserter(m_links));
+
+		p.entries.clear();
+		p.links.clear();
+	}
+
+	for (const Part &p : parts)
+	{
+		for (const AttrSizes &a : p.orphans)
+		{
+			Entry *e = const_cast<Entry *>(GetEntry(a.id));
+
+			if (e)
+				ApplyAttrSizes(*e, a);
+		}
+	}
+
+	return ok;
+}
+
+const FsTreeScan::Entry *FsTreeScan::GetEntry(uint64_t id) const
+{
+	auto it = std::lower_bound(m_entries.begin(), m_entries.end(), id, [](const Entry &e, uint64_t id) { return e.id < id; });
+
+	if (it == m_entries.end() || it->id != id)
+		return nullptr;
+
+	return &*it;
+}
+
+void FsTreeScan::GetChildren(std::vector<const Link *> &children, uint64_t parent_id) const
+{
+	auto it = std::lower_bound(m_links.begin(), m_links.end(), parent_id, [](const Link &l, uint64_t id) { return l.parent_id < id; });
+
+	children.clear();
+
+	for (; it != m_links.end() && it->parent_id == parent_id; ++it)
+		children.push_back(&*it);
+}
+
+void FsTreeScan::GetTotals(Totals &totals, uint64_t id) const
+{
+	std::unordered_set<uint64_t> seen;
+	const Entry *e = GetEntry(id);
+
+	memset(&totals, 0, sizeof(totals));
+
+	if (e)
+		AddTotals(totals, *e, seen, nullptr);
+}
+
+void FsTreeScan::GetDirTotals(std::vector<std::pair<uint64_t, Totals>> &dirs, uint64_t id) const
+{
+	std::unordered_set<uint64_t> seen;
+	Totals totals;
+	const Entry *e = GetEntry(id);
+
+	dirs.clear();
+	memset(&totals, 0, sizeof(totals));
+
+	if (e)
+		AddTotals(totals, *e, seen, &dirs);
+}
+
+void FsTreeScan::AddTotals(Totals &totals, const Entry &e, std::unordered_set<uint64_t> &seen, std::vector<std::pair<uint64_t, Totals>> *dirs) const
+{
+	std::vector<const Link *> children;
+	const Entry *child;
+	Totals sub;
+
+	if ((e.mode & MODE_S_IFMT) != MODE_S_IFDIR)
+	{
+		if (e.nlink > 1 && !seen.insert(e.id).second)
+			return;
+
+		totals.size += e.size;
+		totals.alloced += e.alloced;
+		totals.files++;
+		return;
+	}
+
+	memset(&sub, 0, sizeof(sub));
+	GetChildren(children, e.id);
+
+	for (const Link *l : children)
+	{
+		child = GetEntry(l->file_id);
+		if (child)
+			AddTotals(sub, *child, seen, dirs);
+	}
+
+	if (dirs)
+		dirs->emplace_back(e.id, sub);
+
+	totals.size += sub.size;
+	totals.alloced += sub.alloced;
+	totals.files += sub.files;
+}
+
+void FsTreeScan::ScanRange(Part &part, const std::vector<uint8_t> *beg, const std::vector<uint8_t> *end)
+{
+	ApfsDir dir(m_vol);
+	BTree &tree = m_vol.fstree();
+	BTreeIterator it;
+	BTreeEntry e;
+	AttrSizes a;
+	Entry en;
+	const bool hashed = (m_vol.getTextFormat() & 9) != 0;
+	uint64_t id;
+	bool rc;
+
+	part.ok = true;
+
+	if (beg)
+		rc = tree.GetIterator(it, beg->data(), beg->size(), ApfsDir::CompareStdDirKey, &dir);
+	else
+		rc = tree.GetIteratorBegin(it);
+
+	if (!rc)
+	{
+		std::cerr << "FsTreeScan: Unable to get fs tree iterator." << std::endl;
+		part.ok = false;
+		return;
+	}
+
+	do
+	{
+		if (!it.GetEntry(e))
+			break;
+
+		if (end && ApfsDir::CompareStdDirKey(end->data(), end->size(), e.key, e.key_len, &dir) >= 0)
+			break;
+
+		id = reinterpret_cast<const j_key_t *>(e.key)->obj_id_and_type & OBJ_ID_MASK;
+
+		switch (reinterpret_cast<const j_key_t *>(e.key)->obj_id_and_type >> OBJ_TYPE_SHIFT)
+		{
+		case APFS_TYPE_INODE:
+			{
+				ApfsDir::InodeStat ino;
+
+				ApfsDir::ParseInodeStat(ino, id, e.val, e.val_len);
+
+				en.id = id;
+				en.parent_id = ino.parent_id;
+				en.size = ino.ds_size;
+				en.alloced = ino.ds_alloced_size;
+				en.create_time = ino.create_time;
+				en.mod_time = ino.mod_time;
+				en.change_time = ino.change_time;
+				en.access_time = ino.access_time;
+				en.nlink = static_cast<uint32_t>(ino.nchildren_nlink);
+				en.owner = ino.owner;
+				en.group = ino.group;
+				en.bsd_flags = ino.bsd_flags;
+				en.rdev = ino.rdev;
+				en.mode = ino.mode;
+				en.has_rdev = (ino.optional_present_flags & ApfsDir::Inode::INO_HAS_RDEV) != 0;
+				en.size_known = (ino.bsd_flags & APFS_UF_COMPRESSED) == 0;
+			}
+
+			part.entries.push_back(en);
+			break;
+
+		case APFS_TYPE_XATTR:
+			// The xattrs follow their inode, unless a range boundary is in between.
+			a.id = id;
+			GetAttrSizes(a, e.key, e.key_len, e.val, e.val_len);
+
+			if (!part.entries.empty() && part.entries.back().id == id)
+				ApplyAttrSizes(part.entries.back(), a);
+			else
+				part.orphans.push_back(a);
+			break;
+
+		case APFS_TYPE_DIR_REC:
+			{
+				const uint8_t *name;
+				size_t name_len;
+				size_t hdr_len = hashed ? sizeof(j_drec_hashed_key_t) : sizeof(j_drec_key_t);
+
+				if (e.key_len < hdr_len || e.val_len < sizeof(j_drec_val_t))
+					break;
+
+				if (hashed)
+				{
+					name = reinterpret_cast<const j_drec_hashed_key_t *>(e.key)->name;
+					name_len = reinterpret_cast<const j_drec_hashed_key_t *>(e.key)->name_len_and_hash & J_DREC_LEN_MASK;
+				}
+				else
+				{
+					name = reinterpret_cast<const j_drec_key_t *>(e.key)->name;
+					name_len = reinterpret_cast<const j_drec_key_t *>(e.key)->name_len;
+				}
+
+				name_len = std::min(name_len, e.key_len - hdr_len);
+
+				part.links.emplace_back();
+				part.links.back().parent_id = id;
+				part.links.back().file_id = reinterpret_cast<const j_drec_val_t *>(e.val)->file_id;
+				part.links.back().name.assign(reinterpret_cast<const char *>(name), strnlen(reinterpret_cast<const char *>(name), name_len));
+			}
+			break;
+
+		default:
+			break;
+		}
+	} while (it.next());
+}
+
+void FsTreeScan::GetAttrSizes(AttrSizes &a, const void *key, size_t key_len, const void *val, size_t val_len)
+{
+	const j_xattr_key_t *k = reinterpret_cast<const j_xattr_key_t *>(key);
+	const j_xattr_val_t *v = reinterpret_cast<const j_xattr_val_t *>(val);
+
+	a.size = 0;
+	a.alloced = 0;
+	a.has_size = false;
+	a.size_known = false;
+
+	if (key_len < sizeof(j_xattr_key_t) || val_len < sizeof(j_xattr_val_t))
+		return;
+
+	if (v->flags & XATTR_DATA_STREAM)
+	{
+		if (val_len >= sizeof(j_xattr_val_t) + sizeof(j_xattr_dstream_t))
+			a.alloced = reinterpret_cast<const j_xattr_dstream_t *>(v->xdata)->dstream.alloced_size;
+	}
+	else if ((v->flags & XATTR_DATA_EMBEDDED) && v->xdata_len >= sizeof(CompressionHeader) && val_len >= sizeof(j_xattr_val_t) + sizeof(CompressionHeader) &&
+		strncmp(reinterpret_cast<const char *>(k->name), "com.apple.decmpfs", key_len - sizeof(j_xattr_key_t)) == 0)
+	{
+		// The header of compressed files holds the uncompressed size.
+		a.size = reinterpret_cast<const CompressionHeader *>(v->xdata)->size;
+		a.has_size = true;
+		a.size_known = IsDecompAlgoSupported(reinterpret_cast<const CompressionHeader *>(v->xdata)->algo);
+	}
+}
+
+void FsTreeScan::ApplyAttrSizes(Entry &e, const AttrSizes &a)
+{
+	e.alloced += a.alloced;
+	if (a.has_size)
+		e.size = a.size;
+	if (a.size_known)
+		e.size_known = true;
+}
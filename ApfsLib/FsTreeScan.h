@@ -0,0 +1,121 @@
+/*
+	This file is part of apfs-fuse, a read-only implementation of APFS
+	(Apple File System) for FUSE.
+	Copyright (C) 2017 Simon Gander
+
+	Apfs-fuse is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 2 of the License, or
+	(at your option) any later version.
+
+	Apfs-fuse is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with apfs-fuse.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include "DiskStruct.h"
+
+#if !(defined(_LIBCPP_HAS_NO_THREADS) || defined(M1N1) || defined(__UBOOT__) || defined(JEV_BAREMETAL))
+#define FSSCAN_USE_THREADS
+#include <thread>
+#endif
+
+class ApfsVolume;
+
+// Metadata of a whole volume, read with one pass over the fs tree leaves in key
+// order. The tree can be split into key ranges that are scanned in parallel.
+class FsTreeScan
+{
+public:
+	struct Entry
+	{
+		uint64_t id;
+		uint64_t parent_id;
+		uint64_t size;     // Logical size, uncompressed size of compressed files
+		uint64_t alloced;  // Allocated bytes of the data and xattr streams
+		uint64_t create_time;
+		uint64_t mod_time;
+		uint64_t change_time;
+		uint64_t access_time;
+		uint32_t nlink;    // Children of directories
+		uint32_t owner;
+		uint32_t group;
+		uint32_t bsd_flags;
+		uint32_t rdev;
+		uint16_t mode;
+		bool has_rdev;
+		bool size_known;   // False for compressed files whose size needs the resource fork
+	};
+
+	struct Link
+	{
+		uint64_t parent_id;
+		uint64_t file_id;
+		std::string name;
+	};
+
+	struct Totals
+	{
+		uint64_t size;
+		uint64_t alloced;
+		uint64_t files;
+	};
+
+	FsTreeScan(ApfsVolume &vol);
+	~FsTreeScan();
+
+	bool Scan(unsigned int threads = 1);
+
+	// Sorted by id.
+	const std::vector<Entry> &entries() const { return m_entries; }
+	// Sorted by parent id.
+	const std::vector<Link> &links() const { return m_links; }
+
+	const Entry *GetEntry(uint64_t id) const;
+	void GetChildren(std::vector<const Link *> &children, uint64_t parent_id) const;
+	// Recursive totals of the tree below id. Files with several links are counted once.
+	void GetTotals(Totals &totals, uint64_t id) const;
+	// Totals of every directory below id (including id), children before their parent.
+	void GetDirTotals(std::vector<std::pair<uint64_t, Totals>> &dirs, uint64_t id) const;
+
+private:
+	// Sizes taken from the xattrs of an inode.
+	struct AttrSizes
+	{
+		uint64_t id;
+		uint64_t size;
+		uint64_t alloced;
+		bool has_size;
+		bool size_known;
+	};
+
+	// Records of a key range.
+	struct Part
+	{
+		std::vector<Entry> entries;
+		std::vector<Link> links;
+		std::vector<AttrSizes> orphans; // Xattrs of an inode that is in the previous range
+		bool ok;
+	};
+
+	void ScanRange(Part &part, const std::vector<uint8_t> *beg, const std::vector<uint8_t> *end);
+	void AddTotals(Totals &totals, const Entry &e, std::unordered_set<uint64_t> &seen, std::vector<std::pair<uint64_t, Totals>> *dirs) const;
+	static void GetAttrSizes(AttrSizes &a, const void *key, size_t key_len, const void *val, size_t val_len);
+	static void ApplyAttrSizes(Entry &e, const AttrSizes &a);
+
+	ApfsVolume &m_vol;
+	std::vector<Entry> m_entries;
+	std::vector<Link> m_links;
+};
@@ -0,0 +1,176 @@
+/*
+	This file is part of apfs-fuse, a read-only implementation of APFS
+	(Apple File System) for FUSE.
+	Copyright (C) 2017 Simon Gander
+
+	Apfs-fuse is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 2 of the License, or
+	(at your option) any later version.
+
+	Apfs-fuse is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with apfs-fuse.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+
+#include "HotList.h"
+#include "ApfsContainer.h"
+#include "ApfsVolume.h"
+
+bool HotList::Load(std::vector<HotListEntry> &list, ApfsVolume &vol, const char *path)
+{
+	std::ifstream is(path, std::ios::binary);
+	HotListHeader hdr;
+	uint64_t size;
+
+	list.clear();
+
+	if (!is.is_open())
+	{
+		std::cerr << "Unable to open hot list " << path << std::endl;
+		return false;
+	}
+
+	is.seekg(0, std::ios::end);
+	size = is.tellg();
+	is.seekg(0);
+
+	if (size < sizeof(hdr) || !is.read(reinterpret_cast<char *>(&hdr), sizeof(hdr)) ||
+		hdr.magic != HOT_LIST_MAGIC || hdr.version != HOT_LIST_VERSION ||
+		hdr.cnt != (size - sizeof(hdr)) / sizeof(HotListEntry) || (size - sizeof(hdr)) % sizeof(HotListEntry) != 0)
+	{
+		std::cerr << "Hot list " << path << " is damaged." << std::endl;
+		return false;
+	}
+
+	// Entries of other xids are still useful, the trees check every node they load.
+	if (memcmp(hdr.nx_uuid, vol.getContainer().GetSuperblock().nx_uuid, sizeof(apfs_uuid_t)) != 0 ||
+		memcmp(hdr.vol_uuid, vol.getSuperblock().apfs_vol_uuid, sizeof(apfs_uuid_t)) != 0)
+	{
+		std::cerr << "Hot list " << path << " belongs to another volume." << std::endl;
+		return false;
+	}
+
+	list.resize(hdr.cnt);
+	if (!is.read(reinterpret_cast<char *>(list.data()), hdr.cnt * sizeof(HotListEntry)))
+	{
+		std::cerr << "Error reading hot list " << path << std::endl;
+		list.clear();
+		return false;
+	}
+
+	return true;
+}
+
+void HotList::GetOids(std::vector<oid_t> &oids, const std::vector<HotListEntry> &list, uint32_t subtype)
+{
+	oids.clear();
+
+	for (const HotListEntry &e : list)
+	{
+		if (e.subtype == subtype)
+			oids.push_back(e.oid);
+	}
+}
+
+HotListRecorder::HotListRecorder()
+{
+	m_compacted = 0;
+}
+
+HotListRecorder::~HotListRecorder()
+{
+}
+
+void HotListRecorder::Add(paddr_t paddr, oid_t oid, uint32_t subtype)
+{
+	HotListEntry e;
+
+	e.paddr = paddr;
+	e.oid = oid;
+	e.subtype = subtype;
+	e.pad = 0;
+
+#ifdef HOTLIST_USE_LOCK
+	std::lock_guard<std::mutex> lock(m_mutex);
+#endif
+
+	m_list.push_back(e);
+
+	// Evicted nodes are read again, so duplicates are dropped now and then.
+	if (m_list.size() >= 2 * m_compacted + 4096)
+	{
+		Compact(m_list);
+		m_compacted = m_list.size();
+	}
+}
+
+bool HotListRecorder::Save(ApfsVolume &vol, const char *path)
+{
+	std::vector<HotListEntry> list;
+	HotListHeader hdr;
+	std::string tmp_path(path);
+	std::ofstream os;
+
+	{
+#ifdef HOTLIST_USE_LOCK
+		std::lock_guard<std::mutex> lock(m_mutex);
+#endif
+		list = m_list;
+	}
+
+	Compact(list);
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = HOT_LIST_MAGIC;
+	hdr.version = HOT_LIST_VERSION;
+	memcpy(hdr.nx_uuid, vol.getContainer().GetSuperblock().nx_uuid, sizeof(apfs_uuid_t));
+	memcpy(hdr.vol_uuid, vol.getSuperblock().apfs_vol_uuid, sizeof(apfs_uuid_t));
+	hdr.xid = vol.getXid();
+	hdr.cnt = list.size();
+
+	tmp_path += ".tmp";
+	os.open(tmp_path, std::ios::binary | std::ios::trunc);
+	if (!os.is_open())
+	{
+		std::cerr << "Unable to create hot list " << tmp_path << std::endl;
+		return false;
+	}
+
+	os.write(reinterpret_cast<const char *>(&hdr), sizeof(hdr));
+	os.write(reinterpret_cast<const char *>(list.data()), list.size() * sizeof(HotListEntry));
+	os.close();
+
+	if (os.fail() || std::rename(tmp_path.c_str(), path) != 0)
+	{
+		std::cerr << "Error writing hot list " << path << std::endl;
+		std::remove(tmp_path.c_str());
+		return false;
+	}
+
+	return true;
+}
+
+void HotListRecorder::Compact(std::vector<HotListEntry> &list)
+{
+	std::sort(list.begin(), list.end(), [](const HotListEntry &a, const HotListEntry &b) {
+		if (a.paddr != b.paddr)
+			return a.paddr < b.paddr;
+		return a.oid < b.oid;
+	});
+	list.erase(std::unique(list.begin(), list.end(), [](const HotListEntry &a, const HotListEntry &b) {
+		return a.paddr == b.paddr && a.oid == b.oid;
+	}), list.end());
+}
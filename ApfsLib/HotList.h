@@ -0,0 +1,91 @@
+/*
+	This file is part of apfs-fuse, a read-only implementation of APFS
+	(Apple File System) for FUSE.
+	Copyright (C) 2017 Simon Gander
+
+	Apfs-fuse is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 2 of the License, or
+	(at your option) any later version.
+
+	Apfs-fuse is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with apfs-fuse.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "DiskStruct.h"
+
+#if !(defined(_LIBCPP_HAS_NO_THREADS) || defined(M1N1) || defined(__UBOOT__) || defined(JEV_BAREMETAL))
+#define HOTLIST_USE_LOCK
+#include <mutex>
+#endif
+
+class ApfsVolume;
+
+// List of metadata nodes that were read while a volume was mounted. Replaying it
+// at the next mount loads the same nodes in physical order.
+
+constexpr uint32_t HOT_LIST_MAGIC = 0x54484141; // 'AAHT'
+constexpr uint32_t HOT_LIST_VERSION = 1;
+
+struct HotListHeader
+{
+	le_uint32_t magic;
+	le_uint32_t version;
+	apfs_uuid_t nx_uuid;
+	apfs_uuid_t vol_uuid;
+	le_uint64_t xid;
+	le_uint64_t cnt;
+};
+
+// Sorted by paddr, without duplicates. subtype tells which tree the node belongs to.
+struct HotListEntry
+{
+	le_uint64_t paddr;
+	le_uint64_t oid;
+	le_uint32_t subtype;
+	le_uint32_t pad;
+};
+
+static_assert(sizeof(HotListHeader) == 0x38, "HotListHeader size");
+static_assert(sizeof(HotListEntry) == 24, "HotListEntry size");
+
+class HotList
+{
+public:
+	// Fails if the file is damaged or was recorded on another volume.
+	static bool Load(std::vector<HotListEntry> &list, ApfsVolume &vol, const char *path);
+	// Oids of the entries belonging to trees of the given subtype, in physical order.
+	static void GetOids(std::vector<oid_t> &oids, const std::vector<HotListEntry> &list, uint32_t subtype);
+};
+
+// Collects the nodes the trees read from disk, from any thread.
+class HotListRecorder
+{
+public:
+	HotListRecorder();
+	~HotListRecorder();
+
+	void Add(paddr_t paddr, oid_t oid, uint32_t subtype);
+	// Writes the nodes recorded so far, sorted by paddr. Recording goes on.
+	bool Save(ApfsVolume &vol, const char *path);
+
+private:
+	static void Compact(std::vector<HotListEntry> &list);
+
+#ifdef HOTLIST_USE_LOCK
+	std::mutex m_mutex;
+#endif
+	std::vector<HotListEntry> m_list;
+	size_t m_compacted;
+};
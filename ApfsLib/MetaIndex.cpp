@@ -0,0 +1,403 @@
+/*
+	This file is part of apfs-fuse, a read-only implementation of APFS
+	(Apple File System) for FUSE.
+	Copyright (C) 2017 Simon Gander
+
+	Apfs-fuse is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 2 of the License, or
+	(at your option) any later version.
+
+	Apfs-fuse is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with apfs-fuse.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <string>
+
+#if defined(__linux__) || defined(__APPLE__)
+#define META_INDEX_USE_MMAP
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#include "MetaIndex.h"
+#include "ApfsContainer.h"
+#include "ApfsVolume.h"
+#include "FsTreeScan.h"
+
+static uint64_t AlignOffs(uint64_t offs)
+{
+	return (offs + 7) & ~UINT64_C(7);
+}
+
+static bool WritePad(std::ofstream &os, uint64_t &pos, uint64_t offs)
+{
+	static const char zero[8] = {};
+
+	os.write(zero, offs - pos);
+	pos = offs;
+	return os.good();
+}
+
+MetaIndex::MetaIndex()
+{
+	m_data = nullptr;
+	m_size = 0;
+	m_mapped = false;
+	m_inodes = nullptr;
+	m_links = nullptr;
+	m_names = nullptr;
+	m_omap = nullptr;
+}
+
+MetaIndex::~MetaIndex()
+{
+	Close();
+}
+
+bool MetaIndex::Build(ApfsVolume &vol, const char *path, unsigned int threads)
+{
+	FsTreeScan scan(vol);
+	std::vector<omap_res_t> omap;
+	std::vector<const FsTreeScan::Link *> links;
+	MetaIndexHeader hdr;
+	MetaIndexInode ino;
+	MetaIndexLink lnk;
+	MetaIndexOmap om;
+	const nx_superblock_t &nx = vol.getContainer().GetSuperblock();
+	std::string tmp_path(path);
+	std::ofstream os;
+	uint64_t name_size = 0;
+	uint64_t pos;
+
+	if (!scan.Scan(threads))
+	{
+		std::cerr << "MetaIndex: Scan of the fs tree failed." << std::endl;
+		return false;
+	}
+
+	if (!vol.omap().Flatten(omap, vol.getXid()))
+	{
+		std::cerr << "MetaIndex: Reading the omap failed." << std::endl;
+		return false;
+	}
+
+	links.reserve(scan.links().size());
+	for (const FsTreeScan::Link &l : scan.links())
+	{
+		if (l.name.size() > UINT16_MAX)
+			continue;
+		links.push_back(&l);
+		name_size += l.name.size() + 1;
+	}
+
+	if (name_size > UINT32_MAX)
+	{
+		std::cerr << "MetaIndex: Too many names for the index." << std::endl;
+		return false;
+	}
+
+	std::sort(links.begin(), links.end(), [](const FsTreeScan::Link *a, const FsTreeScan::Link *b) {
+		if (a->parent_id != b->parent_id)
+			return a->parent_id < b->parent_id;
+		return a->name < b->name;
+	});
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = META_INDEX_MAGIC;
+	hdr.version = META_INDEX_VERSION;
+	memcpy(hdr.nx_uuid, nx.nx_uuid, sizeof(apfs_uuid_t));
+	memcpy(hdr.vol_uuid, vol.getSuperblock().apfs_vol_uuid, sizeof(apfs_uuid_t));
+	hdr.nx_xid = nx.nx_o.o_xid;
+	memcpy(hdr.nx_cksum, nx.nx_o.o_cksum, MAX_CKSUM_SIZE);
+	hdr.vol_xid = vol.getXid();
+
+	hdr.inode_offs = sizeof(MetaIndexHeader);
+	hdr.inode_cnt = scan.entries().size();
+	hdr.link_offs = hdr.inode_offs + hdr.inode_cnt * sizeof(MetaIndexInode);
+	hdr.link_cnt = links.size();
+	hdr.name_offs = hdr.link_offs + hdr.link_cnt * sizeof(MetaIndexLink);
+	hdr.name_size = name_size;
+	hdr.omap_offs = AlignOffs(hdr.name_offs + hdr.name_size);
+	hdr.omap_cnt = omap.size();
+	hdr.file_size = hdr.omap_offs + hdr.omap_cnt * sizeof(MetaIndexOmap);
+
+	// Written under a temporary name, so an index is either complete or not there.
+	tmp_path += ".tmp";
+	os.open(tmp_path, std::ios::binary | std::ios::trunc);
+	if (!os.is_open())
+	{
+		std::cerr << "MetaIndex: Unable to create " << tmp_path << std::endl;
+		return false;
+	}
+
+	os.write(reinterpret_cast<const char *>(&hdr), sizeof(hdr));
+
+	for (const FsTreeScan::Entry &e : scan.entries())
+	{
+		ino.id = e.id;
+		ino.parent_id = e.parent_id;
+		ino.size = e.size;
+		ino.create_time = e.create_time;
+		ino.mod_time = e.mod_time;
+		ino.change_time = e.change_time;
+		ino.access_time = e.access_time;
+		ino.nlink = e.nlink;
+		ino.owner = e.owner;
+		ino.group = e.group;
+		ino.bsd_flags = e.bsd_flags;
+		ino.rdev = e.rdev;
+		ino.mode = e.mode;
+		ino.flags = (e.size_known ? META_INO_SIZE_KNOWN : 0) | (e.has_rdev ? META_INO_HAS_RDEV : 0);
+		os.write(reinterpret_cast<const char *>(&ino), sizeof(ino));
+	}
+
+	pos = 0;
+	for (const FsTreeScan::Link *l : links)
+	{
+		lnk.parent_id = l->parent_id;
+		lnk.file_id = l->file_id;
+		lnk.name_offs = static_cast<uint32_t>(pos);
+		lnk.name_len = static_cast<uint16_t>(l->name.size());
+		lnk.pad = 0;
+		os.write(reinterpret_cast<const char *>(&lnk), sizeof(lnk));
+		pos += l->name.size() + 1;
+	}
+
+	for (const FsTreeScan::Link *l : links)
+		os.write(l->name.c_str(), l->name.size() + 1);
+
+	pos = hdr.name_offs + hdr.name_size;
+	WritePad(os, pos, hdr.omap_offs);
+
+	for (const omap_res_t &r : omap)
+	{
+		om.oid = r.oid;
+		om.xid = r.xid;
+		om.paddr = r.paddr;
+		om.flags = r.flags;
+		om.size = r.size;
+		os.write(reinterpret_cast<const char *>(&om), sizeof(om));
+	}
+
+	os.close();
+
+	if (os.fail())
+	{
+		std::cerr << "MetaIndex: Error writing " << tmp_path << std::endl;
+		std::remove(tmp_path.c_str());
+		return false;
+	}
+
+	if (std::rename(tmp_path.c_str(), path) != 0)
+	{
+		std::cerr << "MetaIndex: Unable to rename " << tmp_path << " to " << path << std::endl;
+		std::remove(tmp_path.c_str());
+		return false;
+	}
+
+	return true;
+}
+
+bool MetaIndex::Open(ApfsVolume &vol, const char *path)
+{
+	const MetaIndexHeader *h;
+
+	Close();
+
+#ifdef META_INDEX_USE_MMAP
+	int fd;
+	struct stat st;
+	void *map;
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1)
+		return false;
+
+	if (fstat(fd, &st) != 0 || st.st_size < static_cast<off_t>(sizeof(MetaIndexHeader)) || static_cast<uint64_t>(st.st_size) > SIZE_MAX)
+	{
+		close(fd);
+		return false;
+	}
+
+	map = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if (map == MAP_FAILED)
+		return false;
+
+	m_data = reinterpret_cast<const uint8_t *>(map);
+	m_size = st.st_size;
+	m_mapped = true;
+#else
+	std::ifstream is(path, std::ios::binary);
+
+	if (!is.is_open())
+		return false;
+
+	m_buf.assign(std::istreambuf_iterator<char>(is), std::istreambuf_iterator<char>());
+
+	if (m_buf.size() < sizeof(MetaIndexHeader))
+	{
+		m_buf.clear();
+		return false;
+	}
+
+	m_data = m_buf.data();
+	m_size = m_buf.size();
+#endif
+
+	h = hdr();
+
+	// All sections have to be inside the file, the offsets are 8 byte aligned.
+	if (h->magic != META_INDEX_MAGIC || h->version != META_INDEX_VERSION || h->file_size != m_size ||
+		h->inode_offs != sizeof(MetaIndexHeader) ||
+		h->inode_cnt > m_size / sizeof(MetaIndexInode) ||
+		h->link_offs != h->inode_offs + h->inode_cnt * sizeof(MetaIndexInode) ||
+		h->link_cnt > m_size / sizeof(MetaIndexLink) ||
+		h->name_offs != h->link_offs + h->link_cnt * sizeof(MetaIndexLink) ||
+		h->name_size > m_size ||
+		h->omap_offs != AlignOffs(h->name_offs + h->name_size) ||
+		h->omap_cnt > m_size / sizeof(MetaIndexOmap) ||
+		h->file_size != h->omap_offs + h->omap_cnt * sizeof(MetaIndexOmap))
+	{
+		std::cerr << "MetaIndex: " << path << " is damaged." << std::endl;
+		Close();
+		return false;
+	}
+
+	if (!IsCurrent(*h, vol))
+	{
+		Close();
+		return false;
+	}
+
+	m_inodes = reinterpret_cast<const MetaIndexInode *>(m_data + h->inode_offs);
+	m_links = reinterpret_cast<const MetaIndexLink *>(m_data + h->link_offs);
+	m_names = reinterpret_cast<const char *>(m_data + h->name_offs);
+	m_omap = reinterpret_cast<const MetaIndexOmap *>(m_data + h->omap_offs);
+
+	return true;
+}
+
+void MetaIndex::Close()
+{
+#ifdef META_INDEX_USE_MMAP
+	if (m_mapped)
+		munmap(const_cast<uint8_t *>(m_data), m_size);
+#endif
+	m_buf.clear();
+	m_data = nullptr;
+	m_size = 0;
+	m_mapped = false;
+	m_inodes = nullptr;
+	m_links = nullptr;
+	m_names = nullptr;
+	m_omap = nullptr;
+}
+
+bool MetaIndex::IsCurrent(const MetaIndexHeader &hdr, ApfsVolume &vol)
+{
+	const nx_superblock_t &nx = vol.getContainer().GetSuperblock();
+
+	return memcmp(hdr.nx_uuid, nx.nx_uuid, sizeof(apfs_uuid_t)) == 0 &&
+		memcmp(hdr.vol_uuid, vol.getSuperblock().apfs_vol_uuid, sizeof(apfs_uuid_t)) == 0 &&
+		hdr.nx_xid == nx.nx_o.o_xid &&
+		memcmp(hdr.nx_cksum, nx.nx_o.o_cksum, MAX_CKSUM_SIZE) == 0 &&
+		hdr.vol_xid == vol.getXid();
+}
+
+const MetaIndexInode *MetaIndex::GetInode(uint64_t id) const
+{
+	const MetaIndexInode *beg;
+	const MetaIndexInode *end;
+	const MetaIndexInode *it;
+
+	if (!m_data)
+		return nullptr;
+
+	beg = m_inodes;
+	end = m_inodes + hdr()->inode_cnt;
+	it = std::lower_bound(beg, end, id, [](const MetaIndexInode &e, uint64_t id) { return e.id < id; });
+
+	if (it != end && it->id == id)
+		return it;
+	return nullptr;
+}
+
+bool MetaIndex::LookupName(uint64_t &file_id, uint64_t parent_id, const char *name) const
+{
+	const MetaIndexLink *beg;
+	const MetaIndexLink *end;
+	const MetaIndexLink *it;
+	size_t name_len = strlen(name);
+
+	if (!m_data)
+		return false;
+
+	beg = m_links;
+	end = m_links + hdr()->link_cnt;
+	it = std::lower_bound(beg, end, parent_id, [this, name, name_len](const MetaIndexLink &l, uint64_t parent_id) {
+		if (l.parent_id != parent_id)
+			return l.parent_id < parent_id;
+		return CompareName(l, name, name_len) < 0;
+	});
+
+	if (it == end || it->parent_id != parent_id || CompareName(*it, name, name_len) != 0)
+		return false;
+
+	file_id = it->file_id;
+	return true;
+}
+
+int MetaIndex::CompareName(const MetaIndexLink &l, const char *name, size_t name_len) const
+{
+	size_t len = l.name_len;
+	int cmp;
+
+	// Names outside of the name table sort first, so they never match.
+	if (l.name_offs + static_cast<uint64_t>(len) >= hdr()->name_size)
+		return -1;
+
+	cmp = memcmp(m_names + l.name_offs, name, std::min(len, name_len));
+	if (cmp != 0)
+		return cmp;
+	if (len < name_len)
+		return -1;
+	return len > name_len ? 1 : 0;
+}
+
+void MetaIndex::GetOmap(std::vector<omap_res_t> &map) const
+{
+	omap_res_t r;
+
+	map.clear();
+
+	if (!m_data)
+		return;
+
+	map.reserve(hdr()->omap_cnt);
+	for (uint64_t k = 0; k < hdr()->omap_cnt; k++)
+	{
+		r.oid = m_omap[k].oid;
+		r.xid = m_omap[k].xid;
+		r.flags = m_omap[k].flags;
+		r.size = m_omap[k].size;
+		r.paddr = m_omap[k].paddr;
+		map.push_back(r);
+	}
+}
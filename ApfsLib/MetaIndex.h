@@ -0,0 +1,136 @@
+/*
+	This file is part of apfs-fuse, a read-only implementation of APFS
+	(Apple File System) for FUSE.
+	Copyright (C) 2017 Simon Gander
+
+	Apfs-fuse is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 2 of the License, or
+	(at your option) any later version.
+
+	Apfs-fuse is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with apfs-fuse.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "DiskStruct.h"
+#include "ApfsNodeMapper.h"
+
+class ApfsVolume;
+
+// Sidecar index of the metadata of a volume, written to a file and mapped again at
+// the next mount. It is only valid for the container checkpoint it was built from.
+
+constexpr uint32_t META_INDEX_MAGIC = 0x58444941; // 'AIDX'
+constexpr uint32_t META_INDEX_VERSION = 1;
+
+struct MetaIndexHeader
+{
+	le_uint32_t magic;
+	le_uint32_t version;
+	apfs_uuid_t nx_uuid;
+	apfs_uuid_t vol_uuid;
+	le_uint64_t nx_xid;
+	uint8_t nx_cksum[MAX_CKSUM_SIZE];
+	le_uint64_t vol_xid;
+	le_uint64_t file_size;
+	le_uint64_t inode_offs;
+	le_uint64_t inode_cnt;
+	le_uint64_t link_offs;
+	le_uint64_t link_cnt;
+	le_uint64_t name_offs;
+	le_uint64_t name_size;
+	le_uint64_t omap_offs;
+	le_uint64_t omap_cnt;
+};
+
+constexpr uint16_t META_INO_SIZE_KNOWN = 1;
+constexpr uint16_t META_INO_HAS_RDEV = 2;
+
+// Sorted by id.
+struct MetaIndexInode
+{
+	le_uint64_t id;
+	le_uint64_t parent_id;
+	le_uint64_t size;
+	le_uint64_t create_time;
+	le_uint64_t mod_time;
+	le_uint64_t change_time;
+	le_uint64_t access_time;
+	le_uint32_t nlink;
+	le_uint32_t owner;
+	le_uint32_t group;
+	le_uint32_t bsd_flags;
+	le_uint32_t rdev;
+	le_uint16_t mode;
+	le_uint16_t flags;
+};
+
+// Sorted by parent id, then by the bytes of the name.
+struct MetaIndexLink
+{
+	le_uint64_t parent_id;
+	le_uint64_t file_id;
+	le_uint32_t name_offs;
+	le_uint16_t name_len;
+	le_uint16_t pad;
+};
+
+// Sorted by oid.
+struct MetaIndexOmap
+{
+	le_uint64_t oid;
+	le_uint64_t xid;
+	le_uint64_t paddr;
+	le_uint32_t flags;
+	le_uint32_t size;
+};
+
+static_assert(sizeof(MetaIndexHeader) == 0x88, "MetaIndexHeader size");
+static_assert(sizeof(MetaIndexInode) == 80, "MetaIndexInode size");
+static_assert(sizeof(MetaIndexLink) == 24, "MetaIndexLink size");
+static_assert(sizeof(MetaIndexOmap) == 32, "MetaIndexOmap size");
+
+class MetaIndex
+{
+public:
+	MetaIndex();
+	~MetaIndex();
+
+	// Scans the volume and writes the index for the current checkpoint.
+	static bool Build(ApfsVolume &vol, const char *path, unsigned int threads = 1);
+
+	// Fails if the index is missing, damaged or belongs to another checkpoint.
+	bool Open(ApfsVolume &vol, const char *path);
+	void Close();
+	bool IsOpen() const { return m_data != nullptr; }
+
+	const MetaIndexInode *GetInode(uint64_t id) const;
+	// Exact match of the name bytes, a miss has to be checked in the fs tree.
+	bool LookupName(uint64_t &file_id, uint64_t parent_id, const char *name) const;
+	void GetOmap(std::vector<omap_res_t> &map) const;
+
+private:
+	const MetaIndexHeader *hdr() const { return reinterpret_cast<const MetaIndexHeader *>(m_data); }
+	static bool IsCurrent(const MetaIndexHeader &hdr, ApfsVolume &vol);
+	int CompareName(const MetaIndexLink &l, const char *name, size_t name_len) const;
+
+	const uint8_t *m_data;
+	size_t m_size;
+	bool m_mapped;
+	std::vector<uint8_t> m_buf;
+	const MetaIndexInode *m_inodes;
+	const MetaIndexLink *m_links;
+	const char *m_names;
+	const MetaIndexOmap *m_omap;
+};
@@ -0,0 +1,416 @@
+/*
+	This file is part of apfs-fuse, a read-only implementation of APFS
+	(Apple File System) for FUSE.
+	Copyright (C) 2017 Simon Gander
+
+	Apfs-fuse is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 2 of the License, or
+	(at your option) any later version.
+
+	Apfs-fuse is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with apfs-fuse.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <iostream>
+#include <algorithm>
+#include <cstring>
+
+#include "SnapshotDiff.h"
+#include "ApfsDir.h"
+#include "ApfsVolume.h"
+
+BTreeDiff::BTreeDiff(BTree &tree_old, BTree &tree_new, BTCompareFunc func, void *context) :
+	m_tree_old(tree_old),
+	m_tree_new(tree_new)
+{
+	m_func = func;
+	m_context = context;
+	memset(&m_stats, 0, sizeof(m_stats));
+}
+
+BTreeDiff::~BTreeDiff()
+{
+}
+
+bool BTreeDiff::Run(Receiver &recv)
+{
+	Cursor a;
+	Cursor b;
+	BTreeEntry ea;
+	BTreeEntry eb;
+	BTreeEntry none;
+	paddr_t pa;
+	paddr_t pb;
+	int cmp;
+
+	memset(&m_stats, 0, sizeof(m_stats));
+
+	if (!m_tree_old.m_root_node || !m_tree_new.m_root_node)
+		return false;
+
+	if (m_tree_old.m_root_node->paddr() == m_tree_new.m_root_node->paddr())
+	{
+		m_stats.subtrees_skipped++;
+		return true;
+	}
+
+	InitCursor(a, m_tree_old);
+	InitCursor(b, m_tree_new);
+
+	while (!a.end() || !b.end())
+	{
+		if (!a.end() && !GetEntry(ea, a))
+			return false;
+		if (!b.end() && !GetEntry(eb, b))
+			return false;
+
+		if (a.end() || b.end())
+		{
+			// Everything left on one side has no counterpart.
+			Cursor &c = a.end() ? b : a;
+
+			if (c.level() > 0)
+			{
+				if (!Descend(c))
+					return false;
+				continue;
+			}
+
+			if (a.end() ? !recv.Record(ADDED, none, eb) : !recv.Record(REMOVED, ea, none))
+				return false;
+
+			Advance(c);
+			continue;
+		}
+
+		if (a.level() > 0 && b.level() > 0)
+		{
+			if (a.level() == b.level())
+			{
+				if (!ChildAddress(pa, a) || !ChildAddress(pb, b))
+					return false;
+
+				// Same block, so the same contents in both trees.
+				if (pa == pb)
+				{
+					m_stats.subtrees_skipped++;
+					Advance(a);
+					Advance(b);
+					continue;
+				}
+			}
+
+			// Only the side that starts first is split, so the nodes that follow stay
+			// aligned and the shared ones are found.
+			cmp = Compare(ea, eb);
+
+			if (cmp == 0 && a.level() != b.level())
+				cmp = a.level() > b.level() ? -1 : 1;
+
+			if (cmp <= 0 && !Descend(a))
+				return false;
+			if (cmp >= 0 && !Descend(b))
+				return false;
+			continue;
+		}
+
+		if (a.level() > 0)
+		{
+			// A record before the first key of a subtree on the other side has no counterpart.
+			if (Compare(eb, ea) < 0)
+			{
+				if (!recv.Record(ADDED, none, eb))
+					return false;
+				Advance(b);
+			}
+			else if (!Descend(a))
+				return false;
+			continue;
+		}
+
+		if (b.level() > 0)
+		{
+			if (Compare(ea, eb) < 0)
+			{
+				if (!recv.Record(REMOVED, ea, none))
+					return false;
+				Advance(a);
+			}
+			else if (!Descend(b))
+				return false;
+			continue;
+		}
+
+		m_stats.records_compared++;
+		cmp = Compare(ea, eb);
+
+		if (cmp < 0)
+		{
+			if (!recv.Record(REMOVED, ea, none))
+				return false;
+			Advance(a);
+		}
+		else if (cmp > 0)
+		{
+			if (!recv.Record(ADDED, none, eb))
+				return false;
+			Advance(b);
+		}
+		else
+		{
+			if (ea.val_len != eb.val_len || memcmp(ea.val, eb.val, ea.val_len) != 0)
+			{
+				if (!recv.Record(MODIFIED, ea, eb))
+					return false;
+			}
+			Advance(a);
+			Advance(b);
+		}
+	}
+
+	return true;
+}
+
+void BTreeDiff::InitCursor(Cursor &c, BTree &tree)
+{
+	c.tree = &tree;
+	c.path.clear();
+	c.path.push_back({ tree.m_root_node, 0 });
+	Skip(c);
+}
+
+bool BTreeDiff::Descend(Cursor &c)
+{
+	BTreeEntry e;
+	std::shared_ptr<BTreeNode> node;
+	oid_t oid;
+
+	if (!GetEntry(e, c))
+		return false;
+
+	oid = c.tree->GetChildOid(*c.path.back().node, e);
+	node = c.tree->GetNode(oid);
+
+	if (!node)
+	{
+		std::cerr << "BTreeDiff: Node " << oid << " not found." << std::endl;
+		return false;
+	}
+
+	m_stats.nodes_read++;
+
+	c.path.push_back({ node, 0 });
+	Skip(c);
+
+	return true;
+}
+
+void BTreeDiff::Advance(Cursor &c)
+{
+	c.path.back().index++;
+	Skip(c);
+}
+
+void BTreeDiff::Skip(Cursor &c)
+{
+	// Leave exhausted nodes, the parent then moves on to the next child.
+	while (!c.path.empty() && c.path.back().index >= c.path.back().node->entries_cnt())
+	{
+		c.path.pop_back();
+		if (!c.path.empty())
+			c.path.back().index++;
+	}
+}
+
+bool BTreeDiff::ChildAddress(paddr_t &paddr, const Cursor &c)
+{
+	BTreeEntry e;
+	omap_res_t omr;
+
+	if (!GetEntry(e, c))
+		return false;
+
+	if (!c.tree->MapNode(omr, c.tree->GetChildOid(*c.path.back().node, e)))
+		return false;
+
+	paddr = omr.paddr;
+	return true;
+}
+
+bool BTreeDiff::GetEntry(BTreeEntry &e, const Cursor &c)
+{
+	const BTreeIterator::PathEntry &pe = c.path.back();
+
+	if (!pe.node->GetEntry(e, pe.index))
+	{
+		std::cerr << "BTreeDiff: Unable to get entry " << pe.index << " of node " << pe.node->nodeid() << std::endl;
+		return false;
+	}
+
+	return true;
+}
+
+int BTreeDiff::Compare(const BTreeEntry &a, const BTreeEntry &b) const
+{
+	// The compare function returns the order of its second key relative to the first.
+	return m_func(b.key, b.key_len, a.key, a.key_len, m_context);
+}
+
+class SnapshotDiff::FsReceiver : public BTreeDiff::Receiver
+{
+public:
+	FsReceiver(SnapshotDiff::Receiver &out, uint32_t txt_fmt) : m_out(out), m_txt_fmt(txt_fmt) {}
+
+	bool Record(BTreeDiff::Change change, const BTreeEntry &old_e, const BTreeEntry &new_e) override
+	{
+		const BTreeEntry &e = new_e.key ? new_e : old_e;
+		const j_key_t *hdr = reinterpret_cast<const j_key_t *>(e.key);
+		const uint8_t *name = nullptr;
+		size_t name_len = 0;
+		SnapshotDiff::Record rec;
+
+		rec.change = change;
+		rec.type = static_cast<uint8_t>(hdr->obj_id_and_type >> OBJ_TYPE_SHIFT);
+		rec.obj_id = hdr->obj_id_and_type & OBJ_ID_MASK;
+		rec.offs = 0;
+		rec.old_e = old_e.key ? &old_e : nullptr;
+		rec.new_e = new_e.key ? &new_e : nullptr;
+
+		switch (rec.type)
+		{
+		case APFS_TYPE_DIR_REC:
+			if ((m_txt_fmt & 9) && e.key_len >= sizeof(j_drec_hashed_key_t))
+			{
+				const j_drec_hashed_key_t *k = reinterpret_cast<const j_drec_hashed_key_t *>(e.key);
+				name = k->name;
+				name_len = k->name_len_and_hash & J_DREC_LEN_MASK;
+			}
+			else if (!(m_txt_fmt & 9) && e.key_len >= sizeof(j_drec_key_t))
+			{
+				const j_drec_key_t *k = reinterpret_cast<const j_drec_key_t *>(e.key);
+				name = k->name;
+				name_len = k->name_len;
+			}
+			break;
+		case APFS_TYPE_XATTR:
+			if (e.key_len >= sizeof(j_xattr_key_t))
+			{
+				const j_xattr_key_t *k = reinterpret_cast<const j_xattr_key_t *>(e.key);
+				name = k->name;
+				name_len = k->name_len;
+			}
+			break;
+		case APFS_TYPE_FILE_EXTENT:
+			if (e.key_len >= sizeof(j_file_extent_key_t))
+				rec.offs = reinterpret_cast<const j_file_extent_key_t *>(e.key)->logical_addr;
+			break;
+		case APFS_TYPE_SIBLING_LINK:
+			if (e.key_len >= sizeof(j_sibling_key_t))
+				rec.offs = reinterpret_cast<const j_sibling_key_t *>(e.key)->sibling_id;
+			break;
+		default:
+			break;
+		}
+
+		if (name)
+		{
+			// Names are stored with the terminating NUL.
+			name_len = std::min(name_len, static_cast<size_t>(reinterpret_cast<const uint8_t *>(e.key) + e.key_len - name));
+			rec.name.assign(reinterpret_cast<const char *>(name), strnlen(reinterpret_cast<const char *>(name), name_len));
+		}
+
+		return m_out.Change(rec);
+	}
+
+private:
+	SnapshotDiff::Receiver &m_out;
+	uint32_t m_txt_fmt;
+};
+
+class SnapshotDiff::FextReceiver : public BTreeDiff::Receiver
+{
+public:
+	FextReceiver(SnapshotDiff::Receiver &out) : m_out(out) {}
+
+	bool Record(BTreeDiff::Change change, const BTreeEntry &old_e, const BTreeEntry &new_e) override
+	{
+		const BTreeEntry &e = new_e.key ? new_e : old_e;
+		const fext_tree_key_t *key = reinterpret_cast<const fext_tree_key_t *>(e.key);
+		SnapshotDiff::Record rec;
+
+		rec.change = change;
+		rec.type = APFS_TYPE_FILE_EXTENT;
+		rec.obj_id = key->private_id;
+		rec.offs = key->logical_addr;
+		rec.old_e = old_e.key ? &old_e : nullptr;
+		rec.new_e = new_e.key ? &new_e : nullptr;
+
+		return m_out.Change(rec);
+	}
+
+private:
+	SnapshotDiff::Receiver &m_out;
+};
+
+SnapshotDiff::SnapshotDiff(ApfsVolume &vol_old, ApfsVolume &vol_new) :
+	m_vol_old(vol_old),
+	m_vol_new(vol_new)
+{
+	memset(&m_stats, 0, sizeof(m_stats));
+}
+
+SnapshotDiff::~SnapshotDiff()
+{
+}
+
+bool SnapshotDiff::Run(Receiver &recv)
+{
+	ApfsDir dir(m_vol_new);
+	FsReceiver fs_recv(recv, m_vol_new.getTextFormat());
+	BTreeDiff fs_diff(m_vol_old.fstree(), m_vol_new.fstree(), ApfsDir::CompareStdDirKey, &dir);
+	bool rc;
+
+	rc = fs_diff.Run(fs_recv);
+	m_stats = fs_diff.GetStats();
+
+	// Sealed volumes keep the file extents in a tree of their own.
+	if (rc && m_vol_old.isSealed() && m_vol_new.isSealed())
+	{
+		FextReceiver fext_recv(recv);
+		BTreeDiff fext_diff(m_vol_old.fexttree(), m_vol_new.fexttree(), ApfsDir::CompareFextKey, nullptr);
+
+		rc = fext_diff.Run(fext_recv);
+		m_stats.nodes_read += fext_diff.GetStats().nodes_read;
+		m_stats.subtrees_skipped += fext_diff.GetStats().subtrees_skipped;
+		m_stats.records_compared += fext_diff.GetStats().records_compared;
+	}
+
+	return rc;
+}
+
+const char *SnapshotDiff::TypeName(uint8_t type)
+{
+	switch (type)
+	{
+	case APFS_TYPE_SNAP_METADATA: return "snap_metadata";
+	case APFS_TYPE_EXTENT: return "extent_ref";
+	case APFS_TYPE_INODE: return "inode";
+	case APFS_TYPE_XATTR: return "xattr";
+	case APFS_TYPE_SIBLING_LINK: return "sibling_link";
+	case APFS_TYPE_DSTREAM_ID: return "dstream_id";
+	case APFS_TYPE_CRYPTO_STATE: return "crypto_state";
+	case APFS_TYPE_FILE_EXTENT: return "file_extent";
+	case APFS_TYPE_DIR_REC: return "dir_rec";
+	case APFS_TYPE_DIR_STATS: return "dir_stats";
+	case APFS_TYPE_SNAP_NAME: return "snap_name";
+	case APFS_TYPE_SIBLING_MAP: return "sibling_map";
+	case APFS_TYPE_FILE_INFO: return "file_info";
+	default: return "unknown";
+	}
+}
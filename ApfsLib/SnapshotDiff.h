@@ -0,0 +1,128 @@
+/*
+	This file is part of apfs-fuse, a read-only implementation of APFS
+	(Apple File System) for FUSE.
+	Copyright (C) 2017 Simon Gander
+
+	Apfs-fuse is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 2 of the License, or
+	(at your option) any later version.
+
+	Apfs-fuse is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with apfs-fuse.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "BTree.h"
+
+class ApfsVolume;
+
+// Compares two versions of a B-tree, e.g. the fs tree of two snapshots. Both trees
+// are walked together, subtrees whose nodes map to the same block are skipped.
+class BTreeDiff
+{
+public:
+	enum Change
+	{
+		ADDED,
+		REMOVED,
+		MODIFIED
+	};
+
+	class Receiver
+	{
+	public:
+		virtual ~Receiver() {}
+		// old_e is empty (key == nullptr) for ADDED, new_e for REMOVED. Returning false stops the diff.
+		virtual bool Record(Change change, const BTreeEntry &old_e, const BTreeEntry &new_e) = 0;
+	};
+
+	struct Stats
+	{
+		uint64_t nodes_read;
+		uint64_t subtrees_skipped;
+		uint64_t records_compared;
+	};
+
+	BTreeDiff(BTree &tree_old, BTree &tree_new, BTCompareFunc func, void *context);
+	~BTreeDiff();
+
+	bool Run(Receiver &recv);
+
+	const Stats &GetStats() const { return m_stats; }
+
+private:
+	// Current position in one tree, the path from the root down to the current entry.
+	struct Cursor
+	{
+		BTree *tree;
+		std::vector<BTreeIterator::PathEntry> path;
+
+		bool end() const { return path.empty(); }
+		uint16_t level() const { return path.back().node->level(); }
+	};
+
+	void InitCursor(Cursor &c, BTree &tree);
+	bool Descend(Cursor &c);
+	void Advance(Cursor &c);
+	void Skip(Cursor &c);
+	bool ChildAddress(paddr_t &paddr, const Cursor &c);
+	bool GetEntry(BTreeEntry &e, const Cursor &c);
+	int Compare(const BTreeEntry &a, const BTreeEntry &b) const;
+
+	BTree &m_tree_old;
+	BTree &m_tree_new;
+	BTCompareFunc m_func;
+	void *m_context;
+	Stats m_stats;
+};
+
+// Changes between the fs trees of two versions of a volume, decoded to records.
+class SnapshotDiff
+{
+public:
+	struct Record
+	{
+		BTreeDiff::Change change;
+		uint8_t type;     // APFS_TYPE_*
+		uint64_t obj_id;
+		std::string name; // Dir entry or xattr name
+		uint64_t offs;    // Logical address of a file extent, sibling id of a sibling link
+		const BTreeEntry *old_e;
+		const BTreeEntry *new_e;
+	};
+
+	class Receiver
+	{
+	public:
+		virtual ~Receiver() {}
+		virtual bool Change(const Record &rec) = 0;
+	};
+
+	SnapshotDiff(ApfsVolume &vol_old, ApfsVolume &vol_new);
+	~SnapshotDiff();
+
+	bool Run(Receiver &recv);
+
+	const BTreeDiff::Stats &GetStats() const { return m_stats; }
+
+	static const char *TypeName(uint8_t type);
+
+private:
+	class FsReceiver;
+	class FextReceiver;
+
+	ApfsVolume &m_vol_old;
+	ApfsVolume &m_vol_new;
+	BTreeDiff::Stats m_stats;
+};
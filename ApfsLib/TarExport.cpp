@@ -0,0 +1,480 @@
+/*
+	This file is part of apfs-fuse, a read-only implementation of APFS
+	(Apple File System) for FUSE.
+	Copyright (C) 2017 Simon Gander
+
+	Apfs-fuse is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 2 of the License, or
+	(at your option) any later version.
+
+	Apfs-fuse is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with apfs-fuse.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <iostream>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+
+#include "TarExport.h"
+#include "ApfsVolume.h"
+#include "Decmpfs.h"
+
+struct TarHeader
+{
+	char name[100];
+	char mode[8];
+	char uid[8];
+	char gid[8];
+	char size[12];
+	char mtime[12];
+	char chksum[8];
+	char typeflag;
+	char linkname[100];
+	char magic[6];
+	char version[2];
+	char uname[32];
+	char gname[32];
+	char devmajor[8];
+	char devminor[8];
+	char prefix[155];
+	char pad[12];
+};
+
+static_assert(sizeof(TarHeader) == 512, "TarHeader size wrong");
+
+static constexpr size_t TAR_BLOCK_SIZE = 512;
+static constexpr uint64_t div_nsec = 1000000000;
+
+static void CopyField(char *field, size_t len, const std::string &str)
+{
+	// Longer strings are stored in a pax record, the field is only a fallback.
+	memcpy(field, str.data(), std::min(len, str.size()));
+}
+
+static void FinishHeader(TarHeader &hdr)
+{
+	const uint8_t *p = reinterpret_cast<const uint8_t *>(&hdr);
+	unsigned int sum = 0;
+	size_t k;
+
+	memcpy(hdr.magic, "ustar", 6);
+	memcpy(hdr.version, "00", 2);
+	memset(hdr.chksum, ' ', sizeof(hdr.chksum));
+
+	for (k = 0; k < sizeof(hdr); k++)
+		sum += p[k];
+
+	snprintf(hdr.chksum, sizeof(hdr.chksum), "%06o", sum);
+	hdr.chksum[7] = ' ';
+}
+
+TarExporter::TarExporter(ApfsVolume &vol, std::ostream &os) : m_dir(vol), m_os(os)
+{
+	m_errors = 0;
+}
+
+TarExporter::~TarExporter()
+{
+}
+
+bool TarExporter::Export(const char *path)
+{
+	std::string name = path;
+	uint64_t ino;
+	size_t pos;
+
+	if (!m_dir.LookupPath(ino, path))
+	{
+		Error(path, "Path not found");
+		return false;
+	}
+
+	while (!name.empty() && name.back() == '/')
+		name.pop_back();
+	pos = name.rfind('/');
+	if (pos != std::string::npos)
+		name.erase(0, pos + 1);
+
+	// Exporting the root directory puts its children at the top of the archive.
+	Walk(ino, name);
+
+	return m_os.good();
+}
+
+bool TarExporter::Finish()
+{
+	char end[2 * TAR_BLOCK_SIZE];
+
+	FlushFiles();
+
+	memset(end, 0, sizeof(end));
+	m_os.write(end, sizeof(end));
+	m_os.flush();
+
+	return m_os.good();
+}
+
+void TarExporter::Walk(uint64_t ino, const std::string &name)
+{
+	Entry e;
+	ApfsDir::RecordGroup grp;
+	std::vector<ApfsDir::DirRec> entries;
+	std::vector<uint8_t> target;
+	uint16_t type;
+
+	if (!m_os.good())
+		return;
+
+	if (!m_dir.GetRecordGroup(grp, ino, true))
+	{
+		Error(name, "Unable to read inode");
+		return;
+	}
+
+	type = grp.inode.mode & MODE_S_IFMT;
+
+	e.name = name;
+	e.inode = grp.inode;
+	e.xattrs = std::move(grp.xattrs);
+	e.first_paddr = 0;
+
+	if (type != MODE_S_IFDIR && grp.inode.nchildren_nlink > 1)
+	{
+		auto it = m_link_names.find(ino);
+
+		if (it != m_link_names.end())
+		{
+			// Written after the batch holding the target.
+			m_links.emplace_back(std::move(e), it->second);
+			return;
+		}
+
+		m_link_names[ino] = name;
+	}
+
+	switch (type)
+	{
+	case MODE_S_IFDIR:
+		if (!name.empty())
+		{
+			e.name += '/';
+			WriteHeader(e, '5', 0, std::string());
+		}
+
+		if (!m_dir.ListDirectory(entries, ino))
+		{
+			Error(name, "Unable to list directory");
+			return;
+		}
+
+		// Inodes are keyed by id, visiting them in that order keeps the fs tree lookups local.
+		std::sort(entries.begin(), entries.end(), [](const ApfsDir::DirRec &a, const ApfsDir::DirRec &b) { return a.file_id < b.file_id; });
+
+		for (const ApfsDir::DirRec &c : entries)
+			Walk(c.file_id, name.empty() ? c.name : name + "/" + c.name);
+		break;
+
+	case MODE_S_IFREG:
+		for (const ApfsDir::Extent &ext : grp.extents)
+		{
+			if (ext.phys_block_num != 0)
+			{
+				e.first_paddr = ext.phys_block_num;
+				break;
+			}
+		}
+
+		m_files.push_back(std::move(e));
+		if (m_files.size() >= TAR_BATCH_FILES)
+			FlushFiles();
+		break;
+
+	case MODE_S_IFLNK:
+		{
+			const ApfsDir::XAttrRec *xa = nullptr;
+
+			for (const ApfsDir::XAttrRec &x : e.xattrs)
+			{
+				if (x.name == SYMLINK_EA_NAME)
+					xa = &x;
+			}
+
+			if (!xa || !m_dir.GetAttribute(target, *xa))
+			{
+				Error(name, "Unable to read symlink");
+				return;
+			}
+
+			while (!target.empty() && target.back() == 0)
+				target.pop_back();
+
+			WriteHeader(e, '2', 0, std::string(target.begin(), target.end()));
+		}
+		break;
+
+	case MODE_S_IFIFO:
+		WriteHeader(e, '6', 0, std::string());
+		break;
+
+	case MODE_S_IFCHR:
+		WriteHeader(e, '3', 0, std::string());
+		break;
+
+	case MODE_S_IFBLK:
+		WriteHeader(e, '4', 0, std::string());
+		break;
+
+	default:
+		std::cerr << name << ": Skipping socket" << std::endl;
+		break;
+	}
+}
+
+void TarExporter::FlushFiles()
+{
+	std::stable_sort(m_files.begin(), m_files.end(), [](const Entry &a, const Entry &b) { return a.first_paddr < b.first_paddr; });
+
+	for (const Entry &e : m_files)
+	{
+		if (!WriteFile(e))
+			break;
+	}
+
+	for (const auto &l : m_links)
+	{
+		if (!WriteHeader(l.first, '1', 0, l.second))
+			break;
+	}
+
+	m_files.clear();
+	m_links.clear();
+}
+
+bool TarExporter::WriteFile(const Entry &e)
+{
+	uint64_t size = e.inode.ds_size;
+	uint64_t offs;
+	size_t chunk;
+
+	if (e.inode.bsd_flags & APFS_UF_COMPRESSED)
+	{
+		// The header takes the size from the compression header, the contents follow one chunk at a time.
+		std::vector<uint8_t> cmp;
+		const ApfsDir::XAttrRec *xa = nullptr;
+		const ApfsDir::XAttrRec *rsrc = nullptr;
+		size_t k;
+
+		for (const ApfsDir::XAttrRec &x : e.xattrs)
+		{
+			if (x.name == "com.apple.decmpfs")
+				xa = &x;
+			else if (x.name == "com.apple.ResourceFork")
+				rsrc = &x;
+		}
+
+		if (!xa || !m_dir.GetAttribute(cmp, *xa))
+		{
+			Error(e.name, "Unable to decompress, skipped");
+			return true;
+		}
+
+		DecmpfsStream stream(m_dir, rsrc, cmp);
+
+		if (!stream.Init())
+		{
+			Error(e.name, "Unable to decompress, skipped");
+			return true;
+		}
+
+		if (!WriteHeader(e, '0', stream.size(), std::string()))
+			return false;
+
+		for (k = 0; k < stream.GetChunkCount(); k++)
+		{
+			chunk = stream.GetChunkSize(k);
+			if (m_buf.size() < chunk)
+				m_buf.resize(chunk);
+
+			if (!stream.ReadChunk(k, m_buf.data()))
+			{
+				Error(e.name, "Unable to decompress, replaced by zeroes");
+				memset(m_buf.data(), 0, chunk);
+			}
+
+			if (!WriteData(m_buf.data(), chunk))
+				return false;
+		}
+
+		return WritePadding(stream.size());
+	}
+
+	if (!WriteHeader(e, '0', size, std::string()))
+		return false;
+
+	m_buf.resize(TAR_CHUNK_SIZE);
+
+	for (offs = 0; offs < size; offs += chunk)
+	{
+		chunk = static_cast<size_t>(std::min<uint64_t>(size - offs, TAR_CHUNK_SIZE));
+
+		if (!m_dir.ReadFile(m_buf.data(), e.inode.private_id, offs, chunk))
+		{
+			// The size is already in the header, so the entry has to be completed.
+			Error(e.name, "Read error, replaced by zeroes");
+			memset(m_buf.data(), 0, chunk);
+		}
+
+		if (!WriteData(m_buf.data(), chunk))
+			return false;
+	}
+
+	return WritePadding(size);
+}
+
+bool TarExporter::WriteHeader(const Entry &e, char type, uint64_t size, const std::string &linkname)
+{
+	TarHeader hdr;
+	std::string pax;
+	std::vector<uint8_t> data;
+
+	memset(&hdr, 0, sizeof(hdr));
+
+	if (e.name.size() > sizeof(hdr.name))
+		AddRecord(pax, "path", e.name);
+	if (linkname.size() > sizeof(hdr.linkname))
+		AddRecord(pax, "linkpath", linkname);
+	if (!PutOctal(hdr.size, sizeof(hdr.size), size))
+		AddRecord(pax, "size", std::to_string(size));
+	if (!PutOctal(hdr.uid, sizeof(hdr.uid), e.inode.owner))
+		AddRecord(pax, "uid", std::to_string(e.inode.owner));
+	if (!PutOctal(hdr.gid, sizeof(hdr.gid), e.inode.group))
+		AddRecord(pax, "gid", std::to_string(e.inode.group));
+
+	AddRecord(pax, "mtime", FormatTime(e.inode.mod_time));
+	AddRecord(pax, "atime", FormatTime(e.inode.access_time));
+
+	// A hardlink shares the attributes of its target.
+	if (type != '1')
+	{
+		for (const ApfsDir::XAttrRec &xattr : e.xattrs)
+		{
+			if (IsInternalXattr(e, xattr))
+				continue;
+
+			if (!m_dir.GetAttribute(data, xattr))
+				Error(e.name, ("Unable to read xattr " + xattr.name).c_str());
+			else
+				AddRecord(pax, "SCHILY.xattr." + xattr.name, std::string(data.begin(), data.end()));
+		}
+	}
+
+	if (!pax.empty())
+	{
+		TarHeader xhdr;
+
+		memset(&xhdr, 0, sizeof(xhdr));
+		CopyField(xhdr.name, sizeof(xhdr.name), "PaxHeaders/" + e.name);
+		PutOctal(xhdr.mode, sizeof(xhdr.mode), 0644);
+		PutOctal(xhdr.uid, sizeof(xhdr.uid), 0);
+		PutOctal(xhdr.gid, sizeof(xhdr.gid), 0);
+		PutOctal(xhdr.size, sizeof(xhdr.size), pax.size());
+		PutOctal(xhdr.mtime, sizeof(xhdr.mtime), e.inode.mod_time / div_nsec);
+		xhdr.typeflag = 'x';
+		FinishHeader(xhdr);
+
+		if (!WriteData(&xhdr, sizeof(xhdr)) || !WriteData(pax.data(), pax.size()) || !WritePadding(pax.size()))
+			return false;
+	}
+
+	CopyField(hdr.name, sizeof(hdr.name), e.name);
+	CopyField(hdr.linkname, sizeof(hdr.linkname), linkname);
+	PutOctal(hdr.mode, sizeof(hdr.mode), e.inode.mode & 07777);
+	PutOctal(hdr.mtime, sizeof(hdr.mtime), e.inode.mod_time / div_nsec);
+	hdr.typeflag = type;
+
+	if (type == '3' || type == '4')
+	{
+		// Darwin dev_t layout
+		PutOctal(hdr.devmajor, sizeof(hdr.devmajor), (e.inode.rdev >> 24) & 0xFF);
+		PutOctal(hdr.devminor, sizeof(hdr.devminor), e.inode.rdev & 0xFFFFFF);
+	}
+
+	FinishHeader(hdr);
+
+	return WriteData(&hdr, sizeof(hdr));
+}
+
+bool TarExporter::WriteData(const void *data, size_t size)
+{
+	m_os.write(reinterpret_cast<const char *>(data), size);
+	return m_os.good();
+}
+
+bool TarExporter::WritePadding(uint64_t size)
+{
+	static const char zero[TAR_BLOCK_SIZE] = {};
+	size_t pad = (TAR_BLOCK_SIZE - (size % TAR_BLOCK_SIZE)) % TAR_BLOCK_SIZE;
+
+	return WriteData(zero, pad);
+}
+
+bool TarExporter::IsInternalXattr(const Entry &e, const ApfsDir::XAttrRec &xattr) const
+{
+	if (xattr.name == SYMLINK_EA_NAME)
+		return true;
+	// Compression data is replaced by the decompressed contents.
+	if ((e.inode.bsd_flags & APFS_UF_COMPRESSED) && (xattr.name == "com.apple.decmpfs" || xattr.name == "com.apple.ResourceFork"))
+		return true;
+	return false;
+}
+
+void TarExporter::Error(const std::string &name, const char *what)
+{
+	std::cerr << name << ": " << what << std::endl;
+	m_errors++;
+}
+
+void TarExporter::AddRecord(std::string &pax, const std::string &key, const std::string &value)
+{
+	// "<len> <key>=<value>\n", where len counts its own digits too.
+	size_t len = key.size() + value.size() + 3;
+	size_t digits = std::to_string(len).size();
+
+	while (std::to_string(len + digits).size() > digits)
+		digits++;
+
+	pax += std::to_string(len + digits);
+	pax += ' ';
+	pax += key;
+	pax += '=';
+	pax += value;
+	pax += '\n';
+}
+
+std::string TarExporter::FormatTime(uint64_t nsec)
+{
+	char buf[32];
+
+	snprintf(buf, sizeof(buf), "%llu.%09llu", static_cast<unsigned long long>(nsec / div_nsec), static_cast<unsigned long long>(nsec % div_nsec));
+	return buf;
+}
+
+bool TarExporter::PutOctal(char *field, size_t len, uint64_t val)
+{
+	// len - 1 digits and a terminating NUL. Values that don't fit are left as zero.
+	if ((len - 1) * 3 < 64 && (val >> ((len - 1) * 3)) != 0)
+	{
+		memset(field, '0', len - 1);
+		return false;
+	}
+
+	snprintf(field, len, "%0*llo", static_cast<int>(len - 1), static_cast<unsigned long long>(val));
+	return true;
+}
@@ -0,0 +1,82 @@
+/*
+	This file is part of apfs-fuse, a read-only implementation of APFS
+	(Apple File System) for FUSE.
+	Copyright (C) 2017 Simon Gander
+
+	Apfs-fuse is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 2 of the License, or
+	(at your option) any later version.
+
+	Apfs-fuse is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with apfs-fuse.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <ostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "ApfsDir.h"
+
+class ApfsVolume;
+
+// Number of regular files collected before they are written sorted by physical address.
+#define TAR_BATCH_FILES 4096
+// Size of the pieces uncompressed file contents are copied in.
+#define TAR_CHUNK_SIZE 0x100000
+
+// Writes a tree of a volume as a POSIX pax archive. Metadata is read in fs tree
+// key order, file contents are written in batches sorted by location on disk.
+class TarExporter
+{
+public:
+	TarExporter(ApfsVolume &vol, std::ostream &os);
+	~TarExporter();
+
+	// Adds path with all contents. Archive names start with the last component of path.
+	bool Export(const char *path);
+	// Writes the remaining files and the end of archive marker.
+	bool Finish();
+
+	uint64_t GetErrorCount() const { return m_errors; }
+
+private:
+	struct Entry
+	{
+		std::string name;
+		ApfsDir::Inode inode;
+		std::vector<ApfsDir::XAttrRec> xattrs;
+		paddr_t first_paddr; // Sort key, 0 for files without allocated extents
+	};
+
+	void Walk(uint64_t ino, const std::string &name);
+	void FlushFiles();
+	bool WriteFile(const Entry &e);
+	bool WriteHeader(const Entry &e, char type, uint64_t size, const std::string &linkname);
+	bool WriteData(const void *data, size_t size);
+	bool WritePadding(uint64_t size);
+	bool IsInternalXattr(const Entry &e, const ApfsDir::XAttrRec &xattr) const;
+	void Error(const std::string &name, const char *what);
+
+	static void AddRecord(std::string &pax, const std::string &key, const std::string &value);
+	static std::string FormatTime(uint64_t nsec);
+	static bool PutOctal(char *field, size_t len, uint64_t val);
+
+	ApfsDir m_dir;
+	std::ostream &m_os;
+	std::vector<Entry> m_files;
+	std::vector<std::pair<Entry, std::string>> m_links; // Hardlink entries and their targets
+	std::map<uint64_t, std::string> m_link_names;
+	std::vector<uint8_t> m_buf;
+	uint64_t m_errors;
+};
@@ -2,6 +2,8 @@
 
 #include <cstdint>
 #include <cstddef>
+#include <cstring>
+#include <algorithm>
 
 #include "UnicodeTables_v10.h"
 
@@ -260,38 +262,25 @@ void CanonicalReorder(char32_t *nfd, uint8_t *ccc, size_t len)
 {
 	size_t i;
 	size_t k;
-	bool sorted = false;
 	uint8_t sort_ccc;
 	char32_t sort_ch;
 
-	for (k = 0; k < (len - 1); k++)
+	// Stable insertion sort of each run of non-starters by combining class. Runs are short,
+	// and starters (ccc 0) are never moved, so this only touches what is out of order.
+	for (k = 1; k < len; k++)
 	{
-		if (ccc[k] == 0)
+		sort_ccc = ccc[k];
+		if (sort_ccc == 0 || ccc[k - 1] <= sort_ccc)
 			continue;
 
-		if (ccc[k + 1] == 0)
-			continue;
-
-		do
+		sort_ch = nfd[k];
+		for (i = k; i > 0 && ccc[i - 1] > sort_ccc; i--)
 		{
-			sorted = true;
-
-			for (i = k; i < (len - 1) && ccc[i + 1] != 0; i++)
-			{
-				if (ccc[i] > ccc[i + 1])
-				{
-					sorted = false;
-					sort_ccc = ccc[i + 1];
-					ccc[i + 1] = ccc[i];
-					ccc[i] = sort_ccc;
-					sort_ch = nfd[i + 1];
-					nfd[i + 1] = nfd[i];
-					nfd[i] = sort_ch;
-				}
-			}
-		} while (!sorted);
-
-		k = i + 1;
+			ccc[i] = ccc[i - 1];
+			nfd[i] = nfd[i - 1];
+		}
+		ccc[i] = sort_ccc;
+		nfd[i] = sort_ch;
 	}
 }
 
@@ -326,3 +315,138 @@ bool NormalizeFoldString(std::vector<char32_t> &nfd, const std::vector<char32_t>
 
 	return true;
 }
+
+// Length of the run of ASCII characters at str, stopping at a NUL. Checks 8 bytes at a time.
+static size_t AsciiRunLength(const uint8_t *str, size_t max)
+{
+	constexpr uint64_t lo_bits = 0x0101010101010101ULL;
+	constexpr uint64_t hi_bits = 0x8080808080808080ULL;
+	size_t n = 0;
+	uint64_t v;
+
+	while (n + 8 <= max)
+	{
+		memcpy(&v, str + n, sizeof(v));
+		// High bit set in any byte, or any byte zero
+		if ((v | ((v - lo_bits) & ~v)) & hi_bits)
+			break;
+		n += 8;
+	}
+
+	while (n < max && str[n] != 0 && str[n] < 0x80)
+		n++;
+
+	return n;
+}
+
+NormalizeFoldStream::NormalizeFoldStream(const uint8_t *str, size_t len, bool case_fold)
+{
+	m_str = str;
+	m_len = len;
+	m_pos = 0;
+	m_fill = 0;
+	m_emitted = 0;
+	m_case_fold = case_fold;
+}
+
+int NormalizeFoldStream::Next(const char32_t *&chunk)
+{
+	size_t n;
+	size_t k;
+	size_t cut;
+	int cnt;
+	int rc;
+	char32_t ch;
+	uint8_t c;
+
+	if (m_emitted > 0)
+	{
+		m_fill -= m_emitted;
+		memmove(m_nfd, m_nfd + m_emitted, m_fill * sizeof(char32_t));
+		memmove(m_ccc, m_ccc + m_emitted, m_fill);
+		m_emitted = 0;
+	}
+
+	while (m_pos < m_len && m_str[m_pos] != 0 && m_fill + 4 <= BUFFER_SIZE)
+	{
+		c = m_str[m_pos];
+
+		if (c < 0x80)
+		{
+			// ASCII never decomposes and only needs folding, so skip the trie entirely.
+			n = AsciiRunLength(m_str + m_pos, std::min(m_len - m_pos, BUFFER_SIZE - m_fill));
+			if (m_case_fold)
+			{
+				for (k = 0; k < n; k++)
+					m_nfd[m_fill + k] = nf_basic_cf[m_str[m_pos + k]];
+			}
+			else
+			{
+				for (k = 0; k < n; k++)
+					m_nfd[m_fill + k] = m_str[m_pos + k];
+			}
+			memset(m_ccc + m_fill, 0, n);
+			m_fill += n;
+			m_pos += n;
+			continue;
+		}
+
+		if (c < 0xC0)
+			return -1;
+		else if (c < 0xE0)
+		{
+			ch = c & 0x1F;
+			cnt = 1;
+		}
+		else if (c < 0xF0)
+		{
+			ch = c & 0x0F;
+			cnt = 2;
+		}
+		else if (c < 0xF8)
+		{
+			ch = c & 0x07;
+			cnt = 3;
+		}
+		else
+			return -1;
+
+		if (m_len - m_pos <= static_cast<size_t>(cnt))
+			return -1;
+
+		for (m_pos++; cnt > 0; --cnt)
+		{
+			c = m_str[m_pos++];
+			if ((c & 0xC0) != 0x80)
+				return -1;
+			ch = (ch << 6) | (c & 0x3F);
+		}
+
+		if (ch == 0)
+			return -1;
+
+		rc = normalizeOptFoldU32Char(ch, m_case_fold, m_nfd + m_fill, m_ccc + m_fill);
+		if (rc < 0)
+			return -1;
+
+		m_fill += rc;
+	}
+
+	if (m_pos >= m_len || m_str[m_pos] == 0)
+		cut = m_fill;
+	else
+	{
+		// Keep the last starter and whatever follows it, the next character might still combine with it.
+		for (cut = m_fill - 1; cut > 0 && m_ccc[cut] != 0; cut--)
+			;
+		if (cut == 0)
+			return -1;
+	}
+
+	CanonicalReorder(m_nfd, m_ccc, cut);
+
+	m_emitted = cut;
+	chunk = m_nfd;
+
+	return static_cast<int>(cut);
+}
@@ -8,3 +8,29 @@ int normalizeOptFoldU32Char(char32_t ch, bool case_insensitive, char32_t *sequen
 void CanonicalReorder(char32_t *nfd, uint8_t *ccc, size_t len);
 
 bool NormalizeFoldString(std::vector<char32_t> &out, const std::vector<char32_t> &in, bool case_fold);
+
+// UTF-8 -> NFD (optionally case folded) conversion without heap allocations. The output is
+// handed out in chunks that end before a starter, so canonical reordering never crosses a chunk.
+class NormalizeFoldStream
+{
+public:
+	static constexpr size_t BUFFER_SIZE = 128;
+
+	// The string ends at len or at the first NUL byte, whichever comes first.
+	NormalizeFoldStream(const uint8_t *str, size_t len, bool case_fold);
+
+	// Returns the size of the next chunk, 0 at the end of the string, and -1 on invalid UTF-8,
+	// characters normalizeOptFoldU32Char rejects, or a combining sequence longer than the buffer.
+	int Next(const char32_t *&chunk);
+
+private:
+	const uint8_t *m_str;
+	size_t m_len;
+	size_t m_pos;
+	size_t m_fill;
+	size_t m_emitted;
+	bool m_case_fold;
+
+	char32_t m_nfd[BUFFER_SIZE];
+	uint8_t m_ccc[BUFFER_SIZE];
+};
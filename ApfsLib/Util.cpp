@@ -25,6 +25,7 @@
 #include <iomanip>
 #include <vector>
 #include <sstream>
+#include <cstring>
 #if defined(__linux__) || defined(__APPLE__)
 #include <termios.h>
 #endif
@@ -259,26 +260,33 @@ void dump_utf32(std::ostream &st, const char32_t *str, size_t size)
 
 uint32_t HashFilename(const uint8_t* utf8str, uint16_t name_len, bool case_fold)
 {
-	std::vector<char32_t> utf32;
-	std::vector<char32_t> utf32_nfd;
-	uint32_t hash;
+	NormalizeFoldStream nfs(utf8str, name_len, case_fold);
+	const char32_t *chunk = nullptr;
+	int cnt;
+	uint32_t hash = 0xFFFFFFFF;
+
+	while ((cnt = nfs.Next(chunk)) > 0)
+		hash = g_crc.Calc(hash, reinterpret_cast<const uint8_t *>(chunk), cnt * sizeof(char32_t));
 
-	Utf8toUtf32(utf32, utf8str);
+	if (cnt < 0)
+	{
+		// Invalid or pathological names are hashed exactly as the vector based code always did.
+		std::vector<char32_t> utf32;
+		std::vector<char32_t> utf32_nfd;
 
-	NormalizeFoldString(utf32_nfd, utf32, case_fold);
+		Utf8toUtf32(utf32, utf8str);
+		NormalizeFoldString(utf32_nfd, utf32, case_fold);
 
 #if 0
-	if (g_debug & Dbg_Dir)
-	{
-		dump_utf32(std::cerr, utf32.data(), utf32.size());
-		dump_utf32(std::cerr, utf32_nfd.data(), utf32_nfd.size());
-	}
+		if (g_debug & Dbg_Dir)
+		{
+			dump_utf32(std::cerr, utf32.data(), utf32.size());
+			dump_utf32(std::cerr, utf32_nfd.data(), utf32_nfd.size());
+		}
 #endif
 
-	g_crc.SetCRC(0xFFFFFFFF);
-	g_crc.Calc(reinterpret_cast<const uint8_t *>(utf32_nfd.data()), utf32_nfd.size() * sizeof(char32_t));
-
-	hash = g_crc.GetCRC();
+		hash = g_crc.Calc(0xFFFFFFFF, reinterpret_cast<const uint8_t *>(utf32_nfd.data()), utf32_nfd.size() * sizeof(char32_t));
+	}
 
 	hash = ((hash & 0x3FFFFF) << 10) | (name_len & 0x3FF);
 
@@ -301,7 +309,7 @@ int apfs_strncmp(const uint8_t *s1, size_t s1_len, const uint8_t *s2, size_t s2_
 	return 0;
 }
 
-int StrCmpUtf8NormalizedFolded(const uint8_t* s1, const uint8_t* s2, bool case_fold)
+static int StrCmpUtf8NormalizedFoldedVec(const uint8_t* s1, const uint8_t* s2, bool case_fold)
 {
 	std::vector<char32_t> s1_u32;
 	std::vector<char32_t> s2_u32;
@@ -333,6 +341,46 @@ int StrCmpUtf8NormalizedFolded(const uint8_t* s1, const uint8_t* s2, bool case_f
 	return 0;
 }
 
+int StrCmpUtf8NormalizedFolded(const uint8_t* s1, const uint8_t* s2, bool case_fold)
+{
+	NormalizeFoldStream n1(s1, strlen(reinterpret_cast<const char *>(s1)), case_fold);
+	NormalizeFoldStream n2(s2, strlen(reinterpret_cast<const char *>(s2)), case_fold);
+	const char32_t *c1 = nullptr;
+	const char32_t *c2 = nullptr;
+	int l1 = 0;
+	int l2 = 0;
+
+	while (true)
+	{
+		if (l1 == 0)
+			l1 = n1.Next(c1);
+		if (l2 == 0)
+			l2 = n2.Next(c2);
+
+		if (l1 < 0 || l2 < 0)
+			return StrCmpUtf8NormalizedFoldedVec(s1, s2, case_fold);
+
+		if (l1 == 0 || l2 == 0)
+			break;
+
+		if (*c1 < *c2)
+			return -1;
+		if (*c1 > *c2)
+			return 1;
+
+		++c1;
+		++c2;
+		--l1;
+		--l2;
+	}
+
+	if (l2 > 0)
+		return -1;
+	if (l1 > 0)
+		return 1;
+	return 0;
+}
+
 bool Utf8toUtf32(std::vector<char32_t> &str32, const uint8_t* str)
 {
 	size_t ip = 0;
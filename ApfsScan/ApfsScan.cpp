@@ -0,0 +1,258 @@
+/*
+	This file is part of apfs-fuse, a read-only implementation of APFS
+	(Apple File System) for FUSE.
+	Copyright (C) 2017 Simon Gander
+
+	Apfs-fuse is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 2 of the License, or
+	(at your option) any later version.
+
+	Apfs-fuse is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with apfs-fuse.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <fnmatch.h>
+#include <getopt.h>
+
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <ApfsLib/ApfsContainer.h>
+#include <ApfsLib/ApfsVolume.h>
+#include <ApfsLib/ApfsDir.h>
+#include <ApfsLib/Device.h>
+#include <ApfsLib/FsTreeScan.h>
+#include <ApfsLib/GptPartitionMap.h>
+
+static char type_char(uint16_t mode)
+{
+	switch (mode & MODE_S_IFMT)
+	{
+		case MODE_S_IFDIR: return 'd';
+		case MODE_S_IFREG: return 'f';
+		case MODE_S_IFLNK: return 'l';
+		case MODE_S_IFIFO: return 'p';
+		case MODE_S_IFCHR: return 'c';
+		case MODE_S_IFBLK: return 'b';
+		case MODE_S_IFSOCK: return 's';
+		default: return '?';
+	}
+}
+
+// Prints type, size, mtime and path of the entries below id whose name matches pattern.
+static void find(const FsTreeScan &scan, uint64_t id, const std::string &path, const char *pattern)
+{
+	constexpr uint64_t div_nsec = 1000000000;
+	std::vector<const FsTreeScan::Link *> children;
+	const FsTreeScan::Entry *e;
+
+	scan.GetChildren(children, id);
+
+	for (const FsTreeScan::Link *l : children)
+	{
+		e = scan.GetEntry(l->file_id);
+		if (!e)
+			continue;
+
+		if (!pattern || fnmatch(pattern, l->name.c_str(), 0) == 0)
+		{
+			printf("%c\t%llu\t%llu\t%s/%s\n", type_char(e->mode), static_cast<unsigned long long>(e->size),
+				static_cast<unsigned long long>(e->mod_time / div_nsec), path.c_str(), l->name.c_str());
+		}
+
+		if ((e->mode & MODE_S_IFMT) == MODE_S_IFDIR)
+			find(scan, e->id, path + "/" + l->name, pattern);
+	}
+}
+
+static void dir_paths(const FsTreeScan &scan, uint64_t id, const std::string &path, std::map<uint64_t, std::string> &paths)
+{
+	std::vector<const FsTreeScan::Link *> children;
+	const FsTreeScan::Entry *e;
+
+	paths[id] = path.empty() ? "/" : path;
+
+	scan.GetChildren(children, id);
+
+	for (const FsTreeScan::Link *l : children)
+	{
+		e = scan.GetEntry(l->file_id);
+		if (e && (e->mode & MODE_S_IFMT) == MODE_S_IFDIR)
+			dir_paths(scan, e->id, path + "/" + l->name, paths);
+	}
+}
+
+// Prints allocated KiB, size, number of files and path of every directory below id, like du.
+static void du(const FsTreeScan &scan, uint64_t id, const std::string &path)
+{
+	std::vector<std::pair<uint64_t, FsTreeScan::Totals>> dirs;
+	std::map<uint64_t, std::string> paths;
+
+	dir_paths(scan, id, path, paths);
+	scan.GetDirTotals(dirs, id);
+
+	for (const auto &d : dirs)
+	{
+		printf("%llu\t%llu\t%llu\t%s\n", static_cast<unsigned long long>((d.second.alloced + 1023) / 1024),
+			static_cast<unsigned long long>(d.second.size), static_cast<unsigned long long>(d.second.files), paths[d.first].c_str());
+	}
+}
+
+static void usage(const char *name)
+{
+	std::cerr << "Syntax: " << name << " [-v volume-id] [-r passphrase] [-s snapshot-xid] [-j threads] <device> <command> ..." << std::endl;
+	std::cerr << std::endl;
+	std::cerr << "Reads the metadata of the whole volume in one sequential pass and answers queries from memory." << std::endl;
+	std::cerr << std::endl;
+	std::cerr << "Commands:" << std::endl;
+	std::cerr << "find [path [pattern]] : Lists type, size, mtime and path of the entries below path whose name" << std::endl;
+	std::cerr << "                        matches the shell pattern." << std::endl;
+	std::cerr << "du [path]             : Lists allocated KiB, size, number of files and path of the directories" << std::endl;
+	std::cerr << "                        below path." << std::endl;
+	std::cerr << std::endl;
+	std::cerr << "-v volume-id   : Volume number (default 0)." << std::endl;
+	std::cerr << "-r passphrase  : Passphrase of an encrypted volume. Asked for if not specified." << std::endl;
+	std::cerr << "-s xid         : Scan a snapshot." << std::endl;
+	std::cerr << "-j threads     : Number of threads scanning the tree (default: number of CPUs)." << std::endl;
+}
+
+int main(int argc, char *argv[])
+{
+	std::unique_ptr<Device> disk;
+	std::unique_ptr<ApfsContainer> container;
+	std::unique_ptr<ApfsVolume> vol;
+	std::streambuf *cout_buf;
+	unsigned int vol_id = 0;
+	std::string passphrase;
+	xid_t snap_xid = 0;
+	unsigned int threads = std::thread::hardware_concurrency();
+	uint64_t main_offset = 0;
+	uint64_t main_size;
+	uint64_t ino;
+	const char *cmd;
+	const char *path;
+	std::string start;
+	int partition_id;
+	int opt;
+	int rc = 0;
+
+	g_debug = 0;
+
+	while ((opt = getopt(argc, argv, "v:r:s:j:")) != -1)
+	{
+		switch (opt)
+		{
+			case 'v':
+				vol_id = strtoul(optarg, nullptr, 10);
+				break;
+			case 'r':
+				passphrase = optarg;
+				break;
+			case 's':
+				snap_xid = strtoull(optarg, nullptr, 10);
+				break;
+			case 'j':
+				threads = strtoul(optarg, nullptr, 10);
+				break;
+			default:
+				usage(argv[0]);
+				return 1;
+		}
+	}
+
+	if ((argc - optind) < 2)
+	{
+		usage(argv[0]);
+		return 1;
+	}
+
+	cmd = argv[optind + 1];
+	path = (argc - optind) > 2 ? argv[optind + 2] : "/";
+
+	if (!((strcmp(cmd, "find") == 0 && (argc - optind) <= 4) || (strcmp(cmd, "du") == 0 && (argc - optind) <= 3)))
+	{
+		usage(argv[0]);
+		return 1;
+	}
+
+	disk.reset(Device::OpenDevice(argv[optind]));
+	if (!disk)
+	{
+		std::cerr << "Unable to open device " << argv[optind] << std::endl;
+		return 1;
+	}
+
+	main_size = disk->GetSize();
+
+	GptPartitionMap gpt;
+	if (gpt.LoadAndVerify(*disk))
+	{
+		partition_id = gpt.FindFirstAPFSPartition();
+		if (partition_id != -1)
+			gpt.GetPartitionOffsetAndSize(partition_id, main_offset, main_size);
+	}
+
+	// Messages and the passphrase prompt must not end up in the output.
+	cout_buf = std::cout.rdbuf(std::cerr.rdbuf());
+
+	container.reset(new ApfsContainer(disk.get(), main_offset, main_size));
+	if (container->Init())
+		vol.reset(container->GetVolume(vol_id, passphrase, snap_xid));
+
+	std::cout.rdbuf(cout_buf);
+
+	if (!vol)
+	{
+		std::cerr << "Unable to get volume!" << std::endl;
+		container.reset();
+		disk->Close();
+		return 1;
+	}
+
+	{
+		ApfsDir dir(*vol);
+		FsTreeScan scan(*vol);
+
+		if (!dir.LookupPath(ino, path))
+		{
+			std::cerr << "Path not found: " << path << std::endl;
+			rc = 1;
+		}
+		else
+		{
+			if (!scan.Scan(threads))
+			{
+				std::cerr << "Errors while scanning, results are incomplete." << std::endl;
+				rc = 1;
+			}
+
+			start = path;
+			while (!start.empty() && start.back() == '/')
+				start.pop_back();
+
+			if (strcmp(cmd, "find") == 0)
+				find(scan, ino, start, (argc - optind) > 3 ? argv[optind + 3] : nullptr);
+			else
+				du(scan, ino, start);
+		}
+	}
+
+	vol.reset();
+	container.reset();
+	disk->Close();
+
+	return rc;
+}
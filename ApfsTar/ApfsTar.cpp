@@ -0,0 +1,183 @@
+/*
+	This file is part of apfs-fuse, a read-only implementation of APFS
+	(Apple File System) for FUSE.
+	Copyright (C) 2017 Simon Gander
+
+	Apfs-fuse is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 2 of the License, or
+	(at your option) any later version.
+
+	Apfs-fuse is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with apfs-fuse.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include <getopt.h>
+#include <unistd.h>
+
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <string>
+
+#include <ApfsLib/ApfsContainer.h>
+#include <ApfsLib/ApfsVolume.h>
+#include <ApfsLib/Device.h>
+#include <ApfsLib/GptPartitionMap.h>
+#include <ApfsLib/TarExport.h>
+
+static void usage(const char *name)
+{
+	std::cerr << "Syntax: " << name << " [-v volume-id] [-r passphrase] [-s snapshot-xid] [-f archive] <device> [path ...]" << std::endl;
+	std::cerr << std::endl;
+	std::cerr << "Writes the paths of the volume with all contents as pax archive (default: the whole volume)." << std::endl;
+	std::cerr << "Extended attributes are stored as SCHILY.xattr records." << std::endl;
+	std::cerr << std::endl;
+	std::cerr << "-v volume-id   : Volume number (default 0)." << std::endl;
+	std::cerr << "-r passphrase  : Passphrase of an encrypted volume. Asked for if not specified." << std::endl;
+	std::cerr << "-s xid         : Export a snapshot." << std::endl;
+	std::cerr << "-f archive     : Output file (default: standard output)." << std::endl;
+}
+
+int main(int argc, char *argv[])
+{
+	std::unique_ptr<Device> disk;
+	std::unique_ptr<ApfsContainer> container;
+	std::unique_ptr<ApfsVolume> vol;
+	std::ofstream file;
+	std::ostream *os = &std::cout;
+	std::streambuf *cout_buf;
+	unsigned int vol_id = 0;
+	std::string passphrase;
+	const char *archive = nullptr;
+	xid_t snap_xid = 0;
+	uint64_t main_offset = 0;
+	uint64_t main_size;
+	int partition_id;
+	int opt;
+	int k;
+	bool ok = true;
+
+	g_debug = 0;
+
+	while ((opt = getopt(argc, argv, "v:r:s:f:")) != -1)
+	{
+		switch (opt)
+		{
+			case 'v':
+				vol_id = strtoul(optarg, nullptr, 10);
+				break;
+			case 'r':
+				passphrase = optarg;
+				break;
+			case 's':
+				snap_xid = strtoull(optarg, nullptr, 10);
+				break;
+			case 'f':
+				archive = optarg;
+				break;
+			default:
+				usage(argv[0]);
+				return 1;
+		}
+	}
+
+	if (optind >= argc)
+	{
+		usage(argv[0]);
+		return 1;
+	}
+
+	if (!archive && isatty(STDOUT_FILENO))
+	{
+		std::cerr << "Refusing to write archive to a terminal." << std::endl;
+		return 1;
+	}
+
+	disk.reset(Device::OpenDevice(argv[optind]));
+	if (!disk)
+	{
+		std::cerr << "Unable to open device " << argv[optind] << std::endl;
+		return 1;
+	}
+
+	main_size = disk->GetSize();
+
+	GptPartitionMap gpt;
+	if (gpt.LoadAndVerify(*disk))
+	{
+		partition_id = gpt.FindFirstAPFSPartition();
+		if (partition_id != -1)
+			gpt.GetPartitionOffsetAndSize(partition_id, main_offset, main_size);
+	}
+
+	// Messages and the passphrase prompt must not end up in the archive.
+	cout_buf = std::cout.rdbuf(std::cerr.rdbuf());
+
+	container.reset(new ApfsContainer(disk.get(), main_offset, main_size));
+	if (container->Init())
+		vol.reset(container->GetVolume(vol_id, passphrase, snap_xid));
+
+	std::cout.rdbuf(cout_buf);
+
+	if (!vol)
+	{
+		std::cerr << "Unable to get volume!" << std::endl;
+		container.reset();
+		disk->Close();
+		return 1;
+	}
+
+	if (archive)
+	{
+		file.open(archive, std::ios::binary | std::ios::trunc);
+		if (!file)
+		{
+			std::cerr << "Unable to create " << archive << ": " << strerror(errno) << std::endl;
+			vol.reset();
+			container.reset();
+			disk->Close();
+			return 1;
+		}
+		os = &file;
+	}
+
+	{
+		TarExporter tar(*vol, *os);
+
+		if (optind + 1 == argc)
+			ok = tar.Export("/");
+
+		for (k = optind + 1; k < argc && os->good(); k++)
+		{
+			if (!tar.Export(argv[k]))
+				ok = false;
+		}
+
+		if (!tar.Finish())
+		{
+			std::cerr << "Error writing archive." << std::endl;
+			ok = false;
+		}
+		else if (tar.GetErrorCount() != 0)
+		{
+			std::cerr << tar.GetErrorCount() << " errors." << std::endl;
+			ok = false;
+		}
+	}
+
+	file.close();
+
+	vol.reset();
+	container.reset();
+	disk->Close();
+
+	return ok ? 0 : 1;
+}
@@ -1,9 +1,13 @@
 #include <ApfsLib/ApfsContainer.h>
+#include <ApfsLib/ApfsVolume.h>
+#include <ApfsLib/ApfsDir.h>
 #include <ApfsLib/Device.h>
 #include <ApfsLib/GptPartitionMap.h>
 
 #include <cerrno>
 #include <cinttypes>
+#include <cstdlib>
+#include <cstring>
 
 static void print_apfs_uuid(const apfs_uuid_t &uuid)
 {
@@ -52,6 +56,71 @@ static void print_filevault(uint64_t flags)
 		printf("Yes");
 }
 
+static int print_extents(ApfsContainer &container, int volume, const char *path)
+{
+	ApfsVolume *vol;
+	ApfsDir::InodeStat ino;
+	std::vector<ApfsDir::PhysExtent> extents;
+	uint64_t id = 0;
+	bool indirect = false;
+	int err = 0;
+
+	vol = container.GetVolume(volume);
+	if (!vol) {
+		printf("Unable to open volume %d\n", volume);
+		return EIO;
+	}
+
+	{
+		ApfsDir dir(*vol);
+
+		if (!dir.LookupPath(id, path)) {
+			printf("Path not found: %s\n", path);
+			err = ENOENT;
+		}
+
+		if (!err && !dir.GetInodeStat(ino, id)) {
+			printf("Unable to read inode %" PRIu64 "\n", id);
+			err = EIO;
+		}
+
+		if (!err && !dir.GetPhysExtents(extents, id)) {
+			printf("Unable to read extents of inode %" PRIu64 "\n", id);
+			err = EIO;
+		}
+
+		if (!err) {
+			if (ino.bsd_flags & APFS_UF_COMPRESSED)
+				printf("Note: file is compressed, the contents are in the decmpfs attribute or resource fork.\n");
+
+			for (const ApfsDir::PhysExtent &pe : extents) {
+				if (pe.flags & ApfsDir::PhysExtent::INDIRECT)
+					indirect = true;
+			}
+			if (indirect)
+				printf("Note: the device is a disk image format, device offsets marked 'image' can't be read directly from the file.\n");
+
+			printf("%16s %16s %16s %16s  flags\n", "logical", "device", "length", "crypto_id");
+			for (const ApfsDir::PhysExtent &pe : extents) {
+				printf("%16" PRIx64 " %16" PRIx64 " %16" PRIx64 " %16" PRIx64 " ", pe.logical_offs, pe.device_offs, pe.length, pe.crypto_id);
+				if (pe.flags & ApfsDir::PhysExtent::SPARSE)
+					printf(" sparse");
+				if (pe.flags & ApfsDir::PhysExtent::ENCRYPTED)
+					printf(" encrypted");
+				if (pe.flags & ApfsDir::PhysExtent::TIER2)
+					printf(" tier2");
+				if (pe.flags & ApfsDir::PhysExtent::INDIRECT)
+					printf(" image");
+				printf("\n");
+			}
+		}
+	}
+
+	delete vol;
+
+	return err;
+}
+
 int main(int argc, char *argv[])
 {
 	const char *devname = nullptr;
@@ -61,12 +130,17 @@ int main(int argc, char *argv[])
 	uint64_t size;
 	int volcnt;
 	apfs_superblock_t apsb;
+	bool list = true;
+	int err = 0;
 
 	g_debug = 0;
 
-	if (argc < 2)
+	if (argc == 5 && !strcmp(argv[2], "extents"))
+		list = false;
+	else if (argc != 2)
 	{
 		printf("Syntax: %s [device]\n", argv[0]);
+		printf("        %s [device] extents [volume] [path]\n", argv[0]);
 		return EINVAL;
 	}
 
@@ -80,20 +154,29 @@ int main(int argc, char *argv[])
 
 		GptPartitionMap gpt;
 		if (gpt.LoadAndVerify(*device)) {
-			printf("Found partitions:\n");
-			gpt.ListEntries();
+			if (list) {
+				printf("Found partitions:\n");
+				gpt.ListEntries();
+			}
 
 			int partnum = gpt.FindFirstAPFSPartition();
 			if (partnum > 0) {
-				printf("First APFS partition is %d\n", partnum);
+				if (list)
+					printf("First APFS partition is %d\n", partnum);
 				gpt.GetPartitionOffsetAndSize(partnum, offset, size);
 			}
-			printf("\n");
+			if (list)
+				printf("\n");
 		}
 
 		container = new ApfsContainer(device, offset, size);
 
-		if (container->Init()) {
+		if (!container->Init()) {
+			printf("Unable to open APFS container\n");
+			err = EIO;
+		} else if (!list) {
+			err = print_extents(*container, atoi(argv[3]), argv[4]);
+		} else {
 			// printf("Listing volumes:\n");
 			volcnt = container->GetVolumeCnt();
 			for (int k = 0; k < volcnt; k++) {
@@ -139,8 +222,6 @@ int main(int argc, char *argv[])
 				}
 				printf("\n");
 			}
-		} else {
-			printf("Unable to open APFS container\n");
 		}
 
 		delete container;
@@ -153,5 +234,5 @@ int main(int argc, char *argv[])
 	}
 
 
-	return 0;
+	return err;
 }
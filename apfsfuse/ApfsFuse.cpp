@@ -40,6 +40,7 @@
 
 #include <getopt.h>
 
+#include <signal.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 
@@ -47,20 +48,39 @@
 #include <ApfsLib/ApfsVolume.h>
 #include <ApfsLib/ApfsDir.h>
 #include <ApfsLib/Decmpfs.h>
+#include <ApfsLib/DentryCache.h>
 #include <ApfsLib/DeviceLinux.h>
 #include <ApfsLib/DeviceMac.h>
 #include <ApfsLib/GptPartitionMap.h>
+#include <ApfsLib/HotList.h>
+#include <ApfsLib/MetaIndex.h>
 
 #include <cassert>
 #include <cstring>
 #include <cstddef>
 
+#include <algorithm>
+#include <atomic>
 #include <iostream>
+#include <future>
+#include <thread>
 
 static_assert(sizeof(fuse_ino_t) == 8, "Sorry, on 32-bit systems, you need to use FUSE-3.");
 
 constexpr double FUSE_TIMEOUT = 86400.0;
 
+// Readahead of sequentially read files. The window starts small and doubles
+// every time prefetched data is used, up to the maximum (readahead=N option).
+constexpr size_t READAHEAD_MIN = 128 * 1024;
+constexpr size_t READAHEAD_MAX = 4 * 1024 * 1024;
+// Default budget of the decompressed contents cache (decmpfs_cache=N option).
+constexpr size_t DECMPFS_CACHE_SIZE = 64 * 1024 * 1024;
+// Default number of cached name lookups (dentry_cache=N option), and memory for directory filters.
+constexpr size_t DENTRY_CACHE_ENTRIES = 256 * 1024;
+constexpr size_t DENTRY_FILTER_BYTES = 16 * 1024 * 1024;
+// Tree levels loaded by prewarm=levels without a count.
+constexpr unsigned int PREWARM_LEVELS = 2;
+
 static struct fuse_lowlevel_ops ops;
 static Device *g_disk_main = nullptr;
 static Device *g_disk_tier2 = nullptr;
@@ -75,6 +95,21 @@ static bool g_set_gid = false;
 static int g_physblksize = 512;
 static std::string g_password;
 static xid_t g_snap_xid = 0;
+static size_t g_readahead_max = READAHEAD_MAX;
+static DecmpfsCache g_decmpfs_cache(DECMPFS_CACHE_SIZE);
+static DentryCache g_dentry_cache(DENTRY_CACHE_ENTRIES, DENTRY_FILTER_BYTES);
+static std::string g_index_path;
+static MetaIndex g_index;
+static bool g_pin = false;
+static std::string g_prewarm;
+static unsigned int g_prewarm_levels = 0;
+static std::vector<HotListEntry> g_prewarm_list;
+static std::vector<std::thread> g_prewarm_threads;
+static std::atomic<bool> g_prewarm_stop(false);
+static std::string g_hotlist_path;
+static HotListRecorder g_hotlist;
+static std::thread g_hotlist_thread;
+static int g_hotlist_pipe[2] = { -1, -1 };
 
 struct Directory
 {
@@ -86,19 +121,86 @@ struct Directory
 
 struct File
 {
-	File() {}
-	~File() {}
+	File() : ra_next_off(0), ra_window(0), ra_buf_off(0), ra_pending_off(0) {}
+	~File() { if (ra_pending.valid()) ra_pending.wait(); }
 
 	bool IsCompressed() const { return (ino.bsd_flags & APFS_UF_COMPRESSED) != 0; }
 
-	ApfsDir::Inode ino;
-	std::vector<uint8_t> decomp_data;
+	ApfsDir::InodeStat ino;
+	DecmpfsCache::Data decomp_data;
+
+	// Readahead state, only used for uncompressed files.
+	uint64_t ra_next_off;              // Where the next read starts if the file is read sequentially
+	size_t ra_window;                  // Current readahead size, 0 while reads aren't sequential
+	uint64_t ra_buf_off;
+	std::vector<uint8_t> ra_buf;       // Prefetched data at ra_buf_off
+	uint64_t ra_pending_off;
+	std::vector<uint8_t> ra_pending_buf;
+	std::future<bool> ra_pending;      // Prefetch in flight into ra_pending_buf
 };
 
+static void set_stat_times(struct stat &st, uint64_t create_time, uint64_t mod_time, uint64_t change_time, uint64_t access_time)
+{
+	constexpr uint64_t div_nsec = 1000000000;
+
+#ifdef __linux__
+	// What about this?
+	// st.st_birthtime.tv_sec = create_time / div_nsec;
+	// st.st_birthtime.tv_nsec = create_time % div_nsec;
+	(void)create_time;
+
+	st.st_mtim.tv_sec = mod_time / div_nsec;
+	st.st_mtim.tv_nsec = mod_time % div_nsec;
+	st.st_ctim.tv_sec = change_time / div_nsec;
+	st.st_ctim.tv_nsec = change_time % div_nsec;
+	st.st_atim.tv_sec = access_time / div_nsec;
+	st.st_atim.tv_nsec = access_time % div_nsec;
+#endif
+#ifdef __APPLE__
+	st.st_birthtimespec.tv_sec = create_time / div_nsec;
+	st.st_birthtimespec.tv_nsec = create_time % div_nsec;
+	st.st_mtimespec.tv_sec = mod_time / div_nsec;
+	st.st_mtimespec.tv_nsec = mod_time % div_nsec;
+	st.st_ctimespec.tv_sec = change_time / div_nsec;
+	st.st_ctimespec.tv_nsec = change_time % div_nsec;
+	st.st_atimespec.tv_sec = access_time / div_nsec;
+	st.st_atimespec.tv_nsec = access_time % div_nsec;
+
+	// st.st_gen = rec.ino.gen_count;
+#endif
+}
+
+// Attributes from the sidecar index, false if the fs tree has to be asked.
+static bool apfs_stat_index(fuse_ino_t ino, struct stat &st)
+{
+	const MetaIndexInode *mi = g_index.GetInode(ino);
+
+	if (!mi || !(mi->flags & META_INO_SIZE_KNOWN))
+		return false;
+
+	st.st_ino = ino;
+	st.st_mode = mi->mode;
+	st.st_nlink = 1;
+	st.st_uid = g_set_uid ? g_uid : mi->owner;
+	st.st_gid = g_set_gid ? g_gid : mi->group;
+
+	if (mi->flags & META_INO_HAS_RDEV)
+		st.st_rdev = mi->rdev;
+
+	if (S_ISREG(st.st_mode))
+		st.st_size = mi->size;
+	else if (S_ISDIR(st.st_mode))
+		st.st_size = mi->nlink;
+
+	set_stat_times(st, mi->create_time, mi->mod_time, mi->change_time, mi->access_time);
+	return true;
+}
+
 static bool apfs_stat_internal(fuse_ino_t ino, struct stat &st)
 {
 	ApfsDir dir(*g_volume);
-	ApfsDir::Inode rec;
+	ApfsDir::StatGroup grp;
+	const ApfsDir::InodeStat &rec = grp.inode;
 	bool rc = false;
 
 	memset(&st, 0, sizeof(st));
@@ -111,7 +213,11 @@ static bool apfs_stat_internal(fuse_ino_t ino, struct stat &st)
 		return true;
 	}
 
-	rc = dir.GetInode(rec, ino);
+	if (g_index.IsOpen() && apfs_stat_index(ino, st))
+		return true;
+
+	// Inode and, for compressed files, the xattr headers in one pass.
+	rc = dir.GetStatGroup(grp, ino);
 
 	if (!rc)
 	{
@@ -119,8 +225,6 @@ static bool apfs_stat_internal(fuse_ino_t ino, struct stat &st)
 	}
 	else
 	{
-		constexpr uint64_t div_nsec = 1000000000;
-
 		// st_dev?
 		st.st_ino = ino;
 		st.st_mode = rec.mode;
@@ -141,11 +245,16 @@ static bool apfs_stat_internal(fuse_ino_t ino, struct stat &st)
 		{
 			if (rec.bsd_flags & APFS_UF_COMPRESSED) // Compressed
 			{
-				std::vector<uint8_t> data;
-				rc = dir.GetAttribute(data, ino, "com.apple.decmpfs");
+				const ApfsDir::XAttrRec *xa = grp.FindAttribute("com.apple.decmpfs");
+				CompressionHeader hdr;
+				size_t read = 0;
+
+				// Only the header is needed for the size.
+				rc = xa && dir.ReadAttribute(&hdr, read, *xa, 0, sizeof(hdr)) && read == sizeof(hdr);
+
 				if (rc)
 				{
-					const CompressionHeader *decmpfs = reinterpret_cast<const CompressionHeader *>(data.data());
+					const CompressionHeader *decmpfs = &hdr;
 
 					if (IsDecompAlgoSupported(decmpfs->algo))
 					{
@@ -156,17 +265,17 @@ static bool apfs_stat_internal(fuse_ino_t ino, struct stat &st)
 					}
 					else if (IsDecompAlgoInRsrc(decmpfs->algo))
 					{
-						rc = dir.GetAttribute(data, ino, "com.apple.ResourceFork");
+						const ApfsDir::XAttrRec *rsrc = grp.FindAttribute("com.apple.ResourceFork");
 
-						if (!rc)
-							st.st_size = 0;
+						// Compressed size, no need to read the fork itself
+						if (rsrc)
+							st.st_size = rsrc->attr.size();
 						else
-							// Compressed size
-							st.st_size = data.size();
+							st.st_size = 0;
 					}
 					else
 					{
-						st.st_size = data.size();
+						st.st_size = xa->attr.size();
 						std::cerr << "Unknown compression algorithm " << decmpfs->algo << std::endl;
 						if (!g_lax)
 							return false;
@@ -197,30 +306,7 @@ static bool apfs_stat_internal(fuse_ino_t ino, struct stat &st)
 			st.st_size = rec.nchildren_nlink;
 		}
 
-#ifdef __linux__
-		// What about this?
-		// st.st_birthtime.tv_sec = rec.ino->create_time / div_nsec;
-		// st.st_birthtime.tv_nsec = rec.ino->create_time % div_nsec;
-
-		st.st_mtim.tv_sec = rec.mod_time / div_nsec;
-		st.st_mtim.tv_nsec = rec.mod_time % div_nsec;
-		st.st_ctim.tv_sec = rec.change_time / div_nsec;
-		st.st_ctim.tv_nsec = rec.change_time % div_nsec;
-		st.st_atim.tv_sec = rec.access_time / div_nsec;
-		st.st_atim.tv_nsec = rec.access_time % div_nsec;
-#endif
-#ifdef __APPLE__
-		st.st_birthtimespec.tv_sec = rec.create_time / div_nsec;
-		st.st_birthtimespec.tv_nsec = rec.create_time % div_nsec;
-		st.st_mtimespec.tv_sec = rec.mod_time / div_nsec;
-		st.st_mtimespec.tv_nsec = rec.mod_time % div_nsec;
-		st.st_ctimespec.tv_sec = rec.change_time / div_nsec;
-		st.st_ctimespec.tv_nsec = rec.change_time % div_nsec;
-		st.st_atimespec.tv_sec = rec.access_time / div_nsec;
-		st.st_atimespec.tv_nsec = rec.access_time % div_nsec;
-
-		// st.st_gen = rec.ino.gen_count;
-#endif
+		set_stat_times(st, rec.create_time, rec.mod_time, rec.change_time, rec.access_time);
 		return true;
 	}
 }
@@ -248,8 +334,6 @@ static void apfs_getattr(fuse_req_t req, fuse_ino_t ino, fuse_file_info *fi)
 {
 	(void)fi;
 
-	ApfsDir dir(*g_volume);
-	ApfsDir::Inode rec;
 	bool rc = false;
 	struct stat st;
 
@@ -271,25 +355,32 @@ static void apfs_getattr(fuse_req_t req, fuse_ino_t ino, fuse_file_info *fi)
 static void apfs_getxattr_mac(fuse_req_t req, fuse_ino_t ino, const char *name, size_t size, uint32_t position)
 {
 	ApfsDir dir(*g_volume);
+	ApfsDir::XAttrRec xattr;
 	bool rc = false;
 	std::vector<uint8_t> data;
+	size_t read = 0;
 
 	if (g_debug & Dbg_Info)
 		std::cout << "apfs_getxattr: " << std::hex << ino << " " << name << " => ";
 
-	rc = dir.GetAttribute(data, ino, name);
+	// The contents are only read if requested, and only the requested range.
+	rc = dir.GetAttributeInfo(xattr, ino, name);
 
 	if (g_debug & Dbg_Info)
 		std::cout << (rc ? "OK" : "FAIL") << std::endl;
 
 	if (!rc)
 		fuse_reply_err(req, ENODATA);
+	else if (size == 0)
+		fuse_reply_xattr(req, xattr.attr.size()); // xattr size
 	else
 	{
-		if (size == 0)
-			fuse_reply_xattr(req, data.size()); // xattr size
+		data.resize(size);
+
+		if (!dir.ReadAttribute(data.data(), read, xattr, position, size))
+			fuse_reply_err(req, EIO);
 		else
-			fuse_reply_buf(req, reinterpret_cast<const char *>(data.data() + position), std::min(data.size(), size));
+			fuse_reply_buf(req, reinterpret_cast<const char *>(data.data()), read);
 	}
 }
 #endif
@@ -297,51 +388,60 @@ static void apfs_getxattr_mac(fuse_req_t req, fuse_ino_t ino, const char *name,
 static void apfs_getxattr(fuse_req_t req, fuse_ino_t ino, const char *name, size_t size)
 {
 	ApfsDir dir(*g_volume);
+	ApfsDir::XAttrRec xattr;
 	bool rc = false;
 	std::vector<uint8_t> data;
+	size_t read = 0;
 
 	if (g_debug & Dbg_Info)
 		std::cout << "apfs_getxattr: " << std::hex << ino << " " << name << " => ";
 
-	rc = dir.GetAttribute(data, ino, name);
+	// The contents are only read if requested.
+	rc = dir.GetAttributeInfo(xattr, ino, name);
 
 	if (g_debug & Dbg_Info)
 		std::cout << (rc ? "OK" : "FAIL") << std::endl;
 
 	if (!rc)
 		fuse_reply_err(req, ENODATA);
+	else if (size == 0)
+		fuse_reply_xattr(req, xattr.attr.size()); // xattr size
+	else if (size < xattr.attr.size())
+		fuse_reply_err(req, ERANGE);
 	else
 	{
-		if (size == 0)
-			fuse_reply_xattr(req, data.size()); // xattr size
+		data.resize(xattr.attr.size());
+
+		if (!dir.ReadAttribute(data.data(), read, xattr, 0, data.size()))
+			fuse_reply_err(req, EIO);
 		else
-			fuse_reply_buf(req, reinterpret_cast<const char *>(data.data()), std::min(data.size(), size));
+			fuse_reply_buf(req, reinterpret_cast<const char *>(data.data()), read);
 	}
 }
 #endif
 
+static bool listxattr_add(std::string_view name, void *context)
+{
+	std::string &reply = *reinterpret_cast<std::string *>(context);
+
+	if (g_debug & Dbg_Info)
+		std::cout << name << std::endl;
+	reply.append(name);
+	reply.push_back(0);
+	return true;
+}
+
 static void apfs_listxattr(fuse_req_t req, fuse_ino_t ino, size_t size)
 {
 	ApfsDir dir(*g_volume);
-	bool rc = false;
-	std::vector<std::string> names;
 	std::string reply;
 
-	rc = dir.ListAttributes(names, ino);
-
 	if (g_debug & Dbg_Info)
 		std::cout << "apfs_listxattr:" << std::endl;
 
-	if (rc)
-	{
-		for (size_t k = 0; k < names.size(); k++)
-		{
-			if (g_debug & Dbg_Info)
-				std::cout << names[k] << std::endl;
-			reply.append(names[k]);
-			reply.push_back(0);
-		}
-	}
+	// The names go straight from the fs tree nodes into the reply.
+	if (!dir.VisitAttributes(ino, listxattr_add, &reply))
+		reply.clear();
 
 	if (size == 0)
 		fuse_reply_xattr(req, reply.size());
@@ -358,26 +458,61 @@ static void apfs_lookup(fuse_req_t req, fuse_ino_t ino, const char *name)
 
 	ApfsDir dir(*g_volume);
 	ApfsDir::DirRec res;
+	fuse_entry_param e;
+	uint64_t file_id = 0;
+	bool not_found = false;
 	bool rc;
 
-	rc = dir.LookupName(res, ino, name);
+	if (g_dentry_cache.Get(file_id, ino, name))
+	{
+		rc = file_id != 0;
+	}
+	else if (!g_dentry_cache.MayContain(ino, name, g_volume->getTextFormat()))
+	{
+		rc = false;
+		g_dentry_cache.Put(ino, name, 0);
+	}
+	else
+	{
+		// Names missing in the index may still match in a case or normalization insensitive way.
+		rc = g_index.IsOpen() && g_index.LookupName(file_id, ino, name);
+		if (!rc)
+		{
+			rc = dir.LookupName(res, ino, name, &not_found);
+			file_id = rc ? res.file_id : 0;
+		}
+
+		// Only a search that got to the end may be remembered as a miss.
+		if (!rc && !not_found)
+		{
+			if (g_debug & Dbg_Info)
+				std::cout << "ERROR" << std::endl;
+
+			fuse_reply_err(req, EIO);
+			return;
+		}
+
+		g_dentry_cache.Put(ino, name, file_id);
+	}
 
 	if (g_debug & Dbg_Info)
 		std::cout << (rc ? "OK" : "FAIL") << std::endl;
 
+	memset(&e, 0, sizeof(e));
+	e.attr_timeout = FUSE_TIMEOUT;
+	e.entry_timeout = FUSE_TIMEOUT;
+
 	if (!rc)
 	{
-		fuse_reply_err(req, ENOENT);
+		// A negative entry, so the kernel doesn't ask again. The volume never changes.
+		e.ino = 0;
+		fuse_reply_entry(req, &e);
 	}
 	else
 	{
-		fuse_entry_param e;
-
-		e.ino = res.file_id;
-		e.attr_timeout = FUSE_TIMEOUT;
-		e.entry_timeout = FUSE_TIMEOUT;
+		e.ino = file_id;
 
-		rc = apfs_stat_internal(res.file_id, e.attr);
+		rc = apfs_stat_internal(file_id, e.attr);
 
 		if (g_debug & Dbg_Info)
 			std::cout << "    apfs_stat_internal => " << (rc ? "OK" : "FAIL") << std::endl;
@@ -399,8 +534,9 @@ static void apfs_open(fuse_req_t req, fuse_ino_t ino, fuse_file_info *fi)
 	{
 		File *f = new File();
 		ApfsDir dir(*g_volume);
+		ApfsDir::StatGroup grp;
 
-		rc = dir.GetInode(f->ino, ino);
+		rc = dir.GetStatGroup(grp, ino);
 
 		if (!rc)
 		{
@@ -410,11 +546,18 @@ static void apfs_open(fuse_req_t req, fuse_ino_t ino, fuse_file_info *fi)
 			return;
 		}
 
+		f->ino = grp.inode;
+
 		if (f->IsCompressed())
+			f->decomp_data = g_decmpfs_cache.Get(ino, g_volume->getXid());
+
+		if (f->IsCompressed() && !f->decomp_data)
 		{
+			const ApfsDir::XAttrRec *xa = grp.FindAttribute("com.apple.decmpfs");
 			std::vector<uint8_t> attr;
+			std::shared_ptr<std::vector<uint8_t>> data = std::make_shared<std::vector<uint8_t>>();
 
-			rc = dir.GetAttribute(attr, ino, "com.apple.decmpfs");
+			rc = xa && dir.GetAttribute(attr, *xa);
 
 			if (!rc)
 			{
@@ -428,7 +571,7 @@ static void apfs_open(fuse_req_t req, fuse_ino_t ino, fuse_file_info *fi)
 			{
 				// std::cout << "Inode info: size=" << f->ino.sizes.size << ", alloced_size=" << f->ino.sizes.alloced_size << std::endl;
 			}
-			rc = DecompressFile(dir, ino, f->decomp_data, attr);
+			rc = DecompressFile(dir, grp.FindAttribute("com.apple.ResourceFork"), *data, attr);
 			// In strict mode, do not return uncompressed data.
 			if (!rc && !g_lax)
 			{
@@ -436,6 +579,12 @@ static void apfs_open(fuse_req_t req, fuse_ino_t ino, fuse_file_info *fi)
 				delete f;
 				return;
 			}
+
+			// Data of a failed decompression is not shared with later opens.
+			if (rc)
+				g_decmpfs_cache.Put(ino, g_volume->getXid(), data);
+
+			f->decomp_data = data;
 		}
 
 		fi->fh = reinterpret_cast<uint64_t>(f);
@@ -456,9 +605,108 @@ static void apfs_opendir(fuse_req_t req, fuse_ino_t ino, fuse_file_info *fi)
 	fuse_reply_open(req, fi);
 }
 
-static void apfs_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi)
+static void readahead_collect(File *file)
+{
+	if (!file->ra_pending.valid())
+		return;
+
+	if (file->ra_pending.get())
+	{
+		file->ra_buf.swap(file->ra_pending_buf);
+		file->ra_buf_off = file->ra_pending_off;
+	}
+	else
+	{
+		file->ra_buf.clear();
+	}
+}
+
+static void readahead_start(File *file, uint64_t off)
+{
+	const uint64_t obj_id = file->ino.private_id;
+	const uint64_t file_size = file->ino.ds_size;
+	size_t size = file->ra_window;
+	uint8_t *data;
+
+	if (off >= file_size)
+		return;
+
+	if (off + size > file_size)
+		size = file_size - off;
+
+	if (g_debug & Dbg_Info)
+		std::cout << std::hex << "readahead: ino=" << file->ino.obj_id << " off=" << off << " size=" << size << std::endl;
+
+	// ReadFile leaves the tail alone if the extents end early, so don't serve old data from there.
+	file->ra_pending_off = off;
+	file->ra_pending_buf.assign(size, 0);
+	data = file->ra_pending_buf.data();
+
+	// Device reads are thread safe, so this can run next to the request loop.
+	file->ra_pending = std::async(std::launch::async, [obj_id, data, off, size]() {
+		ApfsDir dir(*g_volume);
+		return dir.ReadFile(data, obj_id, off, size);
+	});
+}
+
+static void read_file(File *file, char *data, uint64_t off, size_t size)
 {
 	ApfsDir dir(*g_volume);
+	const uint64_t end = off + size;
+	bool hit = false;
+
+	if (g_readahead_max == 0)
+	{
+		dir.ReadFile(data, file->ino.private_id, off, size);
+		return;
+	}
+
+	if (off == file->ra_next_off)
+	{
+		if (file->ra_window == 0)
+			file->ra_window = std::min(READAHEAD_MIN, g_readahead_max);
+	}
+	else
+	{
+		// Drop a prefetch for the old position, or it blocks readahead once reads get sequential again.
+		file->ra_window = 0;
+		if (file->ra_pending.valid())
+		{
+			file->ra_pending.wait();
+			file->ra_pending = std::future<bool>();
+		}
+	}
+	file->ra_next_off = end;
+
+	if (file->ra_pending.valid() && off >= file->ra_pending_off && off < file->ra_pending_off + file->ra_pending_buf.size())
+		readahead_collect(file);
+
+	if (off >= file->ra_buf_off && end <= file->ra_buf_off + file->ra_buf.size())
+	{
+		memcpy(data, file->ra_buf.data() + (off - file->ra_buf_off), size);
+		hit = true;
+	}
+	else
+	{
+		dir.ReadFile(data, file->ino.private_id, off, size);
+	}
+
+	// Fetch the next window once less than half of the current one is left.
+	if (file->ra_window > 0 && !file->ra_pending.valid())
+	{
+		uint64_t next = hit ? file->ra_buf_off + file->ra_buf.size() : end;
+
+		if (next - end <= file->ra_window / 2)
+		{
+			if (hit)
+				file->ra_window = std::min(file->ra_window * 2, g_readahead_max);
+			readahead_start(file, next);
+		}
+	}
+}
+
+static void apfs_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi)
+{
 	File *file = reinterpret_cast<File *>(fi->fh);
 
 	if (g_debug & Dbg_Info)
@@ -466,11 +714,9 @@ static void apfs_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, st
 
 	if (!file->IsCompressed())
 	{
-		// bool rc;
 		std::vector<char> buf(size, 0);
 
-		// rc =
-		dir.ReadFile(buf.data(), file->ino.private_id, off, size);
+		read_file(file, buf.data(), off, size);
 
 		// std::cerr << "apfs_read: fuse_reply_buf(req, " << reinterpret_cast<uint64_t>(buf.data()) << ", " << size << ")" << std::endl;
 
@@ -478,16 +724,65 @@ static void apfs_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, st
 	}
 	else
 	{
-		if (static_cast<size_t>(off) >= file->decomp_data.size())
+		const std::vector<uint8_t> &decomp_data = *file->decomp_data;
+
+		if (static_cast<size_t>(off) >= decomp_data.size())
 			size = 0;
-		else if (off + size > file->decomp_data.size())
-			size = file->decomp_data.size() - off;
+		else if (off + size > decomp_data.size())
+			size = decomp_data.size() - off;
+
+		// std::cerr << "apfs_read: fuse_reply_buf(req, " << reinterpret_cast<uint64_t>(decomp_data.data()) + off << ", " << size << ")" << std::endl;
+
+		fuse_reply_buf(req, reinterpret_cast<const char *>(decomp_data.data()) + off, size);
+	}
+}
+
+#if FUSE_VERSION >= FUSE_MAKE_VERSION(3, 8)
+static void apfs_lseek(fuse_req_t req, fuse_ino_t ino, off_t off, int whence, struct fuse_file_info *fi)
+{
+	File *file = reinterpret_cast<File *>(fi->fh);
+	uint64_t size;
+	uint64_t res;
+
+	if (g_debug & Dbg_Info)
+		std::cout << std::hex << "apfs_lseek: ino=" << ino << " off=" << off << " whence=" << whence << std::endl;
+
+	if (whence != SEEK_DATA && whence != SEEK_HOLE)
+	{
+		fuse_reply_err(req, EINVAL);
+		return;
+	}
 
-		// std::cerr << "apfs_read: fuse_reply_buf(req, " << reinterpret_cast<uint64_t>(file->decomp_data.data()) + off << ", " << size << ")" << std::endl;
+	size = file->IsCompressed() ? file->decomp_data->size() : file->ino.ds_size;
 
-		fuse_reply_buf(req, reinterpret_cast<const char *>(file->decomp_data.data()) + off, size);
+	if (off < 0 || static_cast<uint64_t>(off) >= size)
+	{
+		fuse_reply_err(req, ENXIO);
+		return;
 	}
+
+	if (file->IsCompressed())
+	{
+		// Decompressed contents have no holes.
+		res = (whence == SEEK_DATA) ? off : size;
+	}
+	else
+	{
+		ApfsDir dir(*g_volume);
+
+		if (!dir.SeekHoleData(res, file->ino.private_id, off, size, whence == SEEK_DATA))
+		{
+			fuse_reply_err(req, EIO);
+			return;
+		}
+	}
+
+	if (whence == SEEK_DATA && res >= size)
+		fuse_reply_err(req, ENXIO);
+	else
+		fuse_reply_lseek(req, res);
 }
+#endif
 
 static void dirbuf_add(fuse_req_t req, std::vector<char> &dirbuf, const char *name, fuse_ino_t ino, mode_t mode)
 {
@@ -513,10 +808,33 @@ static int reply_buf_limited(fuse_req_t req, const char *buf, size_t bufsize, of
 }
 
 
+struct ReaddirContext
+{
+	fuse_req_t req;
+	std::vector<char> *dirbuf;
+	std::vector<uint32_t> name_hashes;
+	uint32_t txt_fmt;
+};
+
+static bool readdir_add(const ApfsDir::DirEntryView &e, void *context)
+{
+	ReaddirContext &ctx = *reinterpret_cast<ReaddirContext *>(context);
+	char name[J_DREC_LEN_MASK + 1];
+	size_t len = min(e.name.size(), sizeof(name) - 1);
+
+	// fuse_add_direntry wants a C string, the name in the node isn't necessarily terminated.
+	memcpy(name, e.name.data(), len);
+	name[len] = 0;
+
+	dirbuf_add(ctx.req, *ctx.dirbuf, name, e.file_id, (e.flags & DREC_TYPE_MASK) << 12);
+	ctx.name_hashes.push_back(DentryCache::DirEntryHash(e, ctx.txt_fmt));
+	return true;
+}
+
 static void apfs_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi)
 {
 	ApfsDir dir(*g_volume);
-	std::vector<ApfsDir::DirRec> dir_list;
+	ReaddirContext ctx;
 	Directory *dirptr = reinterpret_cast<Directory *>(fi->fh);
 	std::vector<char> &dirbuf = dirptr->dirbuf;
 	bool rc;
@@ -545,15 +863,25 @@ static void apfs_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
 			dirbuf_add(req, dirbuf, "..", dirrec.ino.parent_id);
 		}
 #endif
-		rc = dir.ListDirectory(dir_list, ino);
+		ctx.req = req;
+		ctx.dirbuf = &dirbuf;
+		ctx.txt_fmt = g_volume->getTextFormat();
+
+		rc = dir.VisitDirectory(ino, readdir_add, &ctx);
 		if (!rc)
 		{
+			dirbuf.clear();
 			fuse_reply_err(req, ENOENT);
 			return;
 		}
 
-		for (size_t k = 0; k < dir_list.size(); k++)
-			dirbuf_add(req, dirbuf, dir_list[k].name.c_str(), dir_list[k].file_id, (dir_list[k].flags & DREC_TYPE_MASK) << 12);
+		// A listing cut short by a read error would make the filter reject existing names.
+		{
+			ApfsDir::InodeStat dirrec;
+
+			if (dir.GetInodeStat(dirrec, ino) && dirrec.nchildren_nlink == ctx.name_hashes.size())
+				g_dentry_cache.SetDirNames(ino, ctx.name_hashes);
+		}
 	}
 
 	reply_buf_limited(req, dirbuf.data(), dirbuf.size(), off, size);
@@ -651,6 +979,20 @@ void usage(const char *name)
 	std::cout << "pass=...      : Specify volume passphrase (same as -r)." << std::endl;
 	std::cout << "xid=N         : Mount specific xid." << std::endl;
 	std::cout << "snap=N        : Mount snapshot with given id. Use apfsutil for getting the ids." << std::endl;
+	std::cout << "readahead=N   : Maximum readahead for sequentially read files in KiB." << std::endl;
+	std::cout << "                Default is 4096, 0 disables readahead." << std::endl;
+	std::cout << "decmpfs_cache=N : Memory for decompressed contents of compressed files, shared" << std::endl;
+	std::cout << "                by all opens of a file, in MiB. Default is 64, 0 disables it." << std::endl;
+	std::cout << "dentry_cache=N : Number of cached name lookups, failed ones included. Default" << std::endl;
+	std::cout << "                is 262144, 0 disables it." << std::endl;
+	std::cout << "pin           : Keep all metadata of the volume in memory, loaded at mount time." << std::endl;
+	std::cout << "prewarm=...   : Load metadata into the caches in the background after mounting." << std::endl;
+	std::cout << "                levels[:N] loads the top N (default 2) levels of the trees, full" << std::endl;
+	std::cout << "                as much as fits into the cache, hotlist:file the nodes in file." << std::endl;
+	std::cout << "hotlist=path  : Record the metadata nodes read while mounted into a hot list for" << std::endl;
+	std::cout << "                prewarm=hotlist:path. Written at unmount and on SIGUSR2." << std::endl;
+	std::cout << "index=path    : Answer lookups and attributes from a metadata index file. It" << std::endl;
+	std::cout << "                is rebuilt if missing or written for another transaction." << std::endl;
 	std::cout << std::endl;
 }
 
@@ -701,10 +1043,182 @@ static int apfs_parse_fuse_opt(void *data, const char *arg, int key, struct fuse
 			g_snap_xid = strtoull(strchr(arg, '=') + sizeof(char), nullptr, 10);
 			return 0;
 		}
+		else if (!strncmp(arg, "readahead=", 10)) {
+			g_readahead_max = strtoull(strchr(arg, '=') + sizeof(char), nullptr, 10) * 1024;
+			return 0;
+		}
+		else if (!strncmp(arg, "decmpfs_cache=", 14)) {
+			g_decmpfs_cache.SetMaxBytes(strtoull(strchr(arg, '=') + sizeof(char), nullptr, 10) * 1024 * 1024);
+			return 0;
+		}
+		else if (!strncmp(arg, "dentry_cache=", 13)) {
+			g_dentry_cache.SetMaxEntries(strtoull(strchr(arg, '=') + sizeof(char), nullptr, 10));
+			return 0;
+		}
+		else if (!strcmp(arg, "pin")) {
+			g_pin = true;
+			return 0;
+		}
+		else if (!strncmp(arg, "prewarm=", 8)) {
+			g_prewarm = strchr(arg, '=') + sizeof(char);
+			return 0;
+		}
+		else if (!strncmp(arg, "hotlist=", 8)) {
+			g_hotlist_path = strchr(arg, '=') + sizeof(char);
+			return 0;
+		}
+		else if (!strncmp(arg, "index=", 6)) {
+			g_index_path = strchr(arg, '=') + sizeof(char);
+			return 0;
+		}
 	}
 	return 1;
 }
 
+static bool prewarm_parse()
+{
+	if (g_prewarm == "full")
+	{
+		g_prewarm_levels = 0;
+	}
+	else if (g_prewarm == "levels")
+	{
+		g_prewarm_levels = PREWARM_LEVELS;
+	}
+	else if (!g_prewarm.compare(0, 7, "levels:"))
+	{
+		g_prewarm_levels = strtoul(g_prewarm.c_str() + 7, nullptr, 10);
+		if (g_prewarm_levels == 0)
+			return false;
+	}
+	else if (!g_prewarm.compare(0, 8, "hotlist:"))
+	{
+		return HotList::Load(g_prewarm_list, *g_volume, g_prewarm.c_str() + 8);
+	}
+	else
+	{
+		return false;
+	}
+
+	return true;
+}
+
+static void prewarm_tree(BTree *tree)
+{
+	std::vector<oid_t> oids;
+	size_t cnt;
+
+	if (!g_prewarm_list.empty())
+	{
+		HotList::GetOids(oids, g_prewarm_list, tree->GetSubtype());
+		cnt = tree->Prefetch(oids, &g_prewarm_stop);
+	}
+	else
+	{
+		cnt = tree->Prewarm(g_prewarm_levels, &g_prewarm_stop);
+	}
+
+	if (g_debug & Dbg_Info)
+		std::cout << "Prewarm: " << std::dec << cnt << " nodes of tree type " << tree->GetSubtype() << " loaded." << std::endl;
+}
+
+// Runs while the file system is already serving requests, so it has to start after daemonizing.
+static void prewarm_start()
+{
+	if (g_prewarm.empty())
+		return;
+
+	// A thread per tree. Nodes of the fs tree are mapped through the omap, so both warm its cache.
+	g_prewarm_threads.emplace_back(prewarm_tree, &g_volume->omap().tree());
+	g_prewarm_threads.emplace_back(prewarm_tree, &g_volume->fstree());
+	if (g_volume->isSealed())
+		g_prewarm_threads.emplace_back(prewarm_tree, &g_volume->fexttree());
+}
+
+static void prewarm_stop()
+{
+	g_prewarm_stop = true;
+
+	for (std::thread &t : g_prewarm_threads)
+		t.join();
+	g_prewarm_threads.clear();
+}
+
+static void hotlist_save()
+{
+	if (!g_hotlist.Save(*g_volume, g_hotlist_path.c_str()))
+		std::cerr << "Unable to save hot list " << g_hotlist_path << std::endl;
+}
+
+static void hotlist_signal(int sig)
+{
+	char c = 's';
+	ssize_t rc;
+
+	(void)sig;
+	// Only the pipe write is safe in a signal handler, the thread does the rest.
+	rc = write(g_hotlist_pipe[1], &c, 1);
+	(void)rc;
+}
+
+static void hotlist_thread()
+{
+	char c;
+
+	while (read(g_hotlist_pipe[0], &c, 1) == 1 && c == 's')
+		hotlist_save();
+}
+
+// Attached before prewarming, so the nodes it loads are part of the next hot list.
+static void hotlist_start()
+{
+	struct sigaction sa;
+
+	if (g_hotlist_path.empty())
+		return;
+
+	g_volume->omap().tree().SetRecorder(&g_hotlist);
+	g_volume->fstree().SetRecorder(&g_hotlist);
+	if (g_volume->isSealed())
+		g_volume->fexttree().SetRecorder(&g_hotlist);
+
+	if (pipe(g_hotlist_pipe) != 0)
+		return;
+
+	g_hotlist_thread = std::thread(hotlist_thread);
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = hotlist_signal;
+	sigemptyset(&sa.sa_mask);
+	sa.sa_flags = SA_RESTART;
+	sigaction(SIGUSR2, &sa, nullptr);
+}
+
+static void hotlist_stop()
+{
+	char c = 'q';
+
+	if (g_hotlist_path.empty())
+		return;
+
+	if (g_hotlist_thread.joinable())
+	{
+		signal(SIGUSR2, SIG_DFL);
+		if (write(g_hotlist_pipe[1], &c, 1) == 1)
+			g_hotlist_thread.join();
+		else
+			g_hotlist_thread.detach();
+		close(g_hotlist_pipe[0]);
+		close(g_hotlist_pipe[1]);
+	}
+
+	g_volume->omap().tree().SetRecorder(nullptr);
+	g_volume->fstree().SetRecorder(nullptr);
+	g_volume->fexttree().SetRecorder(nullptr);
+
+	hotlist_save();
+}
+
 int main(int argc, char *argv[])
 {
 	struct fuse_args args = FUSE_ARGS_INIT(0, nullptr);
@@ -738,6 +1252,9 @@ int main(int argc, char *argv[])
 #endif
 	ops.listxattr = apfs_listxattr;
 	ops.lookup = apfs_lookup;
+#if FUSE_VERSION >= FUSE_MAKE_VERSION(3, 8)
+	ops.lseek = apfs_lseek;
+#endif
 	ops.open = apfs_open;
 	ops.opendir = apfs_opendir;
 	ops.read = apfs_read;
@@ -902,6 +1419,50 @@ int main(int argc, char *argv[])
 		return 1;
 	}
 
+	if (!g_index_path.empty())
+	{
+		// Built before the fuse session exists, the scan threads are gone before daemonizing.
+		if (!g_index.Open(*g_volume, g_index_path.c_str()))
+		{
+			if (g_debug & Dbg_Info)
+				std::cout << "Building metadata index " << g_index_path << std::endl;
+			if (MetaIndex::Build(*g_volume, g_index_path.c_str(), std::max(1U, std::thread::hardware_concurrency())))
+				g_index.Open(*g_volume, g_index_path.c_str());
+		}
+
+		if (g_index.IsOpen())
+		{
+			std::vector<omap_res_t> omap;
+
+			g_index.GetOmap(omap);
+			g_volume->omap().SetFlatMap(std::move(omap), g_volume->getXid());
+		}
+		else
+			std::cerr << "Metadata index " << g_index_path << " not usable, continuing without it." << std::endl;
+	}
+
+	if (g_pin)
+	{
+		// The omap last, once the fs tree is pinned it is only needed for other xids.
+		bool rc = g_volume->fstree().Pin();
+
+		if (rc && g_volume->isSealed())
+			rc = g_volume->fexttree().Pin();
+		if (rc)
+			rc = g_volume->omap().tree().Pin();
+
+		if (!rc)
+			std::cerr << "Unable to pin the volume metadata, continuing with the caches." << std::endl;
+		else if (g_debug & Dbg_Info)
+			std::cout << "Pinned " << std::dec << g_volume->fstree().GetPinnedSize() + g_volume->fexttree().GetPinnedSize() + g_volume->omap().tree().GetPinnedSize() << " bytes of metadata." << std::endl;
+	}
+
+	if (!g_prewarm.empty() && !prewarm_parse())
+	{
+		std::cerr << "Invalid prewarm option " << g_prewarm << ", continuing without it." << std::endl;
+		g_prewarm.clear();
+	}
+
 #ifdef USE_FUSE2
 	if ((ch = fuse_mount(mountpoint, &args)) != NULL)
 	{
@@ -914,8 +1475,12 @@ int main(int argc, char *argv[])
 			{
 				if (g_debug == 0)
 					fuse_daemonize(0);
+				hotlist_start();
+				prewarm_start();
 				fuse_session_add_chan(se, ch);
 				err = fuse_session_loop(se);
+				prewarm_stop();
+				hotlist_stop();
 				fuse_remove_signal_handlers(se);
 				fuse_session_remove_chan(ch);
 			}
@@ -933,8 +1498,12 @@ int main(int argc, char *argv[])
 			{
 				if (g_debug == 0)
 					fuse_daemonize(0);
+				hotlist_start();
+				prewarm_start();
 
 				err = fuse_session_loop(se);
+				prewarm_stop();
+				hotlist_stop();
 
 				fuse_session_unmount(se);
 			}
@@ -945,6 +1514,20 @@ int main(int argc, char *argv[])
 #endif
 	fuse_opt_free_args(&args);
 
+	if (g_debug & Dbg_Info)
+	{
+		DecmpfsCache::Stats st = g_decmpfs_cache.GetStats();
+
+		std::cout << std::dec << "Decompression cache: " << st.hits << " hits, " << st.misses << " misses, ";
+		std::cout << st.evictions << " evictions, " << st.entries << " entries, " << st.bytes << " bytes" << std::endl;
+
+		DentryCache::Stats dst = g_dentry_cache.GetStats();
+
+		std::cout << "Dentry cache: " << dst.hits << " hits, " << dst.negative_hits << " negative hits, " << dst.filter_rejects << " filter rejects, ";
+		std::cout << dst.misses << " misses, " << dst.entries << " entries, " << dst.filters << " filters" << std::endl;
+	}
+
+	g_index.Close();
 	delete g_volume;
 	delete g_container;
 	g_disk_main->Close();